@@ -0,0 +1,256 @@
+// loopback benchmark of the UDP relay: a generator sends shadowsocks UDP
+// requests to a server side UDPRelay, which takes the address header off
+// and relays the payload to an echo socket. the echoes come back through
+// the relay, which puts the header back on, to the generator. run once
+// plain and once with udp_offload, the endpoints are the same in both runs:
+// the generator sends with UDP_SEGMENT as a QUIC stack would, the echo and
+// the receiver are plain sockets. datagrams echoed per second are compared
+//   udp_bench [datagrams] [size]
+#include "common.h"
+#include <poll.h>
+
+Log* Log::instance = NULL;
+
+const int kBatch = 64;//datagrams per GSO send, or per recvmmsg
+const int kMaxGsoSize = 65000;//bytes
+const int kHeaderSize = 7;//ATYP, IPv4 address and port
+//bytes sent but not echoed yet, kept under the default socket buffer of
+//the relay so the run measures the relay and not the drops
+const int kWindow = 128 * 1024;
+const int kIdleTimeout = 1000;//millisecond, the run ends
+const int kStopInterval = 100;//millisecond
+
+struct BenchResult
+{
+    int64_t received;
+    int64_t elapsed;//millisecond, first send to the last echo
+};
+
+//stops the relay's loop from its own thread once the run is over
+class LoopStopper : public ITimerNotify
+{
+public:
+    LoopStopper(EventLoop* event_loop, const atomic<bool>* stop):
+        event_loop_(event_loop),
+        stop_(stop),
+        timer_(this)
+    {
+        event_loop_->AddTimer(&timer_, kStopInterval);
+    }
+    virtual void HandleTimeout(Timer* timer) override
+    {
+        if (stop_->load())
+            event_loop_->Stop();
+        else
+            event_loop_->AddTimer(&timer_, kStopInterval);
+    }
+private:
+    EventLoop* event_loop_;
+    const atomic<bool>* stop_;
+    Timer timer_;
+};
+
+static SOCKET Bind(sockaddr_in* addr)
+{
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int size = 8 * 1024 * 1024;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr->sin_addr);
+    bind(s, (sockaddr*)addr, sizeof(*addr));
+    socklen_t len = sizeof(*addr);
+    getsockname(s, (sockaddr*)addr, &len);
+    return s;
+}
+
+static void Relay(int port, bool offload, atomic<bool>* ready, const atomic<bool>* stop)
+{
+    char name[] = "udp_bench";
+    char* argv[] = { name, NULL };
+    Config config(1, argv);
+    config.SetStr("server_address", "127.0.0.1");
+    config.SetInt("server_port", port);
+    config.SetInt("udp_offload", offload ? 1 : 0);
+    //the requests carry IPv4 addresses, nothing is resolved
+    list<string> dns_servers;
+    dns_servers.push_back("127.0.0.1");
+    EventLoop event_loop(&config);
+    DNSResolve dns_resolver(dns_servers);
+    UDPRelay relay(&config, &dns_resolver, NULL, false);
+    if (!relay.Init() || !relay.AddToLoop(&event_loop))
+    {
+        LOGE << "relay initialize failed\n";
+        *ready = true;
+        return;
+    }
+    LoopStopper stopper(&event_loop, stop);
+    *ready = true;
+    event_loop.Run();
+}
+
+static void PrepareBatch(vector<char>* buf, mmsghdr* msgs, iovec* iovs, sockaddr_in* addrs)
+{
+    for (int i = 0; i < kBatch; i++)
+    {
+        iovs[i].iov_base = &(*buf)[i * kBuffSize];
+        iovs[i].iov_len = kBuffSize;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        if (addrs != NULL)
+        {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+//every datagram goes back where it came from, the relay's session socket
+static void Echo(SOCKET s, const atomic<bool>* stop)
+{
+    vector<char> buf(kBatch * kBuffSize);
+    mmsghdr msgs[kBatch];
+    iovec iovs[kBatch];
+    sockaddr_in addrs[kBatch];
+    while (!stop->load())
+    {
+        pollfd pfd = { s, POLLIN, 0 };
+        if (poll(&pfd, 1, kStopInterval) <= 0)
+            continue;
+        PrepareBatch(&buf, msgs, iovs, addrs);
+        int n = recvmmsg(s, msgs, kBatch, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            continue;
+        for (int i = 0; i < n; i++)
+            iovs[i].iov_len = msgs[i].msg_len;
+        sendmmsg(s, msgs, n, 0);
+    }
+}
+
+static void Receive(SOCKET s, int expected, atomic<int64_t>* received)
+{
+    vector<char> buf(kBatch * kBuffSize);
+    mmsghdr msgs[kBatch];
+    iovec iovs[kBatch];
+    while (received->load() < expected)
+    {
+        pollfd pfd = { s, POLLIN, 0 };
+        if (poll(&pfd, 1, kIdleTimeout) <= 0)
+            break;
+        PrepareBatch(&buf, msgs, iovs, NULL);
+        int n = recvmmsg(s, msgs, kBatch, MSG_DONTWAIT, NULL);
+        if (n > 0)
+            *received += n;
+    }
+}
+
+//requests for the echo socket, up to kBatch of them in a GSO send
+static void Generate(SOCKET s, const sockaddr_in& relay, const sockaddr_in& echo, int count, int size,
+                     const atomic<int64_t>* received)
+{
+    int datagram = kHeaderSize + size;
+    int segments = min(kBatch, kMaxGsoSize / datagram);
+    int window = max(kWindow / datagram, segments);
+    vector<char> payload(datagram * segments, 'x');
+    for (int i = 0; i < segments; i++)
+    {
+        char* header = &payload[i * datagram];
+        header[0] = 0x01;
+        memcpy(&header[1], &echo.sin_addr, 4);
+        memcpy(&header[5], &echo.sin_port, 2);
+    }
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    int sent = 0;
+    while (sent < count)
+    {
+        int batch = min(segments, count - sent);
+        int64_t wait = GetMonotonicTime();
+        while (sent - received->load() + batch > window)
+        {
+            //datagrams were dropped, they will never come back
+            if (GetMonotonicTime() - wait > kIdleTimeout)
+                return;
+            this_thread::yield();
+        }
+        iovec iov = { payload.data(), (size_t)(datagram * batch) };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void*)&relay;
+        msg.msg_namelen = sizeof(relay);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (batch > 1)
+        {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = (uint16_t)datagram;
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+        if (sendmsg(s, &msg, 0) < 0)
+        {
+            LOGE << "generator send failed " << GetSocketErrorCode() << "\n";
+            return;
+        }
+        sent += batch;
+    }
+}
+
+static BenchResult Run(int count, int size, bool offload)
+{
+    //a free port for the relay
+    sockaddr_in relay_addr;
+    CloseSocket(Bind(&relay_addr));
+    sockaddr_in echo_addr;
+    sockaddr_in generator_addr;
+    SOCKET echo = Bind(&echo_addr);
+    SOCKET generator = Bind(&generator_addr);
+    atomic<bool> ready(false);
+    atomic<bool> stop(false);
+    atomic<int64_t> received(0);
+    thread relay(Relay, ntohs(relay_addr.sin_port), offload, &ready, &stop);
+    thread echo_thread(Echo, echo, &stop);
+    while (!ready.load())
+        FsSleep(10);
+    thread receiver(Receive, generator, count, &received);
+    int64_t start = GetMonotonicTime();
+    Generate(generator, relay_addr, echo_addr, count, size, &received);
+    receiver.join();
+    BenchResult result = { received.load(), GetMonotonicTime() - start };
+    //a run which lost datagrams ends with the idle timeout
+    if (result.received < count)
+        result.elapsed -= kIdleTimeout;
+    stop = true;
+    relay.join();
+    echo_thread.join();
+    CloseSocket(echo);
+    CloseSocket(generator);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    //the logger is shared by the threads, create it before them
+    Log::GetInstance();
+    int count = argc > 1 ? atoi(argv[1]) : 200000;
+    int size = argc > 2 ? atoi(argv[2]) : 1200;
+    if (count <= 0 || size <= 0 || size > kBuffSize - kHeaderSize)
+    {
+        cout << "usage: udp_bench [datagrams] [size], size up to " << kBuffSize - kHeaderSize << "\n";
+        return 1;
+    }
+    const char* names[] = { "plain", "offload" };
+    for (int i = 0; i < 2; i++)
+    {
+        BenchResult result = Run(count, size, i == 1);
+        double pps = result.elapsed > 0 ? result.received * 1000.0 / result.elapsed : 0;
+        cout << names[i] << ": " << result.received << "/" << count << " datagrams of " << size <<
+             " bytes echoed in " << result.elapsed << " ms, " << (int64_t)pps << " pps\n";
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "common.h"
+#include "buffer_pool.h"
+
+BufferPool::BufferPool():
+    in_use_(0),
+    high_water_(0)
+{
+    for (int i = 0; i < kClasses; i++)
+    {
+        free_[i] = NULL;
+        idle_[i] = 0;
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    for (int i = 0; i < kClasses; i++)
+    {
+        while (free_[i])
+        {
+            FreeNode* node = free_[i];
+            free_[i] = node->next;
+            free(node);
+        }
+    }
+}
+
+int BufferPool::ClassOf(size_t size)
+{
+    for (int i = 0; i < kClasses; i++)
+    {
+        if (size <= (kMinClassSize << i))
+            return i;
+    }
+    return -1;
+}
+
+char* BufferPool::Acquire(size_t size)
+{
+    int cls = ClassOf(size);
+    char* buf = NULL;
+    if (cls >= 0 && free_[cls])
+    {
+        FreeNode* node = free_[cls];
+        free_[cls] = node->next;
+        --idle_[cls];
+        buf = (char*)node;
+    }
+    else
+    {
+        buf = (char*)malloc(cls >= 0 ? (kMinClassSize << cls) : size);
+    }
+    if (++in_use_ > high_water_)
+        high_water_ = in_use_;
+    return buf;
+}
+
+void BufferPool::Release(char * buf, size_t size)
+{
+    if (buf == NULL)
+        return;
+    --in_use_;
+    int cls = ClassOf(size);
+    if (cls < 0 || idle_[cls] >= kMaxIdle)
+    {
+        free(buf);
+        return;
+    }
+    FreeNode* node = (FreeNode*)buf;
+    node->next = free_[cls];
+    free_[cls] = node;
+    ++idle_[cls];
+}
+
+size_t BufferPool::GetInUse()
+{
+    return in_use_;
+}
+
+size_t BufferPool::GetHighWater()
+{
+    return high_water_;
+}
+
+PooledBuffer::PooledBuffer(BufferPool * pool):
+    pool_(pool),
+    data_(NULL),
+    size_(0)
+{
+}
+
+PooledBuffer::~PooledBuffer()
+{
+    if (data_)
+        pool_->Release(data_, size_);
+}
+
+char* PooledBuffer::Acquire(size_t size)
+{
+    if (data_)
+        pool_->Release(data_, size_);
+    data_ = pool_->Acquire(size);
+    size_ = size;
+    return data_;
+}
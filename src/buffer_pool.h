@@ -0,0 +1,51 @@
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+//receive buffers of one event loop in power of two classes, 4KB to 64KB.
+//a released buffer goes on the free list of its class, so steady state
+//relaying doesn't touch the allocator. not thread safe, every worker has
+//its own pool
+class BufferPool
+{
+    const static int kClasses = 5;
+    const static size_t kMinClassSize = 4 * 1024;
+    const static size_t kMaxIdle = 256;//idle buffers kept per class
+    struct FreeNode
+    {
+        FreeNode* next;
+    };
+public:
+    BufferPool();
+    ~BufferPool();
+    //a buffer of at least size bytes, larger than 64KB is allocated directly
+    char* Acquire(size_t size);
+    //size must be the one passed to Acquire
+    void Release(char* buf, size_t size);
+    size_t GetInUse();
+    size_t GetHighWater();
+private:
+    FreeNode* free_[kClasses];
+    size_t idle_[kClasses];
+    size_t in_use_;
+    size_t high_water_;
+
+    static int ClassOf(size_t size);
+};
+
+//a buffer borrowed from a pool for one scope
+class PooledBuffer
+{
+public:
+    PooledBuffer(BufferPool* pool);
+    ~PooledBuffer();
+    char* Acquire(size_t size);
+private:
+    BufferPool* pool_;
+    char* data_;
+    size_t size_;
+
+    PooledBuffer(const PooledBuffer&);
+    PooledBuffer& operator=(const PooledBuffer&);
+};
+
+#endif
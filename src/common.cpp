@@ -2,64 +2,26 @@
 
 bool ParseHeader(vector<char>& data, Sock5Header * header)
 {
-    if (data.size() == 0) return false;
-    char addrtype = data[0];
-    string dest_addr;
-    int dest_port;
-    size_t header_length = 0;
-    if ((addrtype & ADDRTYPE_MASK) == ADDRTYPE_IPV4)
-    {
-        if (data.size() > 7)
-        {
-            char buf[30];
-            if (NULL == inet_ntop(AF_INET, &data[1], buf, 30))
-                return false;
-            dest_addr = buf;
-            dest_port = *(unsigned char*)(&data[5]) * 256 + *(unsigned char*)(&data[6]);
-            header_length = 7;
-        }
-        else
-        {
-            LOGW << "header is too short\n";
-        }
-    }
-    else if ((addrtype & ADDRTYPE_MASK) == ADDRTYPE_HOST)
-    {
-        if (data.size() > 2)
-        {
-            size_t addrlen = data[1];
-            if (data.size() >= 4 + addrlen)
-            {
-                dest_addr = string(&data[2], &data[2 + addrlen]);
-                dest_port = *(unsigned char*)(&data[2 + addrlen]) * 256 + *(unsigned char*)(&data[3 + addrlen]);
-                header_length = 4 + addrlen;
-            }
-        }
-        else
-            LOGW << "header is too short\n";
-    }
-    else if ((addrtype & ADDRTYPE_MASK) == ADDRTYPE_IPV6)
+    if (data.empty()) return false;
+    return ParseHeader(&data[0], data.size(), header);
+}
+
+// a whole header, e.g. of a datagram
+bool ParseHeader(const char* data, size_t len, Sock5Header * header)
+{
+    HeaderParser parser;
+    size_t used = 0;
+    int result = parser.Feed(data, len, &used);
+    if (result != HeaderParser::kParseDone)
     {
-        if (data.size() >= 19)
-        {
-            char buf[30];
-            if (NULL == inet_ntop(AF_INET6, &data[1], buf, 30))
-                return false;
-            dest_addr = buf;
-            dest_port = *(unsigned char*)(&data[17]) * 256 + *(unsigned char*)(&data[18]);
-            header_length = 19;
-        }
-        else
+        if (result == HeaderParser::kParseIncomplete)
             LOGW << "header is too short\n";
-    }
-    else
-        LOGW << "unsupported addrtype %d, maybe wrong password or encryption method" << addrtype<<"\n";
-    if (dest_addr.empty())
         return false;
-    header->addrtype = addrtype;
-    header->header_length = header_length;
-    header->remote_addr = dest_addr;
-    header->remote_port = dest_port;
+    }
+    header->addrtype = parser.GetAddrType();
+    header->header_length = parser.GetHeaderLength();
+    header->remote_addr = parser.GetAddress();
+    header->remote_port = parser.GetPort();
     return true;
 }
 
@@ -81,7 +43,7 @@ string GetIpStr(const struct sockaddr *sa)
 
     default:
         LOGI << "Unknown AF\n";
-        return NULL;
+        return "";
     }
 
     return s;
@@ -115,6 +77,26 @@ bool IsIp(const char* ip)
     return false;
 }
 
+int ToSockAddr(const string& ip, int port, sockaddr_storage* addr)
+{
+    memset(addr, 0, sizeof(sockaddr_storage));
+    sockaddr_in* addr4 = (sockaddr_in*)addr;
+    if (1 == inet_pton(AF_INET, ip.c_str(), &addr4->sin_addr))
+    {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        return sizeof(sockaddr_in);
+    }
+    sockaddr_in6* addr6 = (sockaddr_in6*)addr;
+    if (1 == inet_pton(AF_INET6, ip.c_str(), &addr6->sin6_addr))
+    {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        return sizeof(sockaddr_in6);
+    }
+    return 0;
+}
+
 int SetNoBlocking(SOCKET s)
 {
 #ifdef _WIN32
@@ -151,6 +133,79 @@ int SetReUseAddr(SOCKET s)
 }
 
 
+int SetReUsePort(SOCKET s)
+{
+#ifdef SO_REUSEPORT
+    //every worker binds its own listener on the same port
+    int value = 1;
+    return setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char*)&value, sizeof(value));
+#else
+    return -1;
+#endif
+}
+
+int SetNoDelay(SOCKET s)
+{
+    int value = 1;
+    return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&value, sizeof(value));
+}
+
+int SetZeroCopy(SOCKET s)
+{
+#ifdef SO_ZEROCOPY
+    int value = 1;
+    return setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, (const char*)&value, sizeof(value));
+#else
+    return -1;
+#endif
+}
+
+int SetUdpGro(SOCKET s)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    int value = 1;
+    return setsockopt(s, IPPROTO_UDP, UDP_GRO, (const char*)&value, sizeof(value));
+#endif
+}
+
+int SetFastOpen(SOCKET s, bool listener)
+{
+    if (listener)
+    {
+#ifdef TCP_FASTOPEN
+        //length of the queue of connections not finished the handshake
+        int qlen = 256;
+        return setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&qlen, sizeof(qlen));
+#endif
+    }
+    else
+    {
+#ifdef TCP_FASTOPEN_CONNECT
+        //connect returns at once, the first write carries the data in SYN
+        int value = 1;
+        return setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (const char*)&value, sizeof(value));
+#endif
+    }
+    return -1;
+}
+
+bool IsHandshakeDone(SOCKET s)
+{
+#ifdef TCP_INFO
+    tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return false;
+    //a reset or refused connect is closed, not done
+    return info.tcpi_state != TCP_SYN_SENT && info.tcpi_state != TCP_CLOSE;
+#else
+    //no fast open, writable is connected
+    return true;
+#endif
+}
+
 int BufferSend(SOCKET s, char* buffer, int len)
 {
     int n = -1;
@@ -202,7 +257,7 @@ bool SocketIsBlock(SOCKET s)
     int err = WSAGetLastError();
     blocked = (err == WSAEINPROGRESS || err == WSAEWOULDBLOCK);
 #else
-    blocked = (errno == EINPROGRESS);
+    blocked = (errno == EINPROGRESS || errno == EAGAIN || errno == EWOULDBLOCK);
 #endif
     return blocked;
 }
@@ -225,6 +280,33 @@ int GetSocketErrorCode()
 #endif
 }
 
+int GetSocketPendingError(SOCKET s)
+{
+    int err = 0;
+#ifdef _WIN32
+    int len = sizeof(err);
+#else
+    socklen_t len = sizeof(err);
+#endif
+    if (-1 == getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&err, &len))
+        return GetSocketErrorCode();
+    return err;
+}
+
+int GetReadableSize(SOCKET s)
+{
+#ifdef _WIN32
+    u_long size = 0;
+    if (0 != ioctlsocket(s, FIONREAD, &size))
+        return 0;
+#else
+    int size = 0;
+    if (-1 == ioctl(s, FIONREAD, &size))
+        return 0;
+#endif
+    return (int)size;
+}
+
 void CloseSocket(SOCKET s)
 {
 #ifdef _WIN32
@@ -247,6 +329,18 @@ int64_t GetTimeStamp()
 #endif
 }
 
+//millisecond, not affected by changes of the system time
+int64_t GetMonotonicTime()
+{
+#ifdef _WIN32
+    return (int64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 int GetPeerName(SOCKET s, struct sockaddr *name, int	*namelen)
 {
 #ifdef _WIN32
@@ -256,3 +350,21 @@ int GetPeerName(SOCKET s, struct sockaddr *name, int	*namelen)
 #endif
 }
 
+SOCKET AcceptNoBlocking(SOCKET s, struct sockaddr *addr, int *addrlen)
+{
+#ifdef _WIN32
+    SOCKET new_socket = accept(s, addr, addrlen);
+    if (new_socket != INVALID_SOCKET && -1 == SetNoBlocking(new_socket))
+    {
+        CloseSocket(new_socket);
+        return INVALID_SOCKET;
+    }
+    return new_socket;
+#else
+    socklen_t len = (socklen_t)*addrlen;
+    SOCKET new_socket = accept4(s, addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    *addrlen = (int)len;
+    return new_socket;
+#endif
+}
+
@@ -6,10 +6,13 @@
 #include <set>
 #include <map>
 #include <vector>
+#include <deque>
 #include <cassert>
 #include <string>
 #include <sstream>
 #include <stdint.h>
+#include <thread>
+#include <atomic>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -23,12 +26,22 @@
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <string.h>
 typedef int SOCKET;
 #define INVALID_SOCKET -1
+//older headers lack the UDP offloads of Linux 4.18 and 5.0
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
 #endif
 
 using namespace std;
@@ -37,6 +50,7 @@ using namespace std;
 #include "getopt.h"
 
 
+//first read sizes of a connection, adapted to the traffic from there
 const int kUpStreamBufSize = 16 * 1024;
 const int kDownStreamBufSize = 32 * 1024;
 const int kBuffSize = 16 * 1024;
@@ -48,7 +62,8 @@ enum SOCKET_OP
     kPollOut = 0x04,
     kPollErr = 0x08,
     kPollHup = 0x10,
-    kPollNval = 0x20
+    kPollNval = 0x20,
+    kPollEdge = 0x40 //edge triggered, handler must drain until EAGAIN
 };
 
 
@@ -62,6 +77,21 @@ public:
 
 };
 
+//results of the io_uring completion requests, see EventLoop::StartRecv
+class ICompletionNotify
+{
+public:
+    ICompletionNotify() {};
+    virtual ~ICompletionNotify() {};
+    //a connection accepted on the listener s, non-blocking
+    virtual void HandleAccept(SOCKET s, SOCKET client) {};
+    //data received on s, valid only during the call. 0 is the end of the
+    //stream, a negative len is the error
+    virtual void HandleRecv(SOCKET s, const char* data, int len) {};
+    //a send submitted on s has completed, the bytes sent or the error
+    virtual void HandleSend(SOCKET s, int res) {};
+};
+
 class IPeriodicNotify
 {
 public:
@@ -71,13 +101,65 @@ public:
     virtual void HandlePeriodic() = 0;
 };
 
+//invoke once at the end of the loop iteration it was requested in
+class IFlushNotify
+{
+public:
+    IFlushNotify() {};
+    virtual ~IFlushNotify() {};
+    virtual void HandleFlush() = 0;
+};
+
+class Timer;
+
+class ITimerNotify
+{
+public:
+    ITimerNotify() {};
+    virtual ~ITimerNotify() {};
+    //invoke when timer has expired
+    virtual void HandleTimeout(Timer* timer) = 0;
+};
+
 class IDNSNotify
 {
 public:
     IDNSNotify() {};
     virtual ~IDNSNotify() {};
-    //invoke when dns has resolved
-    virtual void DNSResolved(string hostname, string ip, string err) = 0;
+    //invoke when dns has resolved, ip is the first IPv4 address if any
+    virtual void DNSResolved(string hostname, string ip, string err) {};
+    //invoke with every address of hostname, IPv6 and IPv4 interleaved.
+    //by default one address is passed to DNSResolved
+    virtual void DNSResolvedAll(string hostname, const vector<string>& ips, string err)
+    {
+        string ip = ips.empty() ? "" : ips[0];
+        for (auto& addr : ips)
+        {
+            if (addr.find(':') == string::npos)
+            {
+                ip = addr;
+                break;
+            }
+        }
+        DNSResolved(hostname, ip, err);
+    }
+    //invoke with the token passed to DNSResolve::Resolve, by default it's
+    //ignored. one callback can serve many requests told apart by the token
+    virtual void DNSResolvedToken(uint64_t token, string hostname, const vector<string>& ips, string err)
+    {
+        DNSResolvedAll(hostname, ips, err);
+    }
+};
+
+//invoke when a connection attempt has finished
+class IConnectNotify
+{
+public:
+    IConnectNotify() {};
+    virtual ~IConnectNotify() {};
+    //s is connected and removed from the loop, INVALID_SOCKET if every
+    //address has failed
+    virtual void Connected(SOCKET s) = 0;
 };
 
 
@@ -99,15 +181,38 @@ struct Sock5Header
 };
 
 bool ParseHeader(vector<char>& data, Sock5Header* header);
+bool ParseHeader(const char* data, size_t len, Sock5Header* header);
 
 string GetIpByHostName(const string& host);
 
+string GetIpStr(const struct sockaddr *sa);
+
 bool IsIp(const char* ip);
 
+//fill addr with an IPv4 or IPv6 literal, return the length of addr or 0
+int ToSockAddr(const string& ip, int port, sockaddr_storage* addr);
+
 int SetNoBlocking(SOCKET s);
 
 int SetReUseAddr(SOCKET s);
 
+int SetReUsePort(SOCKET s);
+
+int SetNoDelay(SOCKET s);
+
+//TCP_FASTOPEN on a listener, TCP_FASTOPEN_CONNECT on a socket before connect
+int SetFastOpen(SOCKET s, bool listener);
+
+//the kernel has done the handshake of a connecting socket, by TCP_INFO. a
+//fast open connect returns before it
+bool IsHandshakeDone(SOCKET s);
+
+//SO_ZEROCOPY, so sends may pass MSG_ZEROCOPY
+int SetZeroCopy(SOCKET s);
+
+//UDP_GRO, same-size datagrams of a flow may be received as one
+int SetUdpGro(SOCKET s);
+
 int BufferSend(SOCKET s, char* buffer, int len);
 
 int BufferRecv(SOCKET s, char* buffer, int len);
@@ -118,21 +223,48 @@ void FsSleep(uint32_t ms);
 
 int GetSocketErrorCode();
 
+//SO_ERROR of s, the result of a non-blocking connect
+int GetSocketPendingError(SOCKET s);
+
+//bytes received and not read yet (FIONREAD), 0 if unknown
+int GetReadableSize(SOCKET s);
+
 void CloseSocket(SOCKET s);
 
 int64_t GetTimeStamp();
 
+int64_t GetMonotonicTime();
+
 int BufferSendTo(SOCKET s, char* buffer, int len, const struct sockaddr *to, int tolen);
 
 int BufferRecvFrom(SOCKET s, char* buffer, int len, struct sockaddr *from, int *fromlen);
 
 int GetPeerName(SOCKET s, struct sockaddr *name, int	*namelen);
 
+//accept a connection which is already non-blocking (and close-on-exec)
+SOCKET AcceptNoBlocking(SOCKET s, struct sockaddr *addr, int *addrlen);
+
 #include "config.h"
 #include "lrucache.h"
+#include "object_pool.h"
+#include "timer_wheel.h"
+#include "buffer_pool.h"
 #include "event_loop.h"
+#include "uring_loop.h"
+#include "pipe_pool.h"
+#include "stream_buffer.h"
+#include "packet_buffer.h"
+#include "header_parser.h"
+#include "zerocopy.h"
+#include "datagram_batch.h"
+#include "udp_session.h"
 #include "dns_resolve.h"
+#include "happy_eyeballs.h"
+#include "server_selector.h"
+#include "connection_pool.h"
+#include "mux_tunnel.h"
 #include "tcp_relay.h"
 #include "udp_relay.h"
+#include "worker.h"
 
 #endif
@@ -1,18 +1,22 @@
 #include "common.h"
 #include "config.h"
 
+// getters are called concurrently by the worker threads, so they must never
+// insert into config_
 string Config::GetStr(string key, string val)
 {
-    if (config_.count(key) == 0)
+    auto iter = config_.find(key);
+    if (iter == config_.end())
         return val;
-    return config_[key];
+    return iter->second;
 }
 
 int Config::GetInt(string key, int val)
 {
-    if (config_.count(key) == 0)
+    auto iter = config_.find(key);
+    if (iter == config_.end())
         return val;
-    return atoi(config_[key].c_str());
+    return atoi(iter->second.c_str());
 }
 
 void Config::SetStr(string key, string val)
@@ -38,11 +42,34 @@ Config::Config(int argc, char *argv[])
         { "local-address", required_argument,    0, 1 },
         { "server", no_argument,    0, 1 },
         { "client", no_argument,    0, 1 },
+        { "workers", required_argument,    0, 1 },
+        { "stats-interval", required_argument,    0, 1 },
+        { "edge-triggered", no_argument,    0, 1 },
+        { "io-uring", no_argument,    0, 1 },
+        { "timeout", required_argument,    0, 1 },
+        { "handshake-timeout", required_argument,    0, 1 },
+        { "dns-timeout", required_argument,    0, 1 },
+        { "connect-timeout", required_argument,    0, 1 },
+        { "splice", no_argument,    0, 1 },
+        { "high-watermark", required_argument,    0, 1 },
+        { "low-watermark", required_argument,    0, 1 },
+        { "fast-open", no_argument,    0, 1 },
+        { "no-delay", no_argument,    0, 1 },
+        { "pool-size", required_argument,    0, 1 },
+        { "pool-max-age", required_argument,    0, 1 },
+        { "mux", required_argument,    0, 1 },
+        { "zerocopy", required_argument,    0, 1 },
+        { "min-buffer", required_argument,    0, 1 },
+        { "max-buffer", required_argument,    0, 1 },
+        { "read-hint", no_argument,    0, 1 },
+        { "udp-max-sessions", required_argument,    0, 1 },
+        { "udp-timeout", required_argument,    0, 1 },
+        { "udp-offload", no_argument,    0, 1 },
         { NULL, 0, 0, 0 }
     };
     int option_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "p:l:s:b:", long_options, &option_index)) != -1)
+    while ((opt = getopt_long(argc, argv, "p:l:s:b:t:", long_options, &option_index)) != -1)
     {
         switch (opt)
         {
@@ -58,6 +85,9 @@ Config::Config(int argc, char *argv[])
         case 'b':
             this->SetStr("local_address", optarg);
             break;
+        case 't':
+            this->SetStr("timeout", optarg);
+            break;
         case 1:
             if (strcmp(long_options[option_index].name, "server-port") == 0)
             {
@@ -83,6 +113,98 @@ Config::Config(int argc, char *argv[])
             {
                 this->SetInt("is_local", 1);
             }
+            else if (strcmp(long_options[option_index].name, "workers") == 0)
+            {
+                this->SetStr("workers", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "stats-interval") == 0)
+            {
+                this->SetStr("stats_interval", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "edge-triggered") == 0)
+            {
+                this->SetInt("edge_triggered", 1);
+            }
+            else if (strcmp(long_options[option_index].name, "io-uring") == 0)
+            {
+                this->SetInt("io_uring", 1);
+            }
+            else if (strcmp(long_options[option_index].name, "timeout") == 0)
+            {
+                this->SetStr("timeout", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "handshake-timeout") == 0)
+            {
+                this->SetStr("handshake_timeout", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "dns-timeout") == 0)
+            {
+                this->SetStr("dns_timeout", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "connect-timeout") == 0)
+            {
+                this->SetStr("connect_timeout", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "splice") == 0)
+            {
+                this->SetInt("splice", 1);
+            }
+            else if (strcmp(long_options[option_index].name, "high-watermark") == 0)
+            {
+                this->SetStr("high_watermark", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "low-watermark") == 0)
+            {
+                this->SetStr("low_watermark", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "fast-open") == 0)
+            {
+                this->SetInt("fast_open", 1);
+            }
+            else if (strcmp(long_options[option_index].name, "no-delay") == 0)
+            {
+                this->SetInt("no_delay", 1);
+            }
+            else if (strcmp(long_options[option_index].name, "pool-size") == 0)
+            {
+                this->SetStr("pool_size", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "pool-max-age") == 0)
+            {
+                this->SetStr("pool_max_age", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "mux") == 0)
+            {
+                this->SetStr("mux", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "zerocopy") == 0)
+            {
+                this->SetStr("zerocopy", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "min-buffer") == 0)
+            {
+                this->SetStr("min_buffer", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "max-buffer") == 0)
+            {
+                this->SetStr("max_buffer", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "read-hint") == 0)
+            {
+                this->SetInt("read_hint", 1);
+            }
+            else if (strcmp(long_options[option_index].name, "udp-max-sessions") == 0)
+            {
+                this->SetStr("udp_max_sessions", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "udp-timeout") == 0)
+            {
+                this->SetStr("udp_timeout", optarg);
+            }
+            else if (strcmp(long_options[option_index].name, "udp-offload") == 0)
+            {
+                this->SetInt("udp_offload", 1);
+            }
             break;
         default:
             LOGW << "unknown option <" << (char)opt << ">";
@@ -0,0 +1,206 @@
+#include "common.h"
+#include "connection_pool.h"
+
+//second, below the default handshake timeout of the server
+const int kPoolMaxAge = 20;
+
+ConnectionPool::ConnectionPool(Config * config, EventLoop * event_loop, DNSResolve * dns_resolver,
+                               ServerSelector * selector, int size):
+    config_(config),
+    event_loop_(event_loop),
+    dns_resolver_(dns_resolver),
+    selector_(selector),
+    size_(size),
+    is_closed_(false),
+    ip_index_(0),
+    resolving_(false),
+    age_timer_(this),
+    retry_timer_(this)
+{
+    max_age_ = config_->GetInt("pool_max_age", kPoolMaxAge) * 1000;
+    no_delay_ = config_->GetInt("no_delay") == 1;
+    server_index_ = selector_->Select(0, &server_address_, &server_port_);
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    Close();
+}
+
+void ConnectionPool::Start()
+{
+    LOGI << "connection pool of " << size_ << " to " << server_address_ << ":" << server_port_ << "\n";
+    Fill();
+}
+
+void ConnectionPool::Fill()
+{
+    if (is_closed_ || resolving_ || retry_timer_.IsActive())
+        return;
+    if (ip_index_ >= server_ips_.size())
+    {
+        //may be called back at once for an ip or a cached host
+        server_index_ = selector_->Select(0, &server_address_, &server_port_);
+        resolving_ = true;
+        dns_resolver_->Resolve(server_address_, this);
+        return;
+    }
+    while ((int)(connecting_.size() + idle_.size()) < size_)
+    {
+        if (!Connect())
+        {
+            event_loop_->AddTimer(&retry_timer_, kRetryDelay);
+            break;
+        }
+    }
+}
+
+bool ConnectionPool::Connect()
+{
+    sockaddr_storage addr;
+    int addr_len = ToSockAddr(server_ips_[ip_index_], server_port_, &addr);
+    if (addr_len <= 0)
+    {
+        ++ip_index_;
+        return false;
+    }
+    SOCKET s = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+        return false;
+    SetNoBlocking(s);
+    if (no_delay_)
+        SetNoDelay(s);
+    if (-1 == connect(s, (sockaddr*)&addr, addr_len) && !SocketIsBlock(s))
+    {
+        LOGW << "pool connect failed " << GetSocketErrorCode() << "\n";
+        CloseSocket(s);
+        return false;
+    }
+    PendingConnection pending = { event_loop_->Now(), ip_index_ };
+    connecting_[s] = pending;
+    event_loop_->Add(s, kPollOut | kPollErr, this);
+    return true;
+}
+
+void ConnectionPool::Drop(SOCKET s)
+{
+    event_loop_->Remove(s);
+    CloseSocket(s);
+}
+
+void ConnectionPool::ArmAgeTimer()
+{
+    if (idle_.empty())
+        age_timer_.Cancel();
+    else if (!age_timer_.IsActive())
+        event_loop_->AddTimer(&age_timer_, idle_.front().created + max_age_ - event_loop_->Now());
+}
+
+SOCKET ConnectionPool::Claim()
+{
+    SOCKET s = INVALID_SOCKET;
+    int64_t now = event_loop_->Now();
+    while (!idle_.empty() && s == INVALID_SOCKET)
+    {
+        //the newest one has the longest time left before the server drops it
+        IdleConnection conn = idle_.back();
+        idle_.pop_back();
+        if (now - conn.created >= max_age_)
+        {
+            Drop(conn.s);
+            continue;
+        }
+        event_loop_->Remove(conn.s);
+        s = conn.s;
+    }
+    ArmAgeTimer();
+    Fill();
+    return s;
+}
+
+void ConnectionPool::HandleEvent(SOCKET s, int event)
+{
+    auto connecting = connecting_.find(s);
+    if (connecting != connecting_.end())
+    {
+        PendingConnection pending = connecting->second;
+        connecting_.erase(connecting);
+        if ((event & kPollErr) || GetSocketPendingError(s) != 0)
+        {
+            LOGW << "pool connect failed " << GetSocketPendingError(s) << "\n";
+            selector_->ReportFailure(server_index_);
+            Drop(s);
+            //try the next address, once none is left resolve again as
+            //the addresses may have changed. the other connections to the
+            //same address fail alike and move on only once
+            if (pending.ip_index == ip_index_)
+                ++ip_index_;
+            event_loop_->AddTimer(&retry_timer_, kRetryDelay);
+            return;
+        }
+        selector_->ReportSuccess(server_index_, event_loop_->Now() - pending.started);
+        IdleConnection conn = { s, event_loop_->Now() };
+        idle_.push_back(conn);
+        //only a close (or unexpected data) from the server is expected now
+        event_loop_->Modify(s, kPollIn | kPollErr);
+        ArmAgeTimer();
+        return;
+    }
+    for (auto iter = idle_.begin(); iter != idle_.end(); ++iter)
+    {
+        if (iter->s == s)
+        {
+            idle_.erase(iter);
+            Drop(s);
+            break;
+        }
+    }
+    ArmAgeTimer();
+    Fill();
+}
+
+void ConnectionPool::DNSResolvedAll(string hostname, const vector<string>& ips, string err)
+{
+    resolving_ = false;
+    if (!err.empty() || ips.empty())
+    {
+        LOGW << "pool resolve " << hostname << " failed " << err << "\n";
+        selector_->ReportFailure(server_index_);
+        event_loop_->AddTimer(&retry_timer_, kRetryDelay);
+        return;
+    }
+    server_ips_ = ips;
+    ip_index_ = 0;
+    Fill();
+}
+
+void ConnectionPool::HandleTimeout(Timer * timer)
+{
+    if (timer == &age_timer_)
+    {
+        int64_t now = event_loop_->Now();
+        while (!idle_.empty() && now - idle_.front().created >= max_age_)
+        {
+            Drop(idle_.front().s);
+            idle_.pop_front();
+        }
+        ArmAgeTimer();
+    }
+    Fill();
+}
+
+void ConnectionPool::Close()
+{
+    if (is_closed_)
+        return;
+    is_closed_ = true;
+    age_timer_.Cancel();
+    retry_timer_.Cancel();
+    dns_resolver_->RemoveCallback(this);
+    for (auto& conn : connecting_)
+        Drop(conn.first);
+    connecting_.clear();
+    for (auto& conn : idle_)
+        Drop(conn.s);
+    idle_.clear();
+}
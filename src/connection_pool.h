@@ -0,0 +1,62 @@
+#ifndef _CONNECTION_POOL_H_
+#define _CONNECTION_POOL_H_
+
+//connections from the client to the server established ahead of time, so a
+//new request skips the TCP handshake. the pool is refilled as soon as a
+//connection is claimed, and a connection idle longer than the max age is
+//closed (and replaced) before the server's handshake timeout closes it. the
+//server is picked by the selector whenever the address is resolved again.
+//connections go to one address of the server, a failed connect moves on to
+//the next one and the server is resolved again when none is left
+class ConnectionPool : public ISockNotify, public IDNSNotify, public ITimerNotify
+{
+    const static int kRetryDelay = 1000;//millisecond after a failed connect
+    struct IdleConnection
+    {
+        SOCKET s;
+        int64_t created;
+    };
+    struct PendingConnection
+    {
+        int64_t started;
+        size_t ip_index;
+    };
+public:
+    ConnectionPool(Config* config, EventLoop* event_loop, DNSResolve* dns_resolver,
+                   ServerSelector* selector, int size);
+    ~ConnectionPool();
+    void Start();
+    //an established connection removed from the loop, INVALID_SOCKET if
+    //none is idle
+    SOCKET Claim();
+    void Close();
+    virtual void HandleEvent(SOCKET s, int event) override;
+    virtual void DNSResolvedAll(string hostname, const vector<string>& ips, string err) override;
+    virtual void HandleTimeout(Timer* timer) override;
+private:
+    Config* config_;
+    EventLoop* event_loop_;
+    DNSResolve* dns_resolver_;
+    ServerSelector* selector_;
+    int size_;
+    int64_t max_age_;//millisecond
+    bool no_delay_;
+    bool is_closed_;
+    int server_index_;
+    string server_address_;
+    int server_port_;
+    vector<string> server_ips_;//IPv6 and IPv4, as the resolver ordered them
+    size_t ip_index_;//the address connected to, the next one after a failure
+    bool resolving_;
+    map<SOCKET, PendingConnection> connecting_;
+    deque<IdleConnection> idle_;//oldest first
+    Timer age_timer_;
+    Timer retry_timer_;
+
+    void Fill();
+    bool Connect();
+    void Drop(SOCKET s);
+    void ArmAgeTimer();
+};
+
+#endif
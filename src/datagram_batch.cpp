@@ -0,0 +1,304 @@
+#include "common.h"
+#include "datagram_batch.h"
+
+DatagramBatch::DatagramBatch():
+    storage_(NULL),
+    used_(0),
+    queued_(0),
+    gso_(false),
+    gro_(false),
+    gro_buffers_(NULL)
+{
+    Allocate(kBatchSize);
+}
+
+DatagramBatch::~DatagramBatch()
+{
+    delete[] storage_;
+    delete[] gro_buffers_;
+}
+
+void DatagramBatch::Allocate(int count)
+{
+    delete[] storage_;
+    storage_ = new char[kSlotSize * count];
+    packets_.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        packets_[i].buffer.Reset(storage_ + kSlotSize * i, kSlotSize, kHeadroom);
+        packets_[i].addr_len = 0;
+        packets_[i].s = INVALID_SOCKET;
+    }
+    used_ = 0;
+    queued_ = 0;
+}
+
+void DatagramBatch::SetOffload(bool gso, bool gro)
+{
+#ifndef _WIN32
+    gso_ = gso;
+    if (gro && !gro_)
+    {
+        //every segment of the coalesced datagrams takes a slot
+        gro_buffers_ = new char[kGroBufferSize * kGroBuffers];
+        Allocate(kMaxPackets);
+    }
+    gro_ = gro;
+#endif
+}
+
+int DatagramBatch::Receive(SOCKET s, int* first)
+{
+    int free = (int)packets_.size() - used_;
+    if (free < (gro_ ? kMaxSegments : 1))
+        Flush();
+    *first = used_;
+#ifdef _WIN32
+    Packet& packet = packets_[used_];
+    packet.buffer.Reset(storage_ + kSlotSize * used_, kSlotSize, kHeadroom);
+    packet.s = INVALID_SOCKET;
+    packet.addr_len = sizeof(packet.addr);
+    int n = BufferRecvFrom(s, packet.buffer.Tail(), kBuffSize, (sockaddr*)&packet.addr, &packet.addr_len);
+    if (n < 0)
+        return -1;
+    packet.buffer.Put(n);
+    used_++;
+    return 1;
+#else
+    if (gro_)
+        return ReceiveGro(s);
+    int count = min((int)kBatchSize, (int)packets_.size() - used_);
+    mmsghdr msgs[kBatchSize];
+    iovec iovs[kBatchSize];
+    for (int i = 0; i < count; i++)
+    {
+        int slot = used_ + i;
+        Packet& packet = packets_[slot];
+        packet.buffer.Reset(storage_ + kSlotSize * slot, kSlotSize, kHeadroom);
+        packet.s = INVALID_SOCKET;
+        iovs[i].iov_base = packet.buffer.Tail();
+        iovs[i].iov_len = kBuffSize;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_name = &packet.addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(packet.addr);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(s, msgs, count, MSG_DONTWAIT, NULL);
+    if (n < 0)
+        return -1;
+    for (int i = 0; i < n; i++)
+    {
+        Packet& packet = packets_[used_ + i];
+        packet.buffer.Put(msgs[i].msg_len);
+        packet.addr_len = msgs[i].msg_hdr.msg_namelen;
+    }
+    used_ += n;
+    return n;
+#endif
+}
+
+#ifndef _WIN32
+int DatagramBatch::ReceiveGro(SOCKET s)
+{
+    int count = min((int)kGroBuffers, ((int)packets_.size() - used_) / kMaxSegments);
+    mmsghdr msgs[kGroBuffers];
+    iovec iovs[kGroBuffers];
+    sockaddr_storage addrs[kGroBuffers];
+    char controls[kGroBuffers][CMSG_SPACE(sizeof(int))];
+    for (int i = 0; i < count; i++)
+    {
+        iovs[i].iov_base = gro_buffers_ + kGroBufferSize * i;
+        iovs[i].iov_len = kGroBufferSize;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+    int n = recvmmsg(s, msgs, count, MSG_DONTWAIT, NULL);
+    if (n < 0)
+        return -1;
+    int received = 0;
+    for (int i = 0; i < n; i++)
+    {
+        const char* data = (const char*)iovs[i].iov_base;
+        size_t len = msgs[i].msg_len;
+        //the size of every segment but the last, a datagram not coalesced
+        //has no UDP_GRO message
+        size_t segment = len;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+        {
+            if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                int gso_size = 0;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                if (gso_size > 0)
+                    segment = gso_size;
+            }
+        }
+        for (size_t offset = 0; offset < len; offset += segment)
+        {
+            size_t size = min(segment, len - offset);
+            //larger than a slot, as a recv into one would have truncated it
+            if (size > (size_t)kBuffSize)
+                continue;
+            Packet& packet = packets_[used_];
+            packet.buffer.Reset(storage_ + kSlotSize * used_, kSlotSize, kHeadroom);
+            memcpy(packet.buffer.Put(size), data + offset, size);
+            memcpy(&packet.addr, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+            packet.addr_len = msgs[i].msg_hdr.msg_namelen;
+            packet.s = INVALID_SOCKET;
+            used_++;
+            received++;
+        }
+    }
+    return received;
+}
+#endif
+
+DatagramBatch::Packet* DatagramBatch::Get(int index)
+{
+    return &packets_[index];
+}
+
+void DatagramBatch::Queue(int index, SOCKET s, const sockaddr* addr, int addr_len)
+{
+    Packet& packet = packets_[index];
+    memcpy(&packet.addr, addr, addr_len);
+    packet.addr_len = addr_len;
+    packet.s = s;
+    queued_++;
+}
+
+bool DatagramBatch::Empty()
+{
+    return queued_ == 0;
+}
+
+void DatagramBatch::Flush()
+{
+    for (int i = 0; i < used_ && queued_ > 0; i++)
+    {
+        if (packets_[i].s != INVALID_SOCKET)
+            Send(packets_[i].s, i);
+    }
+    used_ = 0;
+    queued_ = 0;
+}
+
+void DatagramBatch::Flush(SOCKET s)
+{
+    if (queued_ > 0)
+        Send(s, 0);
+}
+
+void DatagramBatch::Send(SOCKET s, int from)
+{
+#ifdef _WIN32
+    for (int i = from; i < used_; i++)
+    {
+        Packet& packet = packets_[i];
+        if (packet.s != s)
+            continue;
+        BufferSendTo(s, packet.buffer.Data(), (int)packet.buffer.Length(), (sockaddr*)&packet.addr, packet.addr_len);
+        packet.s = INVALID_SOCKET;
+        queued_--;
+    }
+#else
+    //the packets of s in the order they were queued, a message each, or with
+    //GSO a message for a run of them to one address where only the last
+    //may be shorter than the first
+    mmsghdr msgs[kMaxPackets];
+    iovec iovs[kMaxPackets];
+    char controls[kMaxPackets][CMSG_SPACE(sizeof(uint16_t))];
+    int count = 0;
+    int packets = 0;
+    msghdr* run = NULL;
+    size_t run_size = 0;
+    bool run_closed = false;
+    for (int i = from; i < used_; i++)
+    {
+        Packet& packet = packets_[i];
+        if (packet.s != s)
+            continue;
+        size_t len = packet.buffer.Length();
+        iovs[packets].iov_base = packet.buffer.Data();
+        iovs[packets].iov_len = len;
+        if (gso_ && run && !run_closed && len <= run->msg_iov[0].iov_len &&
+            (int)run->msg_iovlen < kMaxSegments && run_size + len <= kMaxGsoSize &&
+            (int)run->msg_namelen == packet.addr_len && memcmp(run->msg_name, &packet.addr, packet.addr_len) == 0)
+        {
+            run->msg_iovlen++;
+            run_size += len;
+            run_closed = len < run->msg_iov[0].iov_len;
+        }
+        else
+        {
+            run = &msgs[count++].msg_hdr;
+            memset(run, 0, sizeof(*run));
+            run->msg_name = &packet.addr;
+            run->msg_namelen = packet.addr_len;
+            run->msg_iov = &iovs[packets];
+            run->msg_iovlen = 1;
+            run_size = len;
+            run_closed = false;
+        }
+        packet.s = INVALID_SOCKET;
+        packets++;
+    }
+    queued_ -= packets;
+    for (int i = 0; i < count; i++)
+    {
+        msghdr& msg = msgs[i].msg_hdr;
+        if (msg.msg_iovlen < 2)
+            continue;
+        msg.msg_control = controls[i];
+        msg.msg_controllen = sizeof(controls[i]);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment = (uint16_t)msg.msg_iov[0].iov_len;
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    }
+    int sent = 0;
+    while (sent < count)
+    {
+        int n = sendmmsg(s, msgs + sent, count - sent, MSG_DONTWAIT);
+        if (n < 0)
+        {
+            //a full send buffer drops the rest, as sendto would
+            if (SocketIsBlock(s))
+                break;
+            if (msgs[sent].msg_hdr.msg_iovlen > 1)
+            {
+                LOGW << "UDP GSO failed " << GetSocketErrorCode() << ", turned off\n";
+                gso_ = false;
+                SendEach(s, msgs[sent].msg_hdr);
+            }
+            else
+            {
+                //skip the datagram which failed
+                LOGW << "UDP sendmmsg failed " << GetSocketErrorCode() << "\n";
+            }
+            n = 1;
+        }
+        sent += n;
+    }
+#endif
+}
+
+#ifndef _WIN32
+void DatagramBatch::SendEach(SOCKET s, const msghdr& msg)
+{
+    for (size_t i = 0; i < msg.msg_iovlen; i++)
+    {
+        BufferSendTo(s, (char*)msg.msg_iov[i].iov_base, (int)msg.msg_iov[i].iov_len,
+                     (const sockaddr*)msg.msg_name, msg.msg_namelen);
+    }
+}
+#endif
@@ -0,0 +1,66 @@
+#ifndef _DATAGRAM_BATCH_H_
+#define _DATAGRAM_BATCH_H_
+
+//datagrams received a batch per recvmmsg into preallocated slots. a packet
+//queued for sending is sent from its own slot by Flush, a sendmmsg for all
+//the packets of one socket, so relaying a datagram copies nothing. slots
+//are reused once the queue has been flushed.
+//with GRO a coalesced datagram is split into a slot per segment, so every
+//datagram keeps its own headers. with GSO the queued packets of a socket to
+//one address and of one size go out as a single UDP_SEGMENT send
+class DatagramBatch
+{
+public:
+    const static int kBatchSize = 32;//datagrams
+    const static size_t kHeadroom = 16;//room to push a header in place
+    const static size_t kTailroom = 16;//room to put a trailer in place
+    const static size_t kSlotSize = kHeadroom + kBuffSize + kTailroom;
+    const static int kMaxSegments = 64;//of a GRO or GSO datagram
+    const static int kGroBuffers = 2;//coalesced datagrams per recvmmsg
+    const static size_t kGroBufferSize = 65536;
+    const static int kMaxPackets = kGroBuffers * kMaxSegments;
+    const static size_t kMaxGsoSize = 65000;//bytes of a GSO send
+    struct Packet
+    {
+        PacketBuffer buffer;
+        sockaddr_storage addr;//source when received, destination when queued
+        int addr_len;
+        SOCKET s;//the socket to send with, INVALID_SOCKET if not queued
+    };
+    DatagramBatch();
+    ~DatagramBatch();
+    //before the first Receive, the sockets received must have UDP_GRO set
+    //for gro. GSO is turned off if the kernel refuses it
+    void SetOffload(bool gso, bool gro);
+    //receive into the free slots, the queue is flushed first if there are
+    //none. the packets are [*first, *first + count), -1 on error
+    int Receive(SOCKET s, int* first);
+    Packet* Get(int index);
+    //send the packet with s to addr on the next Flush
+    void Queue(int index, SOCKET s, const sockaddr* addr, int addr_len);
+    bool Empty();
+    void Flush();
+    //send the packets queued for s only, before s is closed
+    void Flush(SOCKET s);
+private:
+    char* storage_;
+    vector<Packet> packets_;
+    int used_;//slots received into since the last flush
+    int queued_;
+    bool gso_;
+    bool gro_;
+    char* gro_buffers_;
+
+    void Allocate(int count);
+#ifndef _WIN32
+    int ReceiveGro(SOCKET s);
+    //the segments of a GSO send one by one
+    void SendEach(SOCKET s, const msghdr& msg);
+#endif
+    void Send(SOCKET s, int from);
+
+    DatagramBatch(const DatagramBatch&);
+    DatagramBatch& operator=(const DatagramBatch&);
+};
+
+#endif
@@ -1,11 +1,12 @@
 #include "common.h"
 #include "dns_resolve.h"
 #include <fstream>
+#include <algorithm>
 
 #define kDnsPacketMaxSize (sizeof(DNSHeader) + kMaxDownmainNameLen + kDnsTypeSize + kDnsClassSzie)
 const int kCacheSweepInterval = 30;
 
-DNSResolve::DNSResolve(list<string>& servers): dns_cache_(300)
+DNSResolve::DNSResolve(list<string>& servers): dns_cache_(300), delay_timer_(this)
 {
     dns_packet_ = new char[kDnsPacketMaxSize];
     this->event_loop_ = NULL;
@@ -56,7 +57,9 @@ void DNSResolve::ParseHosts()
         {
             hostname.push_back(*p++);
         }
-        hosts_[hostname] = ip;
+        vector<string>& ips = hosts_[hostname];
+        if (find(ips.begin(), ips.end(), ip) == ips.end())
+            ips.push_back(ip);
     }
     fhost.close();
 }
@@ -173,6 +176,7 @@ bool DNSResolve::DecodeDotStr(
 bool DNSResolve::ParseResponse(
     char* recv_data,
     string& hostname,
+    uint16_t& query_type,
     vector<string>& ip_result,
     vector<string>& cname_result)
 {
@@ -183,25 +187,33 @@ bool DNSResolve::ParseResponse(
     uint16_t question_count = 0;
     uint16_t answer_count = 0;
 
-    if ((ntohs(dns_header->flags) & 0xfb7f) == 0x8100 //RFC1035 4.1.1(Header section format)
-            && (question_count = ntohs(dns_header->question_count)) >= 0
-            && (answer_count = ntohs(dns_header->answer_count)) > 0)
+    if (!(ntohs(dns_header->flags) & 0x8000))
     {
-        char *dns_data = recv_data + sizeof(DNSHeader);
+        //not a response
+        return false;
+    }
+    question_count = ntohs(dns_header->question_count);
+    answer_count = ntohs(dns_header->answer_count);
+    char *dns_data = recv_data + sizeof(DNSHeader);
 
-        //resolve Question fields
-        for (int question_index = 0; question_index != question_count; ++question_index)
+    //resolve Question fields, an answer without address still ends the query
+    for (int question_index = 0; question_index != question_count; ++question_index)
+    {
+        if (!DecodeDotStr(dns_data, &encoded_name_len, dot_name, sizeof(dot_name)))
         {
-            if (!DecodeDotStr(dns_data, &encoded_name_len, dot_name, sizeof(dot_name)))
-            {
-                return false;
-            }
-            if (hostname.empty() && strlen(dot_name) > 0)
-            {
-                hostname = dot_name;
-            }
-            dns_data += (encoded_name_len + kDnsTypeSize + kDnsClassSzie);
+            return false;
+        }
+        if (hostname.empty() && strlen(dot_name) > 0)
+        {
+            hostname = dot_name;
+            query_type = ntohs(*(uint16_t*)(dns_data + encoded_name_len));
         }
+        dns_data += (encoded_name_len + kDnsTypeSize + kDnsClassSzie);
+    }
+
+    if ((ntohs(dns_header->flags) & 0xfb7f) == 0x8100 //RFC1035 4.1.1(Header section format)
+            && answer_count > 0)
+    {
 
         //resolve Answer fields
         for (int answer_index = 0; answer_index != answer_count; ++answer_index)
@@ -218,14 +230,22 @@ bool DNSResolve::ParseResponse(
             uint16_t answer_data_len = ntohs(*(uint16_t*)(dns_data + kDnsTypeSize + kDnsClassSzie + kDnsTtlSize));
             dns_data += (kDnsTypeSize + kDnsClassSzie + kDnsTtlSize + kDnsDatalenSize);
 
-            if (answer_type == kDnsTypeA)
+            if (answer_type == kDnsTypeA && answer_data_len == 4)
             {
                 in_addr addr;
-                addr.s_addr = *(u_long*)dns_data;
+                memcpy(&addr, dns_data, 4);
                 char ip_str[16];
                 inet_ntop(AF_INET, &addr, ip_str, 16);
                 ip_result.push_back(ip_str);
             }
+            else if (answer_type == kDnsTypeAAAA && answer_data_len == 16)
+            {
+                in6_addr addr;
+                memcpy(&addr, dns_data, 16);
+                char ip_str[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, &addr, ip_str, INET6_ADDRSTRLEN);
+                ip_result.push_back(ip_str);
+            }
             else if (answer_type == kDnsTypeCname)
             {
                 if (!DecodeDotStr(dns_data, &encoded_name_len, dot_name, sizeof(dot_name), recv_data))
@@ -245,77 +265,127 @@ int DNSResolve::HandleData(char* recv_data)
     vector<string> ip_result;
     vector<string> cname_result;
     string hostname;
-    if (!ParseResponse(recv_data, hostname, ip_result, cname_result))
+    uint16_t query_type = kDnsTypeA;
+    if (!ParseResponse(recv_data, hostname, query_type, ip_result, cname_result))
     {
         return -1;
     }
-    string ip = "";
-    if (ip_result.size() > 0)
+    auto iter = pending_.find(hostname);
+    if (iter == pending_.end())
     {
-        ip = ip_result[0];
+        //late answer, or nobody is waiting anymore
+        return 0;
     }
-    if (!ip.empty())
+    PendingQuery& query = iter->second;
+    int flag = query_type == kDnsTypeAAAA ? kQueryAAAA : kQueryA;
+    if (!(query.waiting & flag))
     {
-        dns_cache_[hostname] = ip;
-        CallCallback(hostname, ip);
+        //answered by another server already
+        return 0;
     }
+    query.waiting &= ~flag;
+    if (flag == kQueryAAAA)
+        query.ipv6 = ip_result;
     else
+        query.ipv4 = ip_result;
+    if (query.waiting == 0)
     {
-        if (hostname_status_.count(hostname) > 0 &&
-                hostname_status_[hostname] == kHostStatusFirst)
-        {
-            //send again
-            hostname_status_[hostname] = kHostStatusSecond;
-            SendRequest(hostname, kDnsTypeAAAA);
-        }
-        else
+        Finish(hostname);
+    }
+    else if (!ip_result.empty() && !query.delayed)
+    {
+        //give the other family a moment before connecting without it
+        query.delayed = true;
+        delayed_.push_back(make_pair(event_loop_->Now() + kResolutionDelay, hostname));
+        if (!delay_timer_.IsActive())
+            event_loop_->AddTimer(&delay_timer_, kResolutionDelay);
+    }
+    return 0;
+}
+
+void DNSResolve::Finish(const string& hostname)
+{
+    PendingQuery query = pending_[hostname];
+    pending_.erase(hostname);
+    //interleave the families, IPv6 first (RFC 8305)
+    vector<string> ips;
+    for (size_t i = 0; i < max(query.ipv4.size(), query.ipv6.size()); i++)
+    {
+        if (i < query.ipv6.size())
+            ips.push_back(query.ipv6[i]);
+        if (i < query.ipv4.size())
+            ips.push_back(query.ipv4[i]);
+    }
+    if (!ips.empty())
+    {
+        dns_cache_[hostname] = ips;
+    }
+    CallCallback(hostname, ips);
+}
+
+void DNSResolve::HandleTimeout(Timer* timer)
+{
+    int64_t now = event_loop_->Now();
+    while (!delayed_.empty() && delayed_.front().first <= now)
+    {
+        string hostname = delayed_.front().second;
+        delayed_.pop_front();
+        auto iter = pending_.find(hostname);
+        if (iter != pending_.end() && iter->second.delayed)
         {
-            CallCallback(hostname, "");
+            Finish(hostname);
         }
     }
-    return 0;
+    if (!delayed_.empty())
+    {
+        event_loop_->AddTimer(&delay_timer_, delayed_.front().first - now);
+    }
 }
 
-void DNSResolve::RemoveCallback(IDNSNotify* callback)
+void DNSResolve::RemoveCallback(IDNSNotify* callback, uint64_t token)
 {
-    if (cb_to_hostname_.count(callback) == 0)
+    DNSCallback key(callback, token);
+    if (cb_to_hostname_.count(key) == 0)
     {
         return;
     }
-    string hostname = cb_to_hostname_[callback];
+    string hostname = cb_to_hostname_[key];
 
     auto range_callbacks = hostname_to_cb_.equal_range(hostname);
     while (range_callbacks.first != range_callbacks.second)
     {
-        if (range_callbacks.first->second == callback)
+        if (range_callbacks.first->second == key)
         {
-            hostname_to_cb_.erase(range_callbacks.first);
+            range_callbacks.first = hostname_to_cb_.erase(range_callbacks.first);
+        }
+        else
+        {
+            ++range_callbacks.first;
         }
-        ++range_callbacks.first;
     }
     if (hostname_to_cb_.count(hostname) == 0)
     {
-        hostname_status_.erase(hostname);
+        pending_.erase(hostname);
     }
-    cb_to_hostname_.erase(callback);
+    cb_to_hostname_.erase(key);
 }
 
-void DNSResolve::CallCallback(string hostname, string ip)
+void DNSResolve::CallCallback(string hostname, const vector<string>& ips)
 {
+    //detach the callbacks first, a callback may resolve again
+    vector<DNSCallback> callbacks;
     auto cb_range = hostname_to_cb_.equal_range(hostname);
-    if (cb_range.first == cb_range.second)
-        return;
     while (cb_range.first != cb_range.second)
     {
-        if (cb_to_hostname_.count(cb_range.first->second) > 0)
-        {
-            cb_to_hostname_.erase(cb_range.first->second);
-        }
-        cb_range.first->second->DNSResolved(hostname, ip, "");
+        cb_to_hostname_.erase(cb_range.first->second);
+        callbacks.push_back(cb_range.first->second);
         ++cb_range.first;
     }
     hostname_to_cb_.erase(hostname);
-    hostname_status_.erase(hostname);
+    for (auto& callback : callbacks)
+    {
+        callback.first->DNSResolvedToken(callback.second, hostname, ips, "");
+    }
 }
 
 void DNSResolve::SendRequest(const string& hostname, DNS_TYPE type)
@@ -333,7 +403,7 @@ void DNSResolve::SendRequest(const string& hostname, DNS_TYPE type)
     dns_header->additional_count = 0x0000;
 
     //set dns request packet
-    uint16_t qtype = htons(0x0001);
+    uint16_t qtype = htons(type);
     uint16_t qclass = htons(0x0001);
     size_t domain_name_len = hostname.length();
     char *encode_domain_name = new char[domain_name_len + 2];
@@ -418,6 +488,7 @@ void DNSResolve::Close()
 {
     LOGI << "DNSResolve close\n";
     is_closed_ = true;
+    delay_timer_.Cancel();
     if (event_loop_)
     {
         event_loop_->Remove(dns_socket_);
@@ -425,43 +496,44 @@ void DNSResolve::Close()
     CloseSocket(dns_socket_);
 }
 
-void DNSResolve::Resolve(const string& hostname, IDNSNotify* callback)
+void DNSResolve::Resolve(const string& hostname, IDNSNotify* callback, uint64_t token)
 {
+    vector<string> ips;
     if (hostname.empty())
     {
-        callback->DNSResolved(hostname, hostname, "hostname is empty!");
+        callback->DNSResolvedToken(token, hostname, ips, "hostname is empty!");
     }
     else if (IsIp(hostname.c_str()))
     {
-        callback->DNSResolved(hostname, hostname, "");
+        ips.push_back(hostname);
+        callback->DNSResolvedToken(token, hostname, ips, "");
     }
     else if (dns_cache_.Count(hostname) > 0)
     {
         LOGI << "hit cached\n";
-        callback->DNSResolved(hostname, dns_cache_[hostname], "");
+        ips = dns_cache_[hostname];
+        callback->DNSResolvedToken(token, hostname, ips, "");
     }
     else if (hosts_.count(hostname) > 0)
     {
         LOGI << "hit hosts\n";
-        callback->DNSResolved(hostname, hosts_[hostname], "");
+        ips = hosts_[hostname];
+        callback->DNSResolvedToken(token, hostname, ips, "");
     }
     else
     {
-        if (hostname_to_cb_.find(hostname) != hostname_to_cb_.end())
+        DNSCallback key(callback, token);
+        hostname_to_cb_.insert(make_pair(hostname, key));
+        assert(cb_to_hostname_.count(key) == 0);
+        cb_to_hostname_[key] = hostname;
+        if (pending_.count(hostname) == 0)
         {
-            hostname_to_cb_.insert(make_pair(hostname, callback));
-            assert(cb_to_hostname_.count(callback) == 0);
-            cb_to_hostname_[callback] = hostname;
-            SendRequest(hostname, kDnsTypeA);
-        }
-        else
-        {
-            hostname_status_[hostname] = kHostStatusFirst;
-            hostname_to_cb_.insert(make_pair(hostname, callback));
-            assert(cb_to_hostname_.count(callback) == 0);
-            cb_to_hostname_[callback] = hostname;
+            //both families at once, the answers are merged
+            PendingQuery& query = pending_[hostname];
+            query.waiting = kQueryA | kQueryAAAA;
+            query.delayed = false;
             SendRequest(hostname, kDnsTypeA);
+            SendRequest(hostname, kDnsTypeAAAA);
         }
     }
 }
-
@@ -3,18 +3,28 @@
 
 
 //dns resolveget host from dns server
-class DNSResolve : public ISockNotify
+class DNSResolve : public ISockNotify, public ITimerNotify
 {
     enum DNS_TYPE
     {
         kDnsTypeA = 0x0001, //1 a host address
         kDnsTypeAAAA = 28 //28 a host address
     };
-    enum HOSTSTATUS
+    enum QUERY_FLAG
     {
-        kHostStatusFirst,//first resolve
-        kHostStatusSecond,//second resolve
+        kQueryA = 0x01,
+        kQueryAAAA = 0x02
     };
+    //A and AAAA are queried together, the callbacks are called once both
+    //have answered, or a moment after the first address has arrived
+    struct PendingQuery
+    {
+        int waiting;//QUERY_FLAG of the queries not answered yet
+        bool delayed;
+        vector<string> ipv4;
+        vector<string> ipv6;
+    };
+    const static int kResolutionDelay = 50;//millisecond, RFC 8305
     struct DNSHeader
     {
         uint16_t trans_id;
@@ -37,13 +47,16 @@ public:
 
     int AddToLoop(EventLoop* event_loop);
 
-    void RemoveCallback(IDNSNotify * callback);
+    void RemoveCallback(IDNSNotify * callback, uint64_t token = 0);
 
     virtual void HandleEvent(SOCKET s, int event) override;
 
+    virtual void HandleTimeout(Timer* timer) override;
+
     void Close();
 
-    void Resolve(const string & hostname, IDNSNotify * pNotify);
+    //the token is passed back to IDNSNotify::DNSResolvedToken
+    void Resolve(const string & hostname, IDNSNotify * pNotify, uint64_t token = 0);
 
 private:
     bool is_local_;
@@ -53,12 +66,15 @@ private:
     int listen_port_;
     SOCKET dns_socket_;
     time_t last_time_;
-    map<string, string> hosts_;//hosts file rules
-    map<IDNSNotify*, string> cb_to_hostname_;//callback to hostname
-    multimap<string, IDNSNotify*> hostname_to_cb_;//hostname to callback
-    LRUCache<string, string> dns_cache_;
+    map<string, vector<string> > hosts_;//hosts file rules
+    typedef pair<IDNSNotify*, uint64_t> DNSCallback;//callback and token
+    map<DNSCallback, string> cb_to_hostname_;//callback to hostname
+    multimap<string, DNSCallback> hostname_to_cb_;//hostname to callback
+    LRUCache<string, vector<string> > dns_cache_;
     list<sockaddr_in> servers_;//4 bytes dns server list(ipv4)
-    map<string, int> hostname_status_;//current hostname resolve status
+    map<string, PendingQuery> pending_;//hostnames being resolved
+    deque<pair<int64_t, string> > delayed_;//end of the resolution delay
+    Timer delay_timer_;
     char* dns_packet_;
 
     void ParseHosts();
@@ -67,11 +83,13 @@ private:
 
     bool DecodeDotStr(char * encoded_str, uint16_t * encoded_str_len, char * dot_str, uint16_t dot_str_size, char * packet_start_pos = NULL);
 
-    bool ParseResponse(char * recv_data, string & hostname, vector<string>& ip_result, vector<string>& cname_result);
+    bool ParseResponse(char * recv_data, string & hostname, uint16_t & query_type, vector<string>& ip_result, vector<string>& cname_result);
 
     int HandleData(char * recv_data);
 
-    void CallCallback(string hostname, string ip);
+    void Finish(const string & hostname);
+
+    void CallCallback(string hostname, const vector<string>& ips);
 
     void SendRequest(const string & hostname, DNS_TYPE type);
 
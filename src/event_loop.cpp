@@ -2,6 +2,7 @@
 #include "event_loop.h"
 #include "tcp_relay.h"
 
+//second
 const int kTimeoutPrecision = 10;
 
 struct win_fd_set
@@ -17,8 +18,9 @@ SelectLoop::SelectLoop()
 
 }
 
-int SelectLoop::Poll(map<SOCKET, int>& result, int timeout)
+int SelectLoop::Poll(EventLoop* loop, int timeout)
 {
+    map<SOCKET, int> result;
     win_fd_set* r_fds = (win_fd_set*)malloc(FD_SET_ALLOC_SIZE(r_sock_set_.size()));
     win_fd_set* w_fds = (win_fd_set*)malloc(FD_SET_ALLOC_SIZE(w_sock_set_.size()));
     win_fd_set* x_fds = (win_fd_set*)malloc(FD_SET_ALLOC_SIZE(x_sock_set_.size()));
@@ -43,8 +45,8 @@ int SelectLoop::Poll(map<SOCKET, int>& result, int timeout)
     x_fds->fd_count = count;
 
     timeval tv;
-    tv.tv_sec = timeout;
-    tv.tv_usec = 0;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
     do
     {
         if (r_fds->fd_count == 0 && w_fds->fd_count == 0 && x_fds->fd_count == 0)
@@ -75,11 +77,18 @@ int SelectLoop::Poll(map<SOCKET, int>& result, int timeout)
     free(r_fds);
     free(w_fds);
     free(x_fds);
+    for (auto& iter : result)
+    {
+        auto tag = tags_.find(iter.first);
+        if (tag != tags_.end())
+            loop->Dispatch(tag->second, iter.second);
+    }
     return ret;
 }
 
-void SelectLoop::Register(SOCKET s, int mode)
+void SelectLoop::Register(SOCKET s, int mode, uint64_t tag)
 {
+    tags_[s] = tag;
     if (mode & kPollIn)
         r_sock_set_.insert(s);
     if (mode & kPollOut)
@@ -102,12 +111,17 @@ void SelectLoop::UnRegister(SOCKET s)
     {
         x_sock_set_.erase(s);
     }
+    tags_.erase(s);
 }
 
 void SelectLoop::Modify(SOCKET s, int mode)
 {
+    auto tag = tags_.find(s);
+    if (tag == tags_.end())
+        return;
+    uint64_t value = tag->second;
     UnRegister(s);
-    Register(s, mode);
+    Register(s, mode, value);
 }
 
 void SelectLoop::Close()
@@ -115,38 +129,193 @@ void SelectLoop::Close()
 
 }
 
-EventLoop::EventLoop()
+#ifndef _WIN32
+static uint32_t ToEpollEvents(int mode)
+{
+    uint32_t events = 0;
+    if (mode & kPollIn)
+        events |= EPOLLIN;
+    if (mode & kPollOut)
+        events |= EPOLLOUT;
+    if (mode & kPollEdge)
+        events |= EPOLLET;
+    return events;
+}
+
+const int EpollLoop::kUnregistered;
+
+EpollLoop::EpollLoop()
+{
+    epfd_ = epoll_create(kMaxEpollSize);
+}
+
+int EpollLoop::Poll(EventLoop* loop, int timeout)
+{
+    if (timeout < 0)
+    {
+        timeout = 1000;
+    }
+    Commit();
+    int nfds = epoll_wait(epfd_, events, kEpollSize, timeout);
+    if (-1 == nfds)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < nfds; ++i)
+    {
+        int mode = 0;
+        if (events[i].events & EPOLLIN)
+            mode |= kPollIn;
+        if (events[i].events & EPOLLOUT)
+            mode |= kPollOut;
+        if (events[i].events & EPOLLERR)
+            mode |= kPollErr;
+        if (events[i].events & EPOLLHUP)
+            mode |= kPollHup;
+        loop->Dispatch(events[i].data.u64, mode);
+    }
+    return 0;
+}
+
+void EpollLoop::Register(SOCKET s, int mode, uint64_t tag)
+{
+    if ((size_t)s >= interest_.size())
+    {
+        interest_.resize(s + 1, kUnregistered);
+        wanted_.resize(s + 1, kUnregistered);
+        tags_.resize(s + 1, 0);
+    }
+    epoll_event ev;
+    ev.events = ToEpollEvents(mode);
+    ev.data.u64 = tag;
+    if (0 == epoll_ctl(epfd_, EPOLL_CTL_ADD, s, &ev))
+    {
+        interest_[s] = mode;
+        wanted_[s] = mode;
+        tags_[s] = tag;
+    }
+    else
+    {
+        LOGW << "epoll_ctl add " << s << " failed " << GetSocketErrorCode() << "\n";
+    }
+}
+
+void EpollLoop::UnRegister(SOCKET s)
+{
+    if ((size_t)s >= interest_.size() || interest_[s] == kUnregistered)
+        return;
+    //not deferred, the fd is usually closed right after
+    epoll_event ev;
+    ev.events = 0;
+    ev.data.u64 = 0;
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, s, &ev);
+    interest_[s] = kUnregistered;
+    wanted_[s] = kUnregistered;
+}
+
+void EpollLoop::Modify(SOCKET s, int mode)
+{
+    if ((size_t)s >= interest_.size() || interest_[s] == kUnregistered)
+    {
+        return;
+    }
+    if (wanted_[s] == interest_[s] && mode != interest_[s])
+        dirty_.push_back(s);
+    wanted_[s] = mode;
+}
+
+void EpollLoop::Commit()
+{
+    for (auto& s : dirty_)
+    {
+        if (interest_[s] == kUnregistered || interest_[s] == wanted_[s])
+            continue;
+        epoll_event ev;
+        ev.events = ToEpollEvents(wanted_[s]);
+        ev.data.u64 = tags_[s];
+        epoll_ctl(epfd_, EPOLL_CTL_MOD, s, &ev);
+        interest_[s] = wanted_[s];
+    }
+    dirty_.clear();
+}
+
+void EpollLoop::Close()
+{
+    close(epfd_);
+}
+#endif
+
+EventLoop::EventLoop(Config* config)
 {
+    loop_impl_ = NULL;
+#ifdef HAVE_IO_URING
+    if (config && config->GetInt("io_uring") == 1)
+    {
+        UringLoop* uring = new UringLoop();
+        if (uring->Init())
+        {
+            loop_impl_ = uring;
+            LOGI << "EventLoop use io_uring\n";
+        }
+        else
+        {
+            LOGW << "io_uring is not available, fall back to epoll\n";
+            delete uring;
+        }
+    }
+#endif
+    if (loop_impl_ == NULL)
+    {
 #ifdef _WIN32
-    loop_impl_ = new SelectLoop();
+        loop_impl_ = new SelectLoop();
 #else
-    loop_impl_ = new EpollLoop();
+        loop_impl_ = new EpollLoop();
 #endif
+    }
     stopping_ = false;
-    last_time_ = GetTimeStamp();
+    next_gen_ = 0;
+    now_stale_ = false;
+    now_ = GetMonotonicTime();
+    last_time_ = now_;
     LOGI << "EventLoop initialize completed\n";
 }
 
 EventLoop::~EventLoop()
 {
     if (this->loop_impl_)
+    {
         this->loop_impl_->Close();
+        delete this->loop_impl_;
+    }
 }
 
-int EventLoop::Poll(map<SOCKET, int>& result, int timeout)
+int EventLoop::Poll(int timeout)
 {
-    return loop_impl_->Poll(result, timeout);
+    return loop_impl_->Poll(this, timeout);
 }
 
 void EventLoop::Add(SOCKET s, int mode, ISockNotify * handler)
 {
-    socket_handler_[s] = handler;
-    loop_impl_->Register(s, mode);
+    if ((size_t)s >= handlers_.size())
+    {
+        HandlerSlot empty = { NULL, NULL, 0 };
+        handlers_.resize(s + 1, empty);
+    }
+    HandlerSlot& slot = handlers_[s];
+    slot.handler = handler;
+    slot.completion = NULL;
+    slot.gen = ++next_gen_;
+    loop_impl_->Register(s, mode, MakeSocketTag(s, slot.gen));
 }
 
 void EventLoop::Remove(SOCKET s)
 {
-    socket_handler_.erase(s);
+    if ((size_t)s >= handlers_.size() || handlers_[s].handler == NULL)
+        return;
+    //the generation changes, events already polled for s are dropped
+    handlers_[s].handler = NULL;
+    handlers_[s].completion = NULL;
+    handlers_[s].gen = ++next_gen_;
     loop_impl_->UnRegister(s);
 }
 
@@ -155,6 +324,115 @@ void EventLoop::Modify(SOCKET s, int mode)
     loop_impl_->Modify(s, mode);
 }
 
+// an edge triggered handler which stopped before EAGAIN won't get another
+// notification from the kernel, so it posts the event to the next iteration
+void EventLoop::Repost(SOCKET s, int mode)
+{
+    if ((size_t)s >= handlers_.size() || handlers_[s].handler == NULL)
+        return;
+    reposted_.push_back(make_pair(MakeSocketTag(s, handlers_[s].gen), mode));
+}
+
+EventLoop::HandlerSlot* EventLoop::FindSlot(uint64_t tag)
+{
+    size_t s = (uint32_t)tag;
+    if (stopping_ || s >= handlers_.size())
+        return NULL;
+    HandlerSlot& slot = handlers_[s];
+    if (slot.handler == NULL || slot.gen != (uint32_t)(tag >> 32))
+        return NULL;
+    if (now_stale_)
+    {
+        //first event after a poll which may have slept
+        now_ = GetMonotonicTime();
+        now_stale_ = false;
+    }
+    return &slot;
+}
+
+void EventLoop::Dispatch(uint64_t tag, int mode)
+{
+    HandlerSlot* slot = FindSlot(tag);
+    if (slot != NULL)
+        slot->handler->HandleEvent((SOCKET)(uint32_t)tag, mode);
+}
+
+bool EventLoop::StartAccept(SOCKET s, ICompletionNotify* notify)
+{
+    if ((size_t)s >= handlers_.size() || handlers_[s].handler == NULL || !loop_impl_->StartAccept(s))
+        return false;
+    handlers_[s].completion = notify;
+    return true;
+}
+
+bool EventLoop::StartRecv(SOCKET s, ICompletionNotify* notify)
+{
+    if ((size_t)s >= handlers_.size() || handlers_[s].handler == NULL || !loop_impl_->StartRecv(s))
+        return false;
+    handlers_[s].completion = notify;
+    return true;
+}
+
+#ifndef _WIN32
+int EventLoop::SubmitSend(SOCKET s, const iovec* iov, int count)
+{
+    if ((size_t)s >= handlers_.size() || handlers_[s].completion == NULL)
+        return 0;
+    return loop_impl_->SubmitSend(s, iov, count);
+}
+#endif
+
+void EventLoop::CancelIo(SOCKET s)
+{
+    loop_impl_->CancelIo(s);
+}
+
+void EventLoop::DispatchAccept(uint64_t tag, SOCKET client)
+{
+    HandlerSlot* slot = FindSlot(tag);
+    //nobody takes the connection any more
+    if (slot == NULL || slot->completion == NULL)
+    {
+        CloseSocket(client);
+        return;
+    }
+    slot->completion->HandleAccept((SOCKET)(uint32_t)tag, client);
+}
+
+void EventLoop::DispatchRecv(uint64_t tag, const char* data, int len)
+{
+    HandlerSlot* slot = FindSlot(tag);
+    if (slot != NULL && slot->completion != NULL)
+        slot->completion->HandleRecv((SOCKET)(uint32_t)tag, data, len);
+}
+
+void EventLoop::DispatchSend(uint64_t tag, int res)
+{
+    HandlerSlot* slot = FindSlot(tag);
+    if (slot != NULL && slot->completion != NULL)
+        slot->completion->HandleSend((SOCKET)(uint32_t)tag, res);
+}
+
+void EventLoop::AddTimer(Timer * timer, int64_t timeout)
+{
+    timer_wheel_.Add(timer, timeout, now_);
+}
+
+void EventLoop::RemoveTimer(Timer * timer)
+{
+    timer_wheel_.Remove(timer);
+}
+
+int64_t EventLoop::Now()
+{
+    return now_;
+}
+
+BufferPool* EventLoop::GetBufferPool()
+{
+    return &buffer_pool_;
+}
+
 void EventLoop::Stop()
 {
     stopping_ = true;
@@ -162,29 +440,50 @@ void EventLoop::Stop()
 
 void EventLoop::Run()
 {
-    map<SOCKET, int> events;
+    vector<pair<uint64_t, int> > reposted;
+    vector<IFlushNotify*> flushes;
     while (!stopping_)
     {
-        events.clear();
-        int ret = Poll(events, kTimeoutPrecision);
+        //sleep until the next timer or periodic callback is due
+        now_ = GetMonotonicTime();
+        int64_t timeout = kTimeoutPrecision * 1000 - (now_ - last_time_);
+        int64_t next_timer = timer_wheel_.NextTimeout(now_);
+        if (next_timer >= 0 && next_timer < timeout)
+            timeout = next_timer;
+        if (timeout < 0 || !reposted_.empty())
+            timeout = 0;
+        reposted.clear();
+        reposted.swap(reposted_);
+        //events are dispatched by the backend straight from its event array
+        now_stale_ = true;
+        int ret = Poll((int)timeout);
+        now_stale_ = false;
         if (ret == -1)
         {
             LOGE << "Poll error\n";
             break;
         }
-        if (GetTimeStamp() - last_time_ >= kTimeoutPrecision * 1000)
+        now_ = GetMonotonicTime();
+        for (auto& iter : reposted)
+            Dispatch(iter.first, iter.second);
+        if (now_ - last_time_ >= kTimeoutPrecision * 1000)
         {
             for (auto& cb : periodic_callbacks_)
                 cb->HandlePeriodic();
-            last_time_ = GetTimeStamp();
+            last_time_ = now_;
+        }
+        //handlers have run, so a timer refreshed by an event won't fire
+        if (!stopping_)
+        {
+            now_ = GetMonotonicTime();
+            timer_wheel_.Advance(now_);
         }
-        for (auto& iter : events)
+        while (!flushes_.empty())
         {
-            if (!stopping_ && socket_handler_.count(iter.first) > 0)
-            {
-                if (socket_handler_[iter.first] != NULL)
-                    socket_handler_[iter.first]->HandleEvent(iter.first, iter.second);
-            }
+            flushes.clear();
+            flushes.swap(flushes_);
+            for (auto cb : flushes)
+                cb->HandleFlush();
         }
     }
 }
@@ -199,3 +498,25 @@ void EventLoop::RemovePeriodic(IPeriodicNotify* cb)
     periodic_callbacks_.erase(cb);
 }
 
+void EventLoop::AddFlush(IFlushNotify* cb)
+{
+    for (auto flush : flushes_)
+    {
+        if (flush == cb)
+            return;
+    }
+    flushes_.push_back(cb);
+}
+
+void EventLoop::RemoveFlush(IFlushNotify* cb)
+{
+    for (auto iter = flushes_.begin(); iter != flushes_.end(); ++iter)
+    {
+        if (*iter == cb)
+        {
+            flushes_.erase(iter);
+            return;
+        }
+    }
+}
+
@@ -1,18 +1,51 @@
 #ifndef _EVENT_LOOP_H_
 #define _EVENT_LOOP_H_
 
+class EventLoop;
+
+//tag identifies a registration of a socket, the generation changes
+//every time the socket is added to the loop, so an event polled for a
+//socket which has been removed (and maybe reused) is dropped
+inline uint64_t MakeSocketTag(SOCKET s, uint32_t gen)
+{
+    return ((uint64_t)gen << 32) | (uint32_t)s;
+}
+
+//poll backend used by EventLoop
+class ILoopImpl
+{
+public:
+    ILoopImpl() {};
+    virtual ~ILoopImpl() {};
+    //timeout is millisecond, events are passed to EventLoop::Dispatch
+    virtual int Poll(EventLoop* loop, int timeout) = 0;
+    virtual void Register(SOCKET s, int mode, uint64_t tag) = 0;
+    virtual void UnRegister(SOCKET s) = 0;
+    virtual void Modify(SOCKET s, int mode) = 0;
+    virtual void Close() = 0;
+    //completion requests, only io_uring has them. kPollIn of an accept or
+    //recv socket arms the request instead of a poll
+    virtual bool StartAccept(SOCKET s) { return false; }
+    virtual bool StartRecv(SOCKET s) { return false; }
+#ifndef _WIN32
+    virtual int SubmitSend(SOCKET s, const iovec* iov, int count) { return 0; }
+#endif
+    virtual void CancelIo(SOCKET s) {}
+};
+
 //select mode
-class SelectLoop
+class SelectLoop : public ILoopImpl
 {
 public:
     SelectLoop();
     ~SelectLoop() {};
-    int Poll(map<SOCKET, int>& result, int timeout);
-    void Register(SOCKET s, int mode);
-    void UnRegister(SOCKET s);
-    void Modify(SOCKET s, int mode);
-    void Close();
+    virtual int Poll(EventLoop* loop, int timeout) override;
+    virtual void Register(SOCKET s, int mode, uint64_t tag) override;
+    virtual void UnRegister(SOCKET s) override;
+    virtual void Modify(SOCKET s, int mode) override;
+    virtual void Close() override;
 private:
+    map<SOCKET, uint64_t> tags_;
     set<SOCKET> r_sock_set_;
     set<SOCKET> w_sock_set_;
     set<SOCKET> x_sock_set_;
@@ -20,89 +53,31 @@ private:
 
 #ifndef _WIN32
 //epoll mode
-class EpollLoop
+//interest changes are cached per fd and committed once per iteration before
+//epoll_wait, a change back to the registered mask costs nothing and a real
+//change is a single EPOLL_CTL_MOD
+class EpollLoop : public ILoopImpl
 {
     const static int kEpollSize = 1024;
     const static int kMaxEpollSize = 102400;
+    const static int kUnregistered = -1;
 public:
-    EpollLoop()
-    {
-        epfd_ = epoll_create(kMaxEpollSize);
-    }
+    EpollLoop();
     ~EpollLoop() {}
-    int Poll(map<SOCKET, int>& result, int timeout)
-    {
-        if (timeout < 0)
-        {
-            timeout = 1000;
-        }
-        int ret = 0;
-        do
-        {
-            int nfds = epoll_wait(epfd_, events, kEpollSize, timeout);
-            if (-1 == nfds)
-            {
-                ret = -1;
-                break;
-            }
-            for (int i = 0; i < nfds; ++i)
-            {
-                int mode = 0;
-                if (events[i].events & EPOLLIN)
-                    mode |= kPollIn;
-                if (events[i].events & EPOLLOUT)
-                    mode |= kPollOut;
-                result[events[i].data.fd] = mode;
-            }
-        }
-        while (0);
-        return ret;
-    }
-    void Register(SOCKET s, int mode)
-    {
-        sock_mode_[s] = mode;
-        epoll_event ev;
-        ev.events = 0;
-        ev.data.fd = s;
-        if (mode & kPollIn)
-        {
-            ev.events |= EPOLLIN;
-        }
-        if (mode & kPollOut)
-        {
-            ev.events |= EPOLLOUT;
-        }
-        epoll_ctl(epfd_, EPOLL_CTL_ADD, s, &ev);
-    }
-    void UnRegister(SOCKET s)
-    {
-        int mode = sock_mode_[s];
-        epoll_event ev;
-        ev.events = 0;
-        ev.data.fd = s;
-        if (mode & kPollIn)
-        {
-            ev.events |= EPOLLIN;
-        }
-        if (mode & kPollOut)
-        {
-            ev.events |= EPOLLOUT;
-        }
-        epoll_ctl(epfd_, EPOLL_CTL_DEL, s, &ev);
-    }
-    void Modify(SOCKET s, int mode)
-    {
-        UnRegister(s);
-        Register(s, mode);
-    }
-    void Close()
-    {
-        close(epfd_);
-    }
+    virtual int Poll(EventLoop* loop, int timeout) override;
+    virtual void Register(SOCKET s, int mode, uint64_t tag) override;
+    virtual void UnRegister(SOCKET s) override;
+    virtual void Modify(SOCKET s, int mode) override;
+    virtual void Close() override;
 private:
     int epfd_;
-    map<SOCKET, int> sock_mode_;
+    vector<int> interest_;//mask registered in epoll, indexed by fd
+    vector<int> wanted_;//mask requested by the handlers, indexed by fd
+    vector<uint64_t> tags_;//epoll_event.data, indexed by fd
+    vector<SOCKET> dirty_;
     epoll_event events[kEpollSize];
+
+    void Commit();
 };
 
 #endif
@@ -110,29 +85,73 @@ private:
 //event loop,
 class EventLoop
 {
-    typedef map<SOCKET, ISockNotify*> SocketHandleMap;
+    struct HandlerSlot
+    {
+        ISockNotify* handler;
+        ICompletionNotify* completion;
+        uint32_t gen;
+    };
 public:
-    EventLoop();
+    EventLoop(Config* config = NULL);
     ~EventLoop();
     void Run();
     void AddPeriodic(IPeriodicNotify * cb);
     void RemovePeriodic(IPeriodicNotify * cb);
+    //cb is called once after the events of this iteration, for work batched
+    //across events such as datagrams to send
+    void AddFlush(IFlushNotify* cb);
+    void RemoveFlush(IFlushNotify* cb);
     void Remove(SOCKET s);
     void Add(SOCKET s, int mode, ISockNotify* handler);
     void Modify(SOCKET s, int mode);
+    void Repost(SOCKET s, int mode);
+    //called by the backend for every polled event
+    void Dispatch(uint64_t tag, int mode);
+    //io_uring completions instead of readiness, false if the backend has
+    //none and s stays on readiness. s must have been added, while its mode
+    //has kPollIn the listener accepts and the socket receives, the results
+    //go to notify
+    bool StartAccept(SOCKET s, ICompletionNotify* notify);
+    bool StartRecv(SOCKET s, ICompletionNotify* notify);
+#ifndef _WIN32
+    //send the buffers in order by linked requests, notify of s gets a
+    //HandleSend for each of the requests returned. the data must be kept
+    //until the last one
+    int SubmitSend(SOCKET s, const iovec* iov, int count);
+#endif
+    //cancel the requests of s and stop polling it, the completions of the
+    //sends still come
+    void CancelIo(SOCKET s);
+    //called by the backend for the completions
+    void DispatchAccept(uint64_t tag, SOCKET client);
+    void DispatchRecv(uint64_t tag, const char* data, int len);
+    void DispatchSend(uint64_t tag, int res);
+    //timeout is millisecond
+    void AddTimer(Timer* timer, int64_t timeout);
+    void RemoveTimer(Timer* timer);
+    //monotonic millisecond, cached once per iteration
+    int64_t Now();
+    //receive buffers shared by everything running on this loop
+    BufferPool* GetBufferPool();
+    //may be called from another thread, Run returns after the current poll
     void Stop();
 private:
-    int Poll(map<SOCKET, int>& result, int timeout = 1);
+    int Poll(int timeout = 1);
+    //the slot of a live tag, NULL if the socket has been removed since
+    HandlerSlot* FindSlot(uint64_t tag);
 
-#ifdef _WIN32
-    SelectLoop* loop_impl_;
-#else
-    EpollLoop* loop_impl_;
-#endif
-    SocketHandleMap socket_handler_;
+    ILoopImpl* loop_impl_;
+    vector<HandlerSlot> handlers_;//indexed by socket
+    uint32_t next_gen_;
     set<IPeriodicNotify*> periodic_callbacks_;
+    vector<pair<uint64_t, int> > reposted_;
+    vector<IFlushNotify*> flushes_;
+    TimerWheel timer_wheel_;
+    BufferPool buffer_pool_;
+    int64_t now_;
+    bool now_stale_;
     int64_t last_time_;
-    bool stopping_;
+    atomic<bool> stopping_;
 };
 
 #endif
\ No newline at end of file
@@ -4,6 +4,8 @@ Log* Log::instance = NULL;
 
 int main(int argc, char *argv[])
 {
+    //the logger is shared by the worker threads, create it before them
+    Log::GetInstance();
 #ifdef _WIN32
     int err = 0;
     WSADATA wsaData;
@@ -17,34 +19,79 @@ int main(int argc, char *argv[])
     //		   --server --server-port 8881 --server-address 0.0.0.0
     //client --client -p 8881 -l 1081 -s 127.0.0.1 -b 127.0.0.1
     //		   --client --server-port 8881 --server-address 127.0.0.1 --local-port 1081 --local-address 127.0.0.1
+    //multi core --workers 4 --stats-interval 60
     //parse command line
     Config* config = new Config(argc, argv);
     bool is_local = config->GetInt("is_local") == 1;
+    int worker_count = config->GetInt("workers", 1);
+    int stats_interval = config->GetInt("stats_interval", 0);
+#ifndef SO_REUSEPORT
+    if (worker_count > 1)
+    {
+        LOGW << "SO_REUSEPORT is not supported, run with one worker\n";
+        worker_count = 1;
+    }
+#endif
+    if (worker_count < 1)
+        worker_count = 1;
+    config->SetInt("workers", worker_count);
 
-    list<string> dns_servers;
-    dns_servers.push_back("114.114.114.114");
-    DNSResolve* dns_resolver = NULL;
-
-    EventLoop* event_loop = NULL;
-    TCPRelay* tcp_server = NULL;
-    UDPRelay* udp_server = NULL;
+    vector<Worker*> workers;
     try
     {
-        event_loop = new EventLoop();
-        dns_resolver = new DNSResolve(dns_servers);
-        tcp_server = new TCPRelay(config, dns_resolver, is_local);
-        udp_server = new UDPRelay(config, dns_resolver, is_local);
-        dns_resolver->AddToLoop(event_loop);
-        if (tcp_server->Init() && udp_server->Init())
+        bool init_ok = true;
+        for (int i = 0; i < worker_count && init_ok; i++)
+        {
+            Worker* worker = new Worker(config, i, is_local);
+            workers.push_back(worker);
+            init_ok = worker->Init();
+        }
+        if (init_ok)
         {
             if (is_local)
                 LOGI << "listen " << config->GetStr("local_address") << ":" << config->GetStr("local_port") <<
-                     " forward to " << config->GetStr("server_address") << ":" << config->GetStr("server_port") << "\n";
+                     " forward to " << config->GetStr("server_address") << ":" << config->GetStr("server_port") <<
+                     " with " << worker_count << " workers\n";
             else
-                LOGI << "listen " << config->GetStr("server_address") << ":" << config->GetStr("server_port") << "\n";
-            tcp_server->AddToLoop(event_loop);
-            udp_server->AddToLoop(event_loop);
-            event_loop->Run();
+                LOGI << "listen " << config->GetStr("server_address") << ":" << config->GetStr("server_port") <<
+                     " with " << worker_count << " workers\n";
+            for (auto& worker : workers)
+                worker->Start();
+            //the main thread only waits for workers and reports stats. a
+            //worker whose loop has failed accepts no more, but its listener
+            //still gets its share of the connections, so all of them exit
+            int64_t last_report = GetTimeStamp();
+            size_t running = workers.size();
+            while (running == workers.size())
+            {
+                FsSleep(200);
+                running = 0;
+                for (auto& worker : workers)
+                {
+                    if (worker->IsRunning())
+                        ++running;
+                }
+                if (stats_interval > 0 && GetTimeStamp() - last_report >= stats_interval * 1000)
+                {
+                    WorkerStats stats;
+                    for (auto& worker : workers)
+                        worker->GetStats(&stats);
+                    //reads by size, "<=4K:n <=8K:n ... >256K:n"
+                    stringstream reads;
+                    for (int i = 0; i < ReadSizer::kBuckets; i++)
+                    {
+                        size_t kb = (ReadSizer::kMinBucketSize << min(i, ReadSizer::kBuckets - 2)) / 1024;
+                        reads << (i < ReadSizer::kBuckets - 1 ? " <=" : " >") << kb << "K:" << stats.reads[i];
+                    }
+                    LOGI << "stats: workers " << running << "/" << workers.size() <<
+                         " tcp accepted " << stats.tcp_accepted << " active " << stats.tcp_active <<
+                         " buffers in use " << stats.buffers_in_use << " high water " << stats.buffers_high_water <<
+                         " reads" << reads.str() <<
+                         " udp sessions " << stats.udp_sessions << " created " << stats.udp_created <<
+                         " evicted " << stats.udp_evicted << "\n";
+                    last_report = GetTimeStamp();
+                }
+            }
         }
         LOGE << "error occurred, exit...\n";
     }
@@ -52,27 +99,14 @@ int main(int argc, char *argv[])
     {
         LOGE << "exception occurred, exit...\n";
     }
-    if (tcp_server)
-    {
-        tcp_server->Close();
-        delete tcp_server;
-        tcp_server = NULL;
-    }
-    if (udp_server)
-    {
-        delete udp_server;
-        udp_server = NULL;
-    }
-    if (dns_resolver)
+    for (auto& worker : workers)
     {
-        dns_resolver->Close();
-        delete dns_resolver;
-        dns_resolver = NULL;
+        worker->Stop();
     }
-    if (event_loop)
+    for (auto& worker : workers)
     {
-        delete event_loop;
-        event_loop = NULL;
+        delete worker;
     }
+    workers.clear();
     return 0;
 }
@@ -0,0 +1,215 @@
+#include "common.h"
+#include "happy_eyeballs.h"
+#include <algorithm>
+
+// second, history of an address not used for this long is dropped
+const int kLatencyCacheTimeout = 600;
+
+AddressLatency::AddressLatency():
+    latency_(kLatencyCacheTimeout),
+    last_sweep_(GetMonotonicTime())
+{
+}
+
+void AddressLatency::Record(const string& ip, int64_t latency)
+{
+    if (latency_.Count(ip) > 0)
+    {
+        int64_t& smoothed = latency_[ip];
+        smoothed = (smoothed * 3 + latency) / 4;
+    }
+    else
+    {
+        latency_[ip] = latency;
+    }
+    Sweep();
+}
+
+void AddressLatency::RecordFailure(const string& ip)
+{
+    latency_[ip] = kFailureLatency;
+    Sweep();
+}
+
+void AddressLatency::Sort(vector<string>& ips)
+{
+    if (ips.size() < 2)
+        return;
+    vector<pair<int64_t, string> > scored;
+    for (auto& ip : ips)
+    {
+        int64_t latency = latency_.Count(ip) > 0 ? latency_[ip] : kUnknownLatency;
+        scored.push_back(make_pair(latency, ip));
+    }
+    stable_sort(scored.begin(), scored.end(),
+                [](const pair<int64_t, string>& a, const pair<int64_t, string>& b)
+    {
+        return a.first < b.first;
+    });
+    for (size_t i = 0; i < ips.size(); i++)
+        ips[i] = scored[i].second;
+}
+
+void AddressLatency::Sweep()
+{
+    int64_t now = GetMonotonicTime();
+    if (now - last_sweep_ >= kSweepInterval * 1000)
+    {
+        latency_.Sweep();
+        last_sweep_ = now;
+    }
+}
+
+HappyEyeballs::HappyEyeballs(EventLoop * event_loop, AddressLatency * latency, IConnectNotify * notify):
+    event_loop_(event_loop),
+    latency_(latency),
+    notify_(notify),
+    next_(0),
+    port_(0),
+    fast_open_(false),
+    timer_(this)
+{
+}
+
+HappyEyeballs::~HappyEyeballs()
+{
+    Cancel();
+}
+
+void HappyEyeballs::Start(const vector<string>& ips, int port, bool fast_open)
+{
+    Cancel();
+    candidates_ = ips;
+    latency_->Sort(candidates_);
+    if (fast_open && candidates_.size() > 1)
+        candidates_.resize(1);
+    next_ = 0;
+    port_ = port;
+    fast_open_ = fast_open;
+    Advance();
+}
+
+void HappyEyeballs::Connect(const sockaddr_storage& addr, int addr_len, bool fast_open)
+{
+    Cancel();
+    candidates_.clear();
+    next_ = 0;
+    fast_open_ = fast_open;
+    if (!StartAttempt(addr, addr_len, ""))
+        Finish(INVALID_SOCKET);
+}
+
+void HappyEyeballs::Cancel()
+{
+    timer_.Cancel();
+    for (auto& attempt : attempts_)
+    {
+        event_loop_->Remove(attempt.s);
+        CloseSocket(attempt.s);
+    }
+    attempts_.clear();
+}
+
+bool HappyEyeballs::StartNext()
+{
+    while (next_ < candidates_.size())
+    {
+        const string& ip = candidates_[next_++];
+        sockaddr_storage addr;
+        int addr_len = ToSockAddr(ip, port_, &addr);
+        if (addr_len == 0)
+            continue;
+        if (StartAttempt(addr, addr_len, ip))
+            return true;
+    }
+    return false;
+}
+
+bool HappyEyeballs::StartAttempt(const sockaddr_storage& addr, int addr_len, const string& ip)
+{
+    SOCKET s = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+    {
+        // e.g. no IPv6 on this host
+        if (!ip.empty())
+            latency_->RecordFailure(ip);
+        return false;
+    }
+    SetNoBlocking(s);
+    if (fast_open_)
+        SetFastOpen(s, false);
+    if (-1 == connect(s, (sockaddr*)&addr, addr_len) && !SocketIsBlock(s))
+    {
+        LOGI << "connect " << ip << " failed " << GetSocketErrorCode() << "\n";
+        if (!ip.empty())
+            latency_->RecordFailure(ip);
+        CloseSocket(s);
+        return false;
+    }
+    Attempt attempt = { s, ip, event_loop_->Now() };
+    attempts_.push_back(attempt);
+    event_loop_->Add(s, kPollOut | kPollErr, this);
+    return true;
+}
+
+void HappyEyeballs::Advance()
+{
+    if (StartNext())
+    {
+        // the next address is tried if this one hasn't connected in time
+        if (next_ < candidates_.size())
+            event_loop_->AddTimer(&timer_, kAttemptDelay);
+        return;
+    }
+    if (attempts_.empty())
+        Finish(INVALID_SOCKET);
+}
+
+void HappyEyeballs::Drop(size_t index)
+{
+    event_loop_->Remove(attempts_[index].s);
+    CloseSocket(attempts_[index].s);
+    attempts_.erase(attempts_.begin() + index);
+}
+
+void HappyEyeballs::HandleEvent(SOCKET s, int event)
+{
+    size_t index = 0;
+    while (index < attempts_.size() && attempts_[index].s != s)
+        ++index;
+    if (index == attempts_.size())
+        return;
+    Attempt& attempt = attempts_[index];
+    int err = GetSocketPendingError(s);
+    if ((event & kPollErr) || err != 0)
+    {
+        LOGI << "connect " << attempt.ip << " failed " << err << "\n";
+        if (!attempt.ip.empty())
+            latency_->RecordFailure(attempt.ip);
+        Drop(index);
+        // a failure doesn't wait for the delay
+        timer_.Cancel();
+        Advance();
+        return;
+    }
+    if (!(event & kPollOut))
+        return;
+    // a fast open connect is writable at once, that's no connect time
+    if (!attempt.ip.empty() && !fast_open_)
+        latency_->Record(attempt.ip, event_loop_->Now() - attempt.started);
+    event_loop_->Remove(s);
+    attempts_.erase(attempts_.begin() + index);
+    Cancel();
+    Finish(s);
+}
+
+void HappyEyeballs::HandleTimeout(Timer * timer)
+{
+    Advance();
+}
+
+// the owner may be deleted by the callback, nothing is touched after it
+void HappyEyeballs::Finish(SOCKET s)
+{
+    notify_->Connected(s);
+}
@@ -0,0 +1,68 @@
+#ifndef _HAPPY_EYEBALLS_H_
+#define _HAPPY_EYEBALLS_H_
+
+//connect time of the addresses used recently, one per loop. addresses which
+//connected fast are tried first and the ones which failed last
+class AddressLatency
+{
+    const static int kUnknownLatency = 250;//millisecond, the attempt delay
+    const static int kFailureLatency = 10000;
+    const static int kSweepInterval = 60;//second
+public:
+    AddressLatency();
+    void Record(const string& ip, int64_t latency);
+    void RecordFailure(const string& ip);
+    //stable, so addresses without history keep the resolver's order
+    void Sort(vector<string>& ips);
+private:
+    LRUCache<string, int64_t> latency_;//smoothed, millisecond
+    int64_t last_sweep_;
+
+    void Sweep();
+};
+
+//connect to one of several addresses of a host (RFC 8305). attempts start
+//one after another with a delay and run in parallel, a failed attempt starts
+//the next one at once. the first connected socket wins, the others are closed
+class HappyEyeballs : public ISockNotify, public ITimerNotify
+{
+    const static int kAttemptDelay = 250;//millisecond
+    struct Attempt
+    {
+        SOCKET s;
+        string ip;
+        int64_t started;
+    };
+public:
+    HappyEyeballs(EventLoop* event_loop, AddressLatency* latency, IConnectNotify* notify);
+    ~HappyEyeballs();
+    //the result is passed to IConnectNotify::Connected, maybe before Start
+    //returns. with fast open the connect returns at once, so there's no race
+    void Start(const vector<string>& ips, int port, bool fast_open);
+    //a single address known without resolving, there's nothing to race
+    void Connect(const sockaddr_storage& addr, int addr_len, bool fast_open);
+    void Cancel();
+    virtual void HandleEvent(SOCKET s, int event) override;
+    virtual void HandleTimeout(Timer* timer) override;
+private:
+    EventLoop* event_loop_;
+    AddressLatency* latency_;
+    IConnectNotify* notify_;
+    vector<string> candidates_;
+    size_t next_;
+    int port_;
+    bool fast_open_;
+    vector<Attempt> attempts_;
+    Timer timer_;
+
+    //start attempts until one is in progress, false when none is left
+    bool StartNext();
+    //ip is empty for an address not from the candidates
+    bool StartAttempt(const sockaddr_storage& addr, int addr_len, const string& ip);
+    //start the next attempt, report the failure if none is left
+    void Advance();
+    void Drop(size_t index);
+    void Finish(SOCKET s);
+};
+
+#endif
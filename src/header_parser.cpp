@@ -0,0 +1,186 @@
+#include "common.h"
+#include "header_parser.h"
+
+HeaderParser::HeaderParser(size_t prefix_length)
+{
+    Reset(prefix_length);
+}
+
+void HeaderParser::Reset(size_t prefix_length)
+{
+    prefix_length_ = min(prefix_length, (size_t)kMaxPrefixLength);
+    prefix_fed_ = 0;
+    fed_ = 0;
+    need_ = 1;
+    addr_len_ = 0;
+}
+
+int HeaderParser::Feed(const char* data, size_t len, size_t* used)
+{
+    *used = 0;
+    if (prefix_fed_ < prefix_length_)
+    {
+        size_t n = min(len, prefix_length_ - prefix_fed_);
+        memcpy(prefix_ + prefix_fed_, data, n);
+        prefix_fed_ += n;
+        *used += n;
+        data += n;
+        len -= n;
+    }
+    while (len > 0 && fed_ < need_)
+    {
+        size_t n = min(len, need_ - fed_);
+        memcpy(header_ + fed_, data, n);
+        fed_ += n;
+        *used += n;
+        data += n;
+        len -= n;
+        // the length grows as the fields telling it arrive
+        if (fed_ == 1)
+        {
+            switch (header_[0] & ADDRTYPE_MASK)
+            {
+            case ADDRTYPE_IPV4:
+                need_ = 1 + 4 + 2;
+                break;
+            case ADDRTYPE_IPV6:
+                need_ = 1 + 16 + 2;
+                break;
+            case ADDRTYPE_HOST:
+                need_ = 2;
+                break;
+            default:
+                LOGW << "unsupported addrtype " << (int)header_[0] << ", maybe wrong password or encryption method\n";
+                return kParseError;
+            }
+        }
+        else if (fed_ == 2 && (header_[0] & ADDRTYPE_MASK) == ADDRTYPE_HOST)
+        {
+            if (header_[1] == 0)
+                return kParseError;
+            need_ = 2 + (uint8_t)header_[1] + 2;
+        }
+    }
+    if (fed_ < need_)
+        return kParseIncomplete;
+    Complete();
+    return kParseDone;
+}
+
+void HeaderParser::Complete()
+{
+    int port = GetPort();
+    memset(&addr_, 0, sizeof(addr_));
+    switch (header_[0] & ADDRTYPE_MASK)
+    {
+    case ADDRTYPE_IPV4:
+    {
+        sockaddr_in* addr = (sockaddr_in*)&addr_;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        memcpy(&addr->sin_addr, &header_[1], 4);
+        addr_len_ = sizeof(sockaddr_in);
+        break;
+    }
+    case ADDRTYPE_IPV6:
+    {
+        sockaddr_in6* addr = (sockaddr_in6*)&addr_;
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(port);
+        memcpy(&addr->sin6_addr, &header_[1], 16);
+        addr_len_ = sizeof(sockaddr_in6);
+        break;
+    }
+    default:
+    {
+        // clients often send an IP as a hostname
+        size_t host_len = (uint8_t)header_[1];
+        char host[INET6_ADDRSTRLEN];
+        addr_len_ = 0;
+        if (host_len < sizeof(host))
+        {
+            memcpy(host, &header_[2], host_len);
+            host[host_len] = '\0';
+            sockaddr_in* addr4 = (sockaddr_in*)&addr_;
+            sockaddr_in6* addr6 = (sockaddr_in6*)&addr_;
+            if (1 == inet_pton(AF_INET, host, &addr4->sin_addr))
+            {
+                addr4->sin_family = AF_INET;
+                addr4->sin_port = htons(port);
+                addr_len_ = sizeof(sockaddr_in);
+            }
+            else if (1 == inet_pton(AF_INET6, host, &addr6->sin6_addr))
+            {
+                addr6->sin6_family = AF_INET6;
+                addr6->sin6_port = htons(port);
+                addr_len_ = sizeof(sockaddr_in6);
+            }
+        }
+        break;
+    }
+    }
+}
+
+size_t HeaderParser::GetFedLength()
+{
+    return prefix_fed_ + fed_;
+}
+
+const char* HeaderParser::GetPrefix()
+{
+    return prefix_;
+}
+
+int HeaderParser::GetAddrType()
+{
+    return fed_ > 0 ? header_[0] : 0;
+}
+
+const char* HeaderParser::GetHeader()
+{
+    return header_;
+}
+
+size_t HeaderParser::GetHeaderLength()
+{
+    return fed_;
+}
+
+int HeaderParser::GetPort()
+{
+    return (uint8_t)header_[need_ - 2] * 256 + (uint8_t)header_[need_ - 1];
+}
+
+int HeaderParser::GetSockAddr(sockaddr_storage* addr)
+{
+    if (addr_len_ > 0)
+        memcpy(addr, &addr_, addr_len_);
+    return addr_len_;
+}
+
+string HeaderParser::GetAddress()
+{
+    if ((header_[0] & ADDRTYPE_MASK) == ADDRTYPE_HOST)
+        return string(&header_[2], (uint8_t)header_[1]);
+    return GetIpStr((const sockaddr*)&addr_);
+}
+
+const char* HeaderParser::GetAddress(char* out)
+{
+    out[0] = '\0';
+    if ((header_[0] & ADDRTYPE_MASK) == ADDRTYPE_HOST)
+    {
+        size_t host_len = (uint8_t)header_[1];
+        memcpy(out, &header_[2], host_len);
+        out[host_len] = '\0';
+    }
+    else if (addr_.ss_family == AF_INET)
+    {
+        inet_ntop(AF_INET, &((sockaddr_in*)&addr_)->sin_addr, out, kMaxAddressLength);
+    }
+    else if (addr_.ss_family == AF_INET6)
+    {
+        inet_ntop(AF_INET6, &((sockaddr_in6*)&addr_)->sin6_addr, out, kMaxAddressLength);
+    }
+    return out;
+}
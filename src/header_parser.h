@@ -0,0 +1,57 @@
+#ifndef _HEADER_PARSER_H_
+#define _HEADER_PARSER_H_
+
+//parses the address header ATYP ADDR PORT of a request as it arrives, a
+//header split over several reads resumes where it stopped. the header is
+//kept in a fixed buffer and an IPv4/IPv6 address (or a hostname which is
+//an IP literal) is decoded straight to a sockaddr, nothing is allocated
+class HeaderParser
+{
+public:
+    //ATYP, the length of a hostname, the hostname and the port
+    const static size_t kMaxHeaderLength = 1 + 1 + 255 + 2;
+    const static size_t kMaxPrefixLength = 3;
+    //the text of the address and its NUL, a hostname is the longest
+    const static size_t kMaxAddressLength = 255 + 1;
+    enum PARSE_RESULT
+    {
+        kParseIncomplete = 0,
+        kParseDone = 1,
+        kParseError = -1
+    };
+
+    //prefix bytes are taken before the header, VER CMD RSV of a SOCKS5 request
+    HeaderParser(size_t prefix_length = 0);
+    void Reset(size_t prefix_length = 0);
+    //take bytes of data up to the end of the header, *used is set to the
+    //count taken. the bytes after the header are left to the caller
+    int Feed(const char* data, size_t len, size_t* used);
+    //bytes taken so far, prefix included
+    size_t GetFedLength();
+    const char* GetPrefix();
+    int GetAddrType();
+    //the raw header, valid once parsed
+    const char* GetHeader();
+    size_t GetHeaderLength();
+    int GetPort();
+    //the destination with its port if it's an IP literal, or 0 for a
+    //hostname to resolve
+    int GetSockAddr(sockaddr_storage* addr);
+    //the hostname, or the text of the address of a literal
+    string GetAddress();
+    //the same written to out of kMaxAddressLength bytes, which is returned
+    const char* GetAddress(char* out);
+private:
+    size_t prefix_length_;
+    size_t prefix_fed_;
+    char prefix_[kMaxPrefixLength];
+    char header_[kMaxHeaderLength];
+    size_t fed_;
+    size_t need_;//length of the header, as far as known
+    sockaddr_storage addr_;
+    int addr_len_;
+
+    void Complete();
+};
+
+#endif
@@ -5,14 +5,17 @@
 #include <string>
 #include <fstream>
 #include <time.h>
+#include <mutex>
 
 #ifdef WIN32
 #pragma warning(disable:4996)
 #endif
 
-#define LOGI *(Log::GetInstance())<<white<<Log::FormatTime()<<" [info] "
-#define LOGW *(Log::GetInstance())<<yellow<<Log::FormatTime()<<" [warning] "
-#define LOGE *(Log::GetInstance())<<red<<Log::FormatTime()<<" [error] "
+//a line is built in a LogLine and written whole when the statement ends,
+//so lines from different threads do not interleave
+#define LOGI LogLine(Log::GetInstance())<<white<<Log::FormatTime()<<" [info] "
+#define LOGW LogLine(Log::GetInstance())<<yellow<<Log::FormatTime()<<" [warning] "
+#define LOGE LogLine(Log::GetInstance())<<red<<Log::FormatTime()<<" [error] "
 
 
 inline std::ostream& blue(std::ostream &s)
@@ -84,28 +87,37 @@ public:
     }
     template <typename T> Log& operator<<(const T& value)
     {
+        std::lock_guard<std::mutex> lock(m_mutex);
         std::cout << value;
         return (*this);
     }
+    void Write(const std::string& line)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::cout << line << std::flush;
+    }
     static std::string FormatTime()
     {
         time_t t;
-        struct tm *tm = NULL;
+        struct tm tm;
 
         time(&t);
-        tm = localtime(&t);
+#ifdef WIN32
+        localtime_s(&tm, &t);
+#else
+        localtime_r(&t, &tm);
+#endif
         char buf[100];
         sprintf(buf, "%04d-%02d-%02d %02d:%02d:%02d",
-                tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-                tm->tm_hour, tm->tm_min, tm->tm_sec);
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                tm.tm_hour, tm.tm_min, tm.tm_sec);
         return std::string(buf);
     }
+    //not thread safe the first time, called in main before the workers start
     static Log* GetInstance()
     {
         if (instance == NULL)
-        {
-            return new Log();
-        }
+            instance = new Log();
         return instance;
     }
     void Destory()
@@ -115,9 +127,31 @@ public:
     }
 private:
     std::ofstream m_fs;
+    std::mutex m_mutex;
     static Log* instance;
 };
 
+class LogLine
+{
+public:
+    explicit LogLine(Log* log):
+        m_log(log)
+    {
+    }
+    ~LogLine()
+    {
+        m_log->Write(m_ss.str());
+    }
+    template <typename T> LogLine& operator<<(const T& value)
+    {
+        m_ss << value;
+        return (*this);
+    }
+private:
+    Log* m_log;
+    std::ostringstream m_ss;
+};
+
 #ifdef WIN32
 #pragma warning(default:4996)
 #endif
@@ -0,0 +1,713 @@
+#include "common.h"
+#include "mux_tunnel.h"
+
+// bytes a stream may send before the peer grants more
+const int kMuxWindow = 256 * 1024;
+
+// a window update is sent once this much has been written to the socket
+const int kMuxUpdateThreshold = kMuxWindow / 4;
+
+// bytes read from the socket of a stream into one DATA frame
+const int kMuxChunk = 16 * 1024;
+
+// bytes read per event, so one busy socket can't starve the loop
+const int kMuxReadBudget = 256 * 1024;
+
+// default timeout, second
+const int kMuxConnectTimeout = 10;
+const int kMuxIdleTimeout = 300;
+
+MuxStream::MuxStream(MuxTunnel * tunnel, uint32_t id, EventLoop * event_loop,
+                     DNSResolve * dns_resolver, AddressLatency * latency, Config * config):
+    tunnel_(tunnel),
+    id_(id),
+    event_loop_(event_loop),
+    dns_resolver_(dns_resolver),
+    config_(config),
+    sock_(INVALID_SOCKET),
+    mode_(0),
+    connected_(false),
+    sock_eof_(false),
+    peer_closed_(false),
+    send_window_(kMuxWindow),
+    unacked_(0),
+    pending_sent_(0),
+    remote_port_(0),
+    data_write_to_sock_(event_loop->GetBufferPool()),
+    timer_(this),
+    last_active_(event_loop->Now()),
+    connector_(event_loop, latency, this)
+{
+}
+
+void MuxStream::Attach(SOCKET s, const char* data, size_t len)
+{
+    sock_ = s;
+    connected_ = true;
+    mode_ = kPollIn | kPollErr;
+    event_loop_->Add(sock_, mode_, this);
+    int timeout = config_->GetInt("timeout", kMuxIdleTimeout);
+    if (timeout > 0)
+        event_loop_->AddTimer(&timer_, timeout * 1000);
+    if (len > 0)
+    {
+        // may be larger than a frame or the window, what doesn't fit waits
+        // for a window update
+        pending_.assign(data, data + len);
+        SendPending();
+        UpdatePoll();
+    }
+}
+
+void MuxStream::Connect(const char* header, size_t len)
+{
+    HeaderParser parser;
+    size_t used = 0;
+    if (parser.Feed(header, len, &used) != HeaderParser::kParseDone)
+    {
+        LOGW << "unknown header in mux open\n";
+        Close(true);
+        return;
+    }
+    remote_address_ = parser.GetAddress();
+    remote_port_ = parser.GetPort();
+    LOGI << "mux connecting " << remote_address_ << ":" << remote_port_ << "\n";
+    int timeout = config_->GetInt("connect_timeout", kMuxConnectTimeout);
+    if (timeout > 0)
+        event_loop_->AddTimer(&timer_, timeout * 1000);
+    // an IP literal is connected without resolving
+    sockaddr_storage addr;
+    int addr_len = parser.GetSockAddr(&addr);
+    if (addr_len > 0)
+    {
+        connector_.Connect(addr, addr_len, false);
+        return;
+    }
+    //may be called back at once for an ip or a cached host
+    dns_resolver_->Resolve(remote_address_, this);
+}
+
+void MuxStream::DNSResolvedAll(string hostname, const vector<string>& ips, string err)
+{
+    if (!err.empty() || ips.empty())
+    {
+        LOGW << "mux resolve " << hostname << " failed " << err << "\n";
+        Close(true);
+        return;
+    }
+    connector_.Start(ips, remote_port_, false);
+}
+
+void MuxStream::Connected(SOCKET s)
+{
+    if (s == INVALID_SOCKET)
+    {
+        LOGW << "mux connect " << remote_address_ << ":" << remote_port_ << " failed\n";
+        Close(true);
+        return;
+    }
+    sock_ = s;
+    if (config_->GetInt("no_delay") == 1)
+        SetNoDelay(sock_);
+    mode_ = kPollOut | kPollErr;
+    event_loop_->Add(sock_, mode_, this);
+}
+
+void MuxStream::OnData(const char* data, size_t len)
+{
+    last_active_ = event_loop_->Now();
+    data_write_to_sock_.Append(data, len);
+    // before the connection is up the data waits in the queue
+    if (connected_ && FlushSock())
+        UpdatePoll();
+}
+
+void MuxStream::OnWindow(uint32_t increment)
+{
+    send_window_ += increment;
+    SendPending();
+    UpdatePoll();
+}
+
+void MuxStream::OnPeerClose()
+{
+    peer_closed_ = true;
+    // write what the peer has sent before it closed
+    if (!connected_ || data_write_to_sock_.Empty())
+    {
+        Close(false);
+        return;
+    }
+    UpdatePoll();
+}
+
+void MuxStream::Resume()
+{
+    SendPending();
+    UpdatePoll();
+}
+
+void MuxStream::Abort()
+{
+    tunnel_ = NULL;
+    Close(false);
+}
+
+// DATA frames of the data held back, as long as the window and the tunnel allow
+void MuxStream::SendPending()
+{
+    while (pending_sent_ < pending_.size() && send_window_ > 0 && tunnel_->Writable())
+    {
+        size_t len = min(pending_.size() - pending_sent_, (size_t)min((int64_t)MuxTunnel::kMaxPayload, send_window_));
+        tunnel_->SendFrame(kMuxData, id_, pending_.data() + pending_sent_, len);
+        send_window_ -= len;
+        pending_sent_ += len;
+    }
+    if (pending_sent_ == pending_.size() && !pending_.empty())
+    {
+        vector<char>().swap(pending_);
+        pending_sent_ = 0;
+    }
+}
+
+// read the socket into DATA frames as long as the window and the tunnel allow
+bool MuxStream::ReadSock()
+{
+    int budget = kMuxReadBudget;
+    while (budget > 0 && !sock_eof_ && !peer_closed_ && pending_.empty() && send_window_ > 0 &&
+            tunnel_->Writable())
+    {
+        // read straight into the tunnel's queue behind the frame header
+        PacketBuffer packet;
+        tunnel_->PrepareFrame((size_t)min((int64_t)kMuxChunk, send_window_), &packet);
+        int len = (int)packet.Tailroom();
+        int ret = BufferRecv(sock_, packet.Tail(), len);
+        if (ret <= 0)
+            tunnel_->AbortFrame();
+        if (ret == -1 && SocketIsBlock(sock_))
+            break;
+        if (ret <= 0)
+        {
+            // tell the peer, and close once the queued data is written
+            tunnel_->SendFrame(kMuxClose, id_, NULL, 0);
+            sock_eof_ = true;
+            if (ret < 0 || data_write_to_sock_.Empty())
+            {
+                Close(false);
+                return false;
+            }
+            break;
+        }
+        packet.Put(ret);
+        tunnel_->CommitFrame(kMuxData, id_, &packet);
+        send_window_ -= ret;
+        budget -= ret;
+        // level triggered loop will tell us again
+        if (ret < len)
+            break;
+    }
+    return true;
+}
+
+bool MuxStream::FlushSock()
+{
+    if (!data_write_to_sock_.Empty())
+    {
+        int ret = data_write_to_sock_.Send(sock_);
+        if (ret == -1 && !SocketIsBlock(sock_))
+        {
+            Close(true);
+            return false;
+        }
+        if (ret > 0)
+        {
+            unacked_ += ret;
+            if (unacked_ >= (size_t)kMuxUpdateThreshold && !sock_eof_ && !peer_closed_)
+            {
+                uint32_t increment = htonl((uint32_t)unacked_);
+                tunnel_->SendFrame(kMuxWindowUpdate, id_, (const char*)&increment, sizeof(increment));
+                unacked_ = 0;
+            }
+        }
+    }
+    if (data_write_to_sock_.Empty() && (sock_eof_ || peer_closed_))
+    {
+        Close(false);
+        return false;
+    }
+    return true;
+}
+
+void MuxStream::UpdatePoll()
+{
+    if (sock_ == INVALID_SOCKET)
+        return;
+    int mode = kPollErr;
+    if (!connected_ || !data_write_to_sock_.Empty())
+        mode |= kPollOut;
+    if (connected_ && !sock_eof_ && !peer_closed_ && pending_.empty() && send_window_ > 0 &&
+            tunnel_->Writable())
+        mode |= kPollIn;
+    if (mode != mode_)
+    {
+        mode_ = mode;
+        event_loop_->Modify(sock_, mode_);
+    }
+}
+
+void MuxStream::HandleEvent(SOCKET s, int event)
+{
+    last_active_ = event_loop_->Now();
+    if (!connected_)
+    {
+        if ((event & kPollErr) || GetSocketPendingError(s) != 0)
+        {
+            LOGW << "mux connect " << remote_address_ << ":" << remote_port_ << " failed\n";
+            Close(true);
+            return;
+        }
+        if (!(event & kPollOut))
+            return;
+        connected_ = true;
+        int timeout = config_->GetInt("timeout", kMuxIdleTimeout);
+        if (timeout > 0)
+            event_loop_->AddTimer(&timer_, timeout * 1000);
+        else
+            timer_.Cancel();
+    }
+    if (event & kPollErr)
+    {
+        Close(true);
+        return;
+    }
+    if ((event & kPollOut) && !FlushSock())
+        return;
+    if ((event & (kPollIn | kPollHup)) && !ReadSock())
+        return;
+    UpdatePoll();
+}
+
+void MuxStream::HandleTimeout(Timer * timer)
+{
+    if (connected_)
+    {
+        // idle timer isn't refreshed on every event, check the last activity
+        int64_t idle_timeout = config_->GetInt("timeout", kMuxIdleTimeout) * 1000;
+        int64_t idle = event_loop_->Now() - last_active_;
+        if (idle < idle_timeout)
+        {
+            event_loop_->AddTimer(&timer_, idle_timeout - idle);
+            return;
+        }
+    }
+    LOGW << "mux stream timeout: " << remote_address_ << ":" << remote_port_ << "\n";
+    Close(true);
+}
+
+void MuxStream::Close(bool notify)
+{
+    if (tunnel_)
+    {
+        if (notify && !sock_eof_ && !peer_closed_)
+            tunnel_->SendFrame(kMuxClose, id_, NULL, 0);
+        tunnel_->RemoveStream(id_);
+    }
+    delete this;
+}
+
+MuxStream::~MuxStream()
+{
+    timer_.Cancel();
+    dns_resolver_->RemoveCallback(this);
+    if (sock_ != INVALID_SOCKET)
+    {
+        event_loop_->Remove(sock_);
+        CloseSocket(sock_);
+        sock_ = INVALID_SOCKET;
+    }
+}
+
+MuxTunnel::MuxTunnel(TCPRelay * relay, EventLoop * event_loop, DNSResolve * dns_resolver,
+                     Config * config, bool is_local):
+    relay_(relay),
+    event_loop_(event_loop),
+    dns_resolver_(dns_resolver),
+    config_(config),
+    is_local_(is_local),
+    server_index_(-1),
+    server_port_(0),
+    connect_started_(0),
+    sock_(INVALID_SOCKET),
+    mode_(0),
+    connected_(false),
+    waiting_writable_(false),
+    paused_(false),
+    broken_(false),
+    closed_(false),
+    next_stream_id_(1),
+    data_write_(event_loop->GetBufferPool()),
+    close_timer_(this),
+    connector_(event_loop, relay->GetAddressLatency(), this)
+{
+}
+
+void MuxTunnel::Connect()
+{
+    // the server learns it's a tunnel from the first byte
+    char magic = (char)kMuxMagic;
+    data_write_.Append(&magic, 1);
+    string server_address;
+    server_index_ = relay_->GetServerSelector()->Select(0, &server_address, &server_port_);
+    connect_started_ = event_loop_->Now();
+    //may be called back at once for an ip or a cached host
+    dns_resolver_->Resolve(server_address, this);
+}
+
+void MuxTunnel::DNSResolvedAll(string hostname, const vector<string>& ips, string err)
+{
+    if (!err.empty() || ips.empty())
+    {
+        LOGW << "tunnel resolve " << hostname << " failed " << err << "\n";
+        Fail();
+        return;
+    }
+    // the server may have IPv6 and IPv4 addresses, race them
+    connector_.Start(ips, server_port_, false);
+}
+
+void MuxTunnel::Connected(SOCKET s)
+{
+    if (s == INVALID_SOCKET)
+    {
+        LOGW << "tunnel connect failed\n";
+        Fail();
+        return;
+    }
+    sock_ = s;
+    connected_ = true;
+    relay_->GetServerSelector()->ReportSuccess(server_index_, event_loop_->Now() - connect_started_);
+    LOGI << "tunnel connected, " << streams_.size() << " streams\n";
+    if (config_->GetInt("no_delay") == 1)
+        SetNoDelay(sock_);
+    mode_ = kPollIn | kPollErr;
+    event_loop_->Add(sock_, mode_, this);
+    // the magic and the frames queued meanwhile
+    FlushSock(true);
+}
+
+void MuxTunnel::Accept(SOCKET s, const char* data, size_t len)
+{
+    LOGI << "tunnel accepted\n";
+    sock_ = s;
+    connected_ = true;
+    mode_ = kPollIn | kPollErr;
+    event_loop_->Add(sock_, mode_, this);
+    if (len > 0 && !Feed(data, len))
+        Fail();
+}
+
+void MuxTunnel::OpenStream(SOCKET s, const char* header, size_t header_length, const char* data, size_t len)
+{
+    uint32_t id = next_stream_id_++;
+    MuxStream* stream = new MuxStream(this, id, event_loop_, dns_resolver_, relay_->GetAddressLatency(), config_);
+    streams_[id] = stream;
+    SendFrame(kMuxOpen, id, header, header_length);
+    stream->Attach(s, data, len);
+}
+
+void MuxTunnel::SendFrame(uint8_t type, uint32_t id, const char* payload, size_t len)
+{
+    if (broken_)
+        return;
+    // a payload larger than a frame goes out as frames of the same type
+    do
+    {
+        size_t n = min(len, (size_t)kMaxPayload);
+        char header[kHeaderSize];
+        WriteHeader(header, type, id, n);
+        data_write_.Append(header, kHeaderSize);
+        if (n > 0)
+            data_write_.Append(payload, n);
+        payload += n;
+        len -= n;
+    }
+    while (len > 0);
+    FrameQueued();
+}
+
+void MuxTunnel::PrepareFrame(size_t len, PacketBuffer* packet)
+{
+    len = min(len, (size_t)kMaxPayload);
+    // ask for enough that the free space given is never taken by the header alone
+    size_t room = 0;
+    char* buf = data_write_.PrepareWrite(kHeaderSize + max(len, (size_t)kHeaderSize * 4), &room);
+    packet->Reset(buf, min(room, kHeaderSize + len), kHeaderSize);
+}
+
+void MuxTunnel::CommitFrame(uint8_t type, uint32_t id, PacketBuffer* packet)
+{
+    if (broken_)
+        return;
+    size_t len = packet->Length();
+    WriteHeader(packet->Push(kHeaderSize), type, id, len);
+    data_write_.CommitWrite(packet->Length());
+    FrameQueued();
+}
+
+void MuxTunnel::AbortFrame()
+{
+    data_write_.AbortWrite();
+}
+
+void MuxTunnel::WriteHeader(char* header, uint8_t type, uint32_t id, size_t len)
+{
+    uint32_t stream_id = htonl(id);
+    uint16_t length = htons((uint16_t)len);
+    header[0] = (char)type;
+    memcpy(&header[1], &stream_id, 4);
+    memcpy(&header[5], &length, 2);
+}
+
+void MuxTunnel::FrameQueued()
+{
+    if (data_write_.Size() >= (size_t)kHighWatermark)
+        paused_ = true;
+    FlushSock(false);
+}
+
+void MuxTunnel::RemoveStream(uint32_t id)
+{
+    streams_.erase(id);
+}
+
+bool MuxTunnel::Writable()
+{
+    return !broken_ && !paused_;
+}
+
+bool MuxTunnel::IsBroken()
+{
+    return broken_;
+}
+
+size_t MuxTunnel::GetStreamCount()
+{
+    return streams_.size();
+}
+
+// frames don't need a window of the tunnel, the streams bound them already,
+// so the tunnel is always read
+void MuxTunnel::ReadSock()
+{
+    int budget = kMuxReadBudget;
+    while (budget > 0 && !broken_)
+    {
+        PooledBuffer scratch(event_loop_->GetBufferPool());
+        char* buf = scratch.Acquire(kDownStreamBufSize);
+        int ret = BufferRecv(sock_, buf, kDownStreamBufSize);
+        if (ret == -1 && SocketIsBlock(sock_))
+            return;
+        if (ret <= 0)
+        {
+            LOGI << "tunnel closed by peer, " << streams_.size() << " streams\n";
+            Fail();
+            return;
+        }
+        budget -= ret;
+        if (!Feed(buf, ret))
+        {
+            Fail();
+            return;
+        }
+        if (ret < kDownStreamBufSize)
+            return;
+    }
+}
+
+// dispatch the complete frames, keep the incomplete one for the next read
+bool MuxTunnel::Feed(const char* data, size_t len)
+{
+    const char* buf = data;
+    size_t size = len;
+    if (!partial_frame_.empty())
+    {
+        partial_frame_.insert(partial_frame_.end(), data, data + len);
+        buf = &partial_frame_[0];
+        size = partial_frame_.size();
+    }
+    size_t pos = 0;
+    while (size - pos >= (size_t)kHeaderSize && !broken_)
+    {
+        uint32_t id;
+        uint16_t length;
+        memcpy(&id, buf + pos + 1, 4);
+        memcpy(&length, buf + pos + 5, 2);
+        length = ntohs(length);
+        if (size - pos < (size_t)kHeaderSize + length)
+            break;
+        if (!HandleFrame((uint8_t)buf[pos], ntohl(id), buf + pos + kHeaderSize, length))
+            return false;
+        pos += kHeaderSize + length;
+    }
+    if (buf == data)
+        partial_frame_.assign(data + pos, data + len);
+    else
+        partial_frame_.erase(partial_frame_.begin(), partial_frame_.begin() + pos);
+    return true;
+}
+
+bool MuxTunnel::HandleFrame(uint8_t type, uint32_t id, const char* payload, size_t len)
+{
+    auto iter = streams_.find(id);
+    MuxStream* stream = iter == streams_.end() ? NULL : iter->second;
+    // a frame of a stream closed here is dropped, the peer closes it too
+    switch (type)
+    {
+    case kMuxOpen:
+        if (is_local_ || stream)
+        {
+            LOGW << "unexpected mux open " << id << "\n";
+            return false;
+        }
+        stream = new MuxStream(this, id, event_loop_, dns_resolver_, relay_->GetAddressLatency(), config_);
+        streams_[id] = stream;
+        stream->Connect(payload, len);
+        break;
+    case kMuxData:
+        if (stream)
+            stream->OnData(payload, len);
+        break;
+    case kMuxClose:
+        if (stream)
+            stream->OnPeerClose();
+        break;
+    case kMuxWindowUpdate:
+        if (len != 4)
+            return false;
+        if (stream)
+        {
+            uint32_t increment;
+            memcpy(&increment, payload, 4);
+            stream->OnWindow(ntohl(increment));
+        }
+        break;
+    default:
+        LOGW << "unknown mux frame " << (int)type << "\n";
+        return false;
+    }
+    return true;
+}
+
+void MuxTunnel::FlushSock(bool writable)
+{
+    if (broken_ || !connected_)
+        return;
+    // while waiting for writable a send would only fail with EAGAIN
+    if (!data_write_.Empty() && (writable || !waiting_writable_))
+    {
+        int ret = data_write_.Send(sock_);
+        if (ret == -1 && !SocketIsBlock(sock_))
+        {
+            LOGW << "tunnel send failed " << GetSocketErrorCode() << "\n";
+            Fail();
+            return;
+        }
+    }
+    waiting_writable_ = !data_write_.Empty();
+    UpdatePoll();
+    if (paused_ && data_write_.Size() <= (size_t)kLowWatermark)
+    {
+        paused_ = false;
+        ResumeStreams();
+    }
+}
+
+void MuxTunnel::UpdatePoll()
+{
+    if (broken_ || sock_ == INVALID_SOCKET)
+        return;
+    int mode = kPollErr;
+    if (connected_)
+        mode |= kPollIn;
+    if (!connected_ || waiting_writable_)
+        mode |= kPollOut;
+    if (mode != mode_)
+    {
+        mode_ = mode;
+        event_loop_->Modify(sock_, mode_);
+    }
+}
+
+void MuxTunnel::ResumeStreams()
+{
+    vector<uint32_t> ids;
+    for (auto& iter : streams_)
+        ids.push_back(iter.first);
+    for (auto& id : ids)
+    {
+        auto iter = streams_.find(id);
+        if (iter != streams_.end())
+            iter->second->Resume();
+    }
+}
+
+void MuxTunnel::HandleEvent(SOCKET s, int event)
+{
+    if (broken_)
+        return;
+    if (event & kPollErr)
+    {
+        Fail();
+        return;
+    }
+    if (event & kPollOut)
+        FlushSock(true);
+    if (!broken_ && (event & (kPollIn | kPollHup)))
+        ReadSock();
+    UpdatePoll();
+}
+
+void MuxTunnel::Fail()
+{
+    if (broken_)
+        return;
+    broken_ = true;
+    // the server couldn't be resolved or connected
+    if (is_local_ && !connected_)
+        relay_->GetServerSelector()->ReportFailure(server_index_);
+    if (sock_ != INVALID_SOCKET)
+        event_loop_->Remove(sock_);
+    event_loop_->AddTimer(&close_timer_, 0);
+}
+
+void MuxTunnel::HandleTimeout(Timer * timer)
+{
+    delete this;
+}
+
+void MuxTunnel::Close()
+{
+    if (closed_)
+        return;
+    closed_ = true;
+    broken_ = true;
+    close_timer_.Cancel();
+    dns_resolver_->RemoveCallback(this);
+    connector_.Cancel();
+    map<uint32_t, MuxStream*> streams;
+    streams.swap(streams_);
+    for (auto& iter : streams)
+        iter.second->Abort();
+    if (sock_ != INVALID_SOCKET)
+    {
+        event_loop_->Remove(sock_);
+        CloseSocket(sock_);
+        sock_ = INVALID_SOCKET;
+    }
+}
+
+MuxTunnel::~MuxTunnel()
+{
+    Close();
+    relay_->RemoveTunnel(this);
+}
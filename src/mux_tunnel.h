@@ -0,0 +1,157 @@
+#ifndef _MUX_TUNNEL_H_
+#define _MUX_TUNNEL_H_
+
+class TCPRelay;
+class MuxTunnel;
+
+//first byte of a connection which carries a tunnel instead of a single
+//request, it isn't a valid address type so the server can tell them apart
+const uint8_t kMuxMagic = 0x4d;
+
+//every frame is type(1) stream id(4) length(2) followed by the payload,
+//integers are in network order
+enum MUX_FRAME
+{
+    kMuxOpen = 1,//payload is the address header, client to server only
+    kMuxData = 2,
+    kMuxClose = 3,//the sender has closed the stream
+    kMuxWindowUpdate = 4//payload is the window increment(4)
+};
+
+//one SOCKS session carried by a tunnel. on the client the socket is the
+//accepted SOCKS connection, on the server it's the connection to the target.
+//a side never sends more than the window granted by the peer, the peer grants
+//it again once the data has been written to its socket, so the queue of a
+//stream is bounded by the window. sockets of streams are level triggered
+class MuxStream : public ISockNotify, public IDNSNotify, public ITimerNotify, public IConnectNotify
+{
+public:
+    MuxStream(MuxTunnel* tunnel, uint32_t id, EventLoop* event_loop, DNSResolve* dns_resolver,
+              AddressLatency* latency, Config* config);
+    //client: relay an accepted socket, data is sent ahead of it
+    void Attach(SOCKET s, const char* data, size_t len);
+    //server: connect to the address of an OPEN frame
+    void Connect(const char* header, size_t len);
+    //frames from the peer, each of them may close the stream
+    void OnData(const char* data, size_t len);
+    void OnWindow(uint32_t increment);
+    void OnPeerClose();
+    //the tunnel can take more data
+    void Resume();
+    //the tunnel is gone, close without telling the peer
+    void Abort();
+    virtual void HandleEvent(SOCKET s, int event) override;
+    virtual void DNSResolvedAll(string hostname, const vector<string>& ips, string err) override;
+    virtual void Connected(SOCKET s) override;
+    virtual void HandleTimeout(Timer* timer) override;
+private:
+    MuxTunnel* tunnel_;
+    uint32_t id_;
+    EventLoop* event_loop_;
+    DNSResolve* dns_resolver_;
+    Config* config_;
+    SOCKET sock_;
+    int mode_;
+    bool connected_;
+    bool sock_eof_;
+    bool peer_closed_;
+    int64_t send_window_;
+    size_t unacked_;//written to the socket, not granted to the peer yet
+    vector<char> pending_;//sent ahead of the socket, waiting for the window
+    size_t pending_sent_;
+    string remote_address_;
+    uint16_t remote_port_;
+    StreamBuffer data_write_to_sock_;
+    Timer timer_;
+    int64_t last_active_;
+    HappyEyeballs connector_;
+
+    ~MuxStream();
+    void SendPending();
+    bool ReadSock();
+    bool FlushSock();
+    void UpdatePoll();
+    void Close(bool notify);
+};
+
+//a long-lived connection between the client and the server carrying many
+//streams. the client opens a fixed number of them and spreads the new streams
+//over them, the server takes over a connection whose first byte is the magic
+class MuxTunnel : public ISockNotify, public IDNSNotify, public ITimerNotify, public IConnectNotify
+{
+    const static int kHeaderSize = 7;
+    //the tunnel stops the streams reading at the high watermark of its
+    //queue and lets them go on once it has drained to the low watermark
+    const static int kHighWatermark = 1024 * 1024;
+    const static int kLowWatermark = 256 * 1024;
+public:
+    const static size_t kMaxPayload = 0xffff;
+
+    MuxTunnel(TCPRelay* relay, EventLoop* event_loop, DNSResolve* dns_resolver, Config* config,
+              bool is_local);
+    //client: connect to the server picked by the selector, frames are
+    //queued until it's connected
+    void Connect();
+    //server: take over an accepted connection, data follows the magic
+    void Accept(SOCKET s, const char* data, size_t len);
+    //client: carry an accepted SOCKS connection, data is what was received
+    //after the address header
+    void OpenStream(SOCKET s, const char* header, size_t header_length, const char* data, size_t len);
+    //a payload over kMaxPayload is split into frames
+    void SendFrame(uint8_t type, uint32_t id, const char* payload, size_t len);
+    //room for the payload of a frame, at most len bytes, at the tail of the
+    //write queue with the header's room in front of it. the payload is read
+    //into packet, and CommitFrame pushes the header, so it's never copied
+    void PrepareFrame(size_t len, PacketBuffer* packet);
+    void CommitFrame(uint8_t type, uint32_t id, PacketBuffer* packet);
+    //nothing was read into the frame prepared
+    void AbortFrame();
+    void RemoveStream(uint32_t id);
+    bool Writable();
+    bool IsBroken();
+    size_t GetStreamCount();
+    virtual void HandleEvent(SOCKET s, int event) override;
+    virtual void DNSResolvedAll(string hostname, const vector<string>& ips, string err) override;
+    virtual void Connected(SOCKET s) override;
+    virtual void HandleTimeout(Timer* timer) override;
+private:
+    friend class TCPRelay;
+    TCPRelay* relay_;
+    EventLoop* event_loop_;
+    DNSResolve* dns_resolver_;
+    Config* config_;
+    bool is_local_;
+    int server_index_;
+    int server_port_;
+    int64_t connect_started_;
+    SOCKET sock_;
+    int mode_;
+    bool connected_;
+    bool waiting_writable_;
+    bool paused_;
+    bool broken_;
+    bool closed_;
+    uint32_t next_stream_id_;
+    map<uint32_t, MuxStream*> streams_;
+    StreamBuffer data_write_;
+    vector<char> partial_frame_;
+
+    static void WriteHeader(char* header, uint8_t type, uint32_t id, size_t len);
+    void FrameQueued();
+    Timer close_timer_;
+    HappyEyeballs connector_;
+
+    ~MuxTunnel();
+    void ReadSock();
+    bool Feed(const char* data, size_t len);
+    bool HandleFrame(uint8_t type, uint32_t id, const char* payload, size_t len);
+    void FlushSock(bool writable);
+    void UpdatePoll();
+    void ResumeStreams();
+    //stop using the tunnel, it's closed and deleted from the timer so
+    //a stream calling in is never deleted under itself
+    void Fail();
+    void Close();
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef _OBJECT_POOL_H_
+#define _OBJECT_POOL_H_
+
+#include <type_traits>
+
+//objects of one type carved from slabs, a freed slot is reused by the next
+//object so the allocator is only called when the pool grows. an object is
+//referred to by a handle of its slot and the generation of the slot, a
+//handle kept after the object is freed resolves to NULL instead of a
+//stranger living in the same memory. one pool per loop, not thread safe
+template<typename T>
+class ObjectPool
+{
+    const static uint32_t kSlabSize = 256;//objects
+    const static uint32_t kNoSlot = 0xffffffff;
+    struct Slot
+    {
+        typename aligned_storage<sizeof(T), alignof(T)>::type storage;
+        uint32_t index;
+        uint32_t generation;//odd while the slot holds an object
+        uint32_t next_free;
+    };
+public:
+    typedef uint64_t Handle;
+    const static Handle kInvalidHandle = 0;
+
+    ObjectPool():
+        free_(kNoSlot),
+        count_(0)
+    {
+    }
+    //objects still alive are not destructed, free them first
+    ~ObjectPool()
+    {
+        for (auto& slab : slabs_)
+            delete[] slab;
+    }
+    //the handle of the object is valid inside its constructor
+    template<typename... Args>
+    T* New(Args&&... args)
+    {
+        if (free_ == kNoSlot)
+            Grow();
+        Slot* slot = GetSlot(free_);
+        free_ = slot->next_free;
+        ++slot->generation;
+        ++count_;
+        return new (&slot->storage) T(std::forward<Args>(args)...);
+    }
+    //the slot is reused first, while it's still in the cache
+    void Delete(T* object)
+    {
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        object->~T();
+        ++slot->generation;
+        slot->next_free = free_;
+        free_ = slot->index;
+        --count_;
+    }
+    Handle GetHandle(const T* object) const
+    {
+        const Slot* slot = reinterpret_cast<const Slot*>(object);
+        return ((Handle)slot->generation << 32) | slot->index;
+    }
+    //NULL once the object of the handle has been freed
+    T* Get(Handle handle) const
+    {
+        uint32_t index = (uint32_t)handle;
+        uint32_t generation = (uint32_t)(handle >> 32);
+        if (index >= slabs_.size() * kSlabSize)
+            return NULL;
+        Slot* slot = GetSlot(index);
+        if (slot->generation != generation || !(generation & 1))
+            return NULL;
+        return reinterpret_cast<T*>(&slot->storage);
+    }
+    //the objects alive, for a shutdown
+    vector<T*> GetAll() const
+    {
+        vector<T*> objects;
+        for (uint32_t i = 0; i < slabs_.size() * kSlabSize; i++)
+        {
+            Slot* slot = GetSlot(i);
+            if (slot->generation & 1)
+                objects.push_back(reinterpret_cast<T*>(&slot->storage));
+        }
+        return objects;
+    }
+    size_t GetCount() const
+    {
+        return count_;
+    }
+private:
+    vector<Slot*> slabs_;
+    uint32_t free_;
+    size_t count_;
+
+    Slot* GetSlot(uint32_t index) const
+    {
+        return &slabs_[index / kSlabSize][index % kSlabSize];
+    }
+    void Grow()
+    {
+        Slot* slab = new Slot[kSlabSize];
+        uint32_t base = (uint32_t)(slabs_.size() * kSlabSize);
+        slabs_.push_back(slab);
+        for (uint32_t i = kSlabSize; i > 0; i--)
+        {
+            Slot& slot = slab[i - 1];
+            slot.index = base + i - 1;
+            slot.generation = 0;
+            slot.next_free = free_;
+            free_ = slot.index;
+        }
+    }
+};
+
+#endif
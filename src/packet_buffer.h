@@ -0,0 +1,87 @@
+#ifndef _PACKET_BUFFER_H_
+#define _PACKET_BUFFER_H_
+
+//a packet in memory owned by someone else, with room kept in front of and
+//behind it. a header is pushed into the headroom and a trailer put into
+//the tailroom in place, a consumed header is pulled off the front, so the
+//payload never moves. the room has to be reserved when the packet is read
+class PacketBuffer
+{
+public:
+    PacketBuffer():
+        head_(NULL),
+        data_(NULL),
+        tail_(NULL),
+        end_(NULL)
+    {
+    }
+    //an empty packet headroom bytes into buf
+    void Reset(char* buf, size_t size, size_t headroom)
+    {
+        assert(headroom <= size);
+        head_ = buf;
+        data_ = buf + headroom;
+        tail_ = data_;
+        end_ = buf + size;
+    }
+    char* Data() const
+    {
+        return data_;
+    }
+    size_t Length() const
+    {
+        return tail_ - data_;
+    }
+    //where Put appends
+    char* Tail() const
+    {
+        return tail_;
+    }
+    size_t Headroom() const
+    {
+        return data_ - head_;
+    }
+    size_t Tailroom() const
+    {
+        return end_ - tail_;
+    }
+    //grow the packet at the front, NULL if the headroom is short
+    char* Push(size_t len)
+    {
+        if (len > Headroom())
+            return NULL;
+        data_ -= len;
+        return data_;
+    }
+    //drop len bytes from the front, NULL if the packet is shorter
+    char* Pull(size_t len)
+    {
+        if (len > Length())
+            return NULL;
+        data_ += len;
+        return data_;
+    }
+    //grow the packet at the end, the added bytes or NULL if the tailroom
+    //is short
+    char* Put(size_t len)
+    {
+        if (len > Tailroom())
+            return NULL;
+        char* added = tail_;
+        tail_ += len;
+        return added;
+    }
+    //cut the packet to len bytes
+    void Trim(size_t len)
+    {
+        if (len < Length())
+            tail_ = data_ + len;
+    }
+private:
+    char* head_;
+    char* data_;
+    char* tail_;
+    char* end_;
+};
+
+#endif
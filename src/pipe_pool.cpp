@@ -0,0 +1,59 @@
+#include "common.h"
+#include "pipe_pool.h"
+
+#ifndef _WIN32
+PipePool::PipePool()
+{
+}
+
+PipePool::~PipePool()
+{
+    for (auto& pipe : idle_)
+        Close(&pipe);
+    idle_.clear();
+}
+
+bool PipePool::Acquire(SplicePipe * pipe)
+{
+    if (!idle_.empty())
+    {
+        *pipe = idle_.back();
+        idle_.pop_back();
+        return true;
+    }
+    int fds[2];
+    if (-1 == pipe2(fds, O_NONBLOCK | O_CLOEXEC))
+    {
+        LOGW << "create pipe failed " << GetSocketErrorCode() << "\n";
+        return false;
+    }
+    pipe->read_fd = fds[0];
+    pipe->write_fd = fds[1];
+    pipe->pending = 0;
+    return true;
+}
+
+void PipePool::Release(SplicePipe * pipe)
+{
+    if (pipe->read_fd < 0)
+        return;
+    if (pipe->pending == 0 && idle_.size() < kMaxIdle)
+        idle_.push_back(*pipe);
+    else
+        Close(pipe);
+    Reset(pipe);
+}
+
+void PipePool::Reset(SplicePipe * pipe)
+{
+    pipe->read_fd = -1;
+    pipe->write_fd = -1;
+    pipe->pending = 0;
+}
+
+void PipePool::Close(SplicePipe * pipe)
+{
+    close(pipe->read_fd);
+    close(pipe->write_fd);
+}
+#endif
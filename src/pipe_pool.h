@@ -0,0 +1,32 @@
+#ifndef _PIPE_POOL_H_
+#define _PIPE_POOL_H_
+
+#ifndef _WIN32
+//pipe used to splice one direction of a connection
+struct SplicePipe
+{
+    int read_fd;
+    int write_fd;
+    size_t pending;//bytes spliced into the pipe but not out of it yet
+};
+
+//pipes of one event loop, a connection takes one per direction when it
+//starts splicing and gives it back on close. a pipe which still holds data
+//is closed instead of reused
+class PipePool
+{
+    const static size_t kMaxIdle = 64;
+public:
+    PipePool();
+    ~PipePool();
+    bool Acquire(SplicePipe* pipe);
+    void Release(SplicePipe* pipe);
+    static void Reset(SplicePipe* pipe);
+private:
+    vector<SplicePipe> idle_;
+
+    static void Close(SplicePipe* pipe);
+};
+#endif
+
+#endif
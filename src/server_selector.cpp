@@ -0,0 +1,222 @@
+#include "common.h"
+#include "server_selector.h"
+
+// weight of a new sample in the moving averages
+const double kEwmaAlpha = 0.2;
+
+// millisecond, what a failure rate of 1 adds to the connect time
+const double kFailurePenalty = 1000;
+
+ServerProbe::ServerProbe(ServerSelector * selector, EventLoop * event_loop, DNSResolve * dns_resolver,
+                         AddressLatency * latency, int index):
+    selector_(selector),
+    event_loop_(event_loop),
+    dns_resolver_(dns_resolver),
+    index_(index),
+    port_(0),
+    running_(false),
+    started_(0),
+    connector_(event_loop, latency, this),
+    timer_(this)
+{
+}
+
+ServerProbe::~ServerProbe()
+{
+    dns_resolver_->RemoveCallback(this);
+}
+
+void ServerProbe::Start(const string& address, int port, int timeout)
+{
+    running_ = true;
+    port_ = port;
+    started_ = event_loop_->Now();
+    event_loop_->AddTimer(&timer_, timeout);
+    //may be called back at once for an ip or a cached host
+    dns_resolver_->Resolve(address, this);
+}
+
+bool ServerProbe::IsRunning()
+{
+    return running_;
+}
+
+void ServerProbe::DNSResolvedAll(string hostname, const vector<string>& ips, string err)
+{
+    if (!err.empty() || ips.empty())
+    {
+        Finish(-1);
+        return;
+    }
+    connector_.Start(ips, port_, false);
+}
+
+void ServerProbe::Connected(SOCKET s)
+{
+    if (s == INVALID_SOCKET)
+    {
+        Finish(-1);
+        return;
+    }
+    CloseSocket(s);
+    Finish(event_loop_->Now() - started_);
+}
+
+void ServerProbe::HandleTimeout(Timer * timer)
+{
+    Finish(-1);
+}
+
+void ServerProbe::Finish(int64_t rtt)
+{
+    running_ = false;
+    timer_.Cancel();
+    connector_.Cancel();
+    dns_resolver_->RemoveCallback(this);
+    if (rtt >= 0)
+        selector_->ReportSuccess(index_, rtt);
+    else
+        selector_->ReportFailure(index_);
+}
+
+ServerSelector::ServerSelector(Config * config, EventLoop * event_loop, DNSResolve * dns_resolver):
+    event_loop_(event_loop),
+    dns_resolver_(dns_resolver),
+    probe_timer_(this)
+{
+    int default_port = config->GetInt("server_port");
+    stringstream list(config->GetStr("server_address"));
+    string item;
+    while (getline(list, item, ','))
+    {
+        if (item.empty())
+            continue;
+        Server server = { item, default_port, 0, 0, 0, false, NULL };
+        // host:port, an IPv6 literal has more than one colon
+        size_t colon = item.rfind(':');
+        if (colon != string::npos && item.find(':') == colon)
+        {
+            server.address = item.substr(0, colon);
+            server.port = atoi(item.c_str() + colon + 1);
+        }
+        servers_.push_back(server);
+    }
+    if (servers_.size() > 64)
+    {
+        LOGW << "only the first 64 servers are used\n";
+        servers_.resize(64);
+    }
+    for (size_t i = 0; i < servers_.size(); i++)
+    {
+        servers_[i].probe = new ServerProbe(this, event_loop_, dns_resolver_, &latency_, (int)i);
+    }
+    if (servers_.size() > 1)
+        LOGI << "select from " << servers_.size() << " servers\n";
+}
+
+ServerSelector::~ServerSelector()
+{
+    Close();
+}
+
+size_t ServerSelector::GetCount()
+{
+    return servers_.size();
+}
+
+double ServerSelector::Score(const Server & server)
+{
+    // a server not measured yet is tried first, so it gets a sample
+    return server.rtt + kFailurePenalty * server.failure_rate;
+}
+
+int ServerSelector::Select(uint64_t exclude, string * address, int * port)
+{
+    int best = -1;
+    for (size_t i = 0; i < servers_.size(); i++)
+    {
+        if (exclude & (1ULL << i))
+            continue;
+        if (best == -1)
+        {
+            best = (int)i;
+            continue;
+        }
+        Server& server = servers_[i];
+        Server& current = servers_[best];
+        if (server.down != current.down)
+        {
+            if (current.down)
+                best = (int)i;
+            continue;
+        }
+        // every server is down, use the one failing least
+        double score = server.down ? server.failure_rate : Score(server);
+        double best_score = current.down ? current.failure_rate : Score(current);
+        if (score < best_score)
+            best = (int)i;
+    }
+    if (best >= 0)
+    {
+        *address = servers_[best].address;
+        *port = servers_[best].port;
+    }
+    return best;
+}
+
+void ServerSelector::ReportSuccess(int index, int64_t rtt)
+{
+    if (index < 0 || index >= (int)servers_.size())
+        return;
+    Server& server = servers_[index];
+    if (rtt >= 0)
+        server.rtt = server.rtt == 0 ? rtt : server.rtt * (1 - kEwmaAlpha) + rtt * kEwmaAlpha;
+    server.failure_rate *= 1 - kEwmaAlpha;
+    server.failures = 0;
+    if (server.down)
+    {
+        server.down = false;
+        LOGI << "server " << server.address << ":" << server.port << " is up\n";
+    }
+}
+
+void ServerSelector::ReportFailure(int index)
+{
+    if (index < 0 || index >= (int)servers_.size())
+        return;
+    Server& server = servers_[index];
+    server.failure_rate = server.failure_rate * (1 - kEwmaAlpha) + kEwmaAlpha;
+    ++server.failures;
+    if (!server.down && server.failures >= kMaxFailures)
+    {
+        server.down = true;
+        LOGW << "server " << server.address << ":" << server.port << " is down\n";
+    }
+    if (server.down && !probe_timer_.IsActive())
+        event_loop_->AddTimer(&probe_timer_, kProbeInterval);
+}
+
+void ServerSelector::HandleTimeout(Timer * timer)
+{
+    bool any_down = false;
+    for (auto& server : servers_)
+    {
+        if (!server.down)
+            continue;
+        any_down = true;
+        if (!server.probe->IsRunning())
+            server.probe->Start(server.address, server.port, kProbeTimeout);
+    }
+    if (any_down && !probe_timer_.IsActive())
+        event_loop_->AddTimer(&probe_timer_, kProbeInterval);
+}
+
+void ServerSelector::Close()
+{
+    probe_timer_.Cancel();
+    for (auto& server : servers_)
+    {
+        delete server.probe;
+        server.probe = NULL;
+    }
+}
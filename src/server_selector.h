@@ -0,0 +1,73 @@
+#ifndef _SERVER_SELECTOR_H_
+#define _SERVER_SELECTOR_H_
+
+class ServerSelector;
+
+//connects to a server marked down, to find out when it's back
+class ServerProbe : public IDNSNotify, public IConnectNotify, public ITimerNotify
+{
+public:
+    ServerProbe(ServerSelector* selector, EventLoop* event_loop, DNSResolve* dns_resolver,
+                AddressLatency* latency, int index);
+    ~ServerProbe();
+    void Start(const string& address, int port, int timeout);
+    bool IsRunning();
+    virtual void DNSResolvedAll(string hostname, const vector<string>& ips, string err) override;
+    virtual void Connected(SOCKET s) override;
+    virtual void HandleTimeout(Timer* timer) override;
+private:
+    ServerSelector* selector_;
+    EventLoop* event_loop_;
+    DNSResolve* dns_resolver_;
+    int index_;
+    int port_;
+    bool running_;
+    int64_t started_;
+    HappyEyeballs connector_;
+    Timer timer_;
+
+    void Finish(int64_t rtt);
+};
+
+//the servers of the client, -s host[:port],host[:port]... every server keeps
+//an EWMA of its connect time and of its failure rate, fed by the connections
+//(passive) and by probes of the servers marked down (active). the server
+//with the lowest score is used, one marked down only if all of them are
+class ServerSelector : public ITimerNotify
+{
+    const static int kProbeInterval = 5000;//millisecond
+    const static int kProbeTimeout = 5000;//millisecond
+    const static int kMaxFailures = 2;//consecutive failures marking a server down
+    struct Server
+    {
+        string address;
+        int port;
+        double rtt;//millisecond, 0 until measured
+        double failure_rate;
+        int failures;//consecutive
+        bool down;
+        ServerProbe* probe;
+    };
+public:
+    ServerSelector(Config* config, EventLoop* event_loop, DNSResolve* dns_resolver);
+    ~ServerSelector();
+    size_t GetCount();
+    //index of the best server not in exclude (a bit per index), address
+    //and port are filled. -1 if every server is excluded
+    int Select(uint64_t exclude, string* address, int* port);
+    //rtt is the connect time in millisecond, negative if not measured
+    void ReportSuccess(int index, int64_t rtt);
+    void ReportFailure(int index);
+    virtual void HandleTimeout(Timer* timer) override;
+    void Close();
+private:
+    EventLoop* event_loop_;
+    DNSResolve* dns_resolver_;
+    vector<Server> servers_;
+    AddressLatency latency_;//of the probes
+    Timer probe_timer_;
+
+    double Score(const Server& server);
+};
+
+#endif
@@ -0,0 +1,363 @@
+#include "common.h"
+#include "stream_buffer.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#endif
+
+StreamBuffer::StreamBuffer(BufferPool* pool):
+    pool_(pool),
+    size_(0),
+    zerocopy_threshold_(0),
+    next_seq_(0),
+    completed_seq_(0)
+{
+}
+
+StreamBuffer::~StreamBuffer()
+{
+    Clear();
+}
+
+size_t StreamBuffer::Size()
+{
+    return size_;
+}
+
+bool StreamBuffer::Empty()
+{
+    return size_ == 0;
+}
+
+char* StreamBuffer::NewChunk(size_t size)
+{
+    if (pool_)
+        return pool_->Acquire(size);
+    return (char*)malloc(size);
+}
+
+void StreamBuffer::FreeChunk(char * data, size_t size)
+{
+    if (pool_)
+        pool_->Release(data, size);
+    else
+        free(data);
+}
+
+char* StreamBuffer::PrepareWrite(size_t want, size_t* len)
+{
+    // a sliver of space left would only cost a short read
+    if (chunks_.empty() || (chunks_.back().size - chunks_.back().end) * 4 < want)
+    {
+        Chunk chunk = { NewChunk(want), want, 0, 0, false, 0 };
+        chunks_.push_back(chunk);
+    }
+    Chunk& tail = chunks_.back();
+    *len = min(want, tail.size - tail.end);
+    return tail.data + tail.end;
+}
+
+void StreamBuffer::CommitWrite(size_t len)
+{
+    if (len == 0)
+        return;
+    chunks_.back().end += len;
+    size_ += len;
+}
+
+void StreamBuffer::AbortWrite()
+{
+    if (chunks_.empty())
+        return;
+    Chunk& tail = chunks_.back();
+    if (tail.begin == tail.end && !tail.pinned)
+    {
+        FreeChunk(tail.data, tail.size);
+        chunks_.pop_back();
+    }
+}
+
+void StreamBuffer::Append(const char * data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = 0;
+        char* tail = PrepareWrite(min(len, (size_t)kChunkSize), &n);
+        memcpy(tail, data, n);
+        CommitWrite(n);
+        data += n;
+        len -= n;
+    }
+}
+
+void StreamBuffer::Prepend(const char* data, size_t len)
+{
+    if (len == 0)
+        return;
+    Chunk chunk = { NewChunk(len), len, 0, len, false, 0 };
+    memcpy(chunk.data, data, len);
+    chunks_.push_front(chunk);
+    size_ += len;
+}
+
+size_t StreamBuffer::Peek(vector<char>* out, size_t len)
+{
+    size_t copied = 0;
+    for (auto& chunk : chunks_)
+    {
+        if (copied == len)
+            break;
+        size_t n = min(len - copied, chunk.end - chunk.begin);
+        out->insert(out->end(), chunk.data + chunk.begin, chunk.data + chunk.begin + n);
+        copied += n;
+    }
+    return copied;
+}
+
+#ifndef _WIN32
+int StreamBuffer::PeekIov(iovec* iov, int max)
+{
+    int count = 0;
+    for (auto& chunk : chunks_)
+    {
+        if (count == max)
+            break;
+        if (chunk.end == chunk.begin)
+            continue;
+        iov[count].iov_base = chunk.data + chunk.begin;
+        iov[count].iov_len = chunk.end - chunk.begin;
+        ++count;
+    }
+    return count;
+}
+#endif
+
+void StreamBuffer::Consume(size_t len)
+{
+    len = min(len, size_);
+    size_ -= len;
+    while (len > 0)
+    {
+        Chunk& head = chunks_.front();
+        size_t n = min(len, head.end - head.begin);
+        head.begin += n;
+        len -= n;
+        if (head.begin == head.end)
+        {
+            ReleaseChunk(head);
+            chunks_.pop_front();
+        }
+    }
+    //keep the space of the last chunk reusable once it is drained,
+    //unless the kernel still reads it
+    if (size_ == 0 && !chunks_.empty() && !chunks_.front().pinned)
+    {
+        chunks_.front().begin = chunks_.front().end = 0;
+    }
+}
+
+int StreamBuffer::Send(SOCKET s)
+{
+    int count = 0;
+#ifdef _WIN32
+    WSABUF bufs[kMaxIov];
+    for (auto& chunk : chunks_)
+    {
+        if (count == kMaxIov)
+            break;
+        bufs[count].buf = chunk.data + chunk.begin;
+        bufs[count].len = (ULONG)(chunk.end - chunk.begin);
+        ++count;
+    }
+    DWORD sent = 0;
+    if (SOCKET_ERROR == WSASend(s, bufs, count, &sent, 0, NULL, NULL))
+        return -1;
+    int ret = (int)sent;
+#else
+    iovec iov[kMaxIov];
+    for (auto& chunk : chunks_)
+    {
+        if (count == kMaxIov)
+            break;
+        iov[count].iov_base = chunk.data + chunk.begin;
+        iov[count].iov_len = chunk.end - chunk.begin;
+        ++count;
+    }
+    int ret = -1;
+    bool sent = false;
+#ifdef MSG_ZEROCOPY
+    if (zerocopy_threshold_ > 0 && size_ >= zerocopy_threshold_)
+    {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ret = (int)sendmsg(s, &msg, MSG_ZEROCOPY);
+        if (ret > 0)
+            Pin(ret);
+        // ENOBUFS when the pages can't be pinned (optmem limit), copy instead
+        sent = ret >= 0 || errno != ENOBUFS;
+    }
+#endif
+    if (!sent)
+        ret = (int)writev(s, iov, count);
+    if (ret < 0)
+        return -1;
+#endif
+    Consume(ret);
+    return ret;
+}
+
+void StreamBuffer::SetZeroCopy(size_t threshold)
+{
+    zerocopy_threshold_ = threshold;
+}
+
+// seq numbers wrap, compare them as a window
+bool StreamBuffer::IsCompleted(uint32_t seq)
+{
+    return (int32_t)(seq - completed_seq_) < 0;
+}
+
+void StreamBuffer::ReleaseChunk(const Chunk& chunk)
+{
+    if (chunk.pinned && !IsCompleted(chunk.seq))
+        pinned_.push_back(chunk);
+    else
+        FreeChunk(chunk.data, chunk.size);
+}
+
+// every zero copy send takes the next seq, the chunks it reads keep it
+void StreamBuffer::Pin(size_t len)
+{
+    for (auto& chunk : chunks_)
+    {
+        if (len == 0)
+            break;
+        chunk.pinned = true;
+        chunk.seq = next_seq_;
+        len -= min(len, chunk.end - chunk.begin);
+    }
+    ++next_seq_;
+}
+
+void StreamBuffer::ReadCompletions(SOCKET s)
+{
+#ifdef MSG_ZEROCOPY
+    char control[128];
+    msghdr msg;
+    while (true)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s, &msg, MSG_ERRQUEUE) == -1)
+            break;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                    (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+            sock_extended_err* err = (sock_extended_err*)CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // sends ee_info to ee_data have completed, TCP completes in order
+            if (!IsCompleted(err->ee_data))
+                completed_seq_ = err->ee_data + 1;
+            // the kernel copied anyway (e.g. loopback), pinning only costs
+            if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && zerocopy_threshold_ > 0)
+            {
+                LOGI << "zero copy fell back to copying, turned off\n";
+                zerocopy_threshold_ = 0;
+            }
+        }
+    }
+#endif
+    while (!pinned_.empty() && IsCompleted(pinned_.front().seq))
+    {
+        FreeChunk(pinned_.front().data, pinned_.front().size);
+        pinned_.pop_front();
+    }
+    for (auto& chunk : chunks_)
+    {
+        if (chunk.pinned && IsCompleted(chunk.seq))
+            chunk.pinned = false;
+    }
+}
+
+bool StreamBuffer::HasPinned()
+{
+    if (!pinned_.empty())
+        return true;
+    for (auto& chunk : chunks_)
+    {
+        if (chunk.pinned)
+            return true;
+    }
+    return false;
+}
+
+void StreamBuffer::Swap(StreamBuffer & other)
+{
+    swap(pool_, other.pool_);
+    chunks_.swap(other.chunks_);
+    swap(size_, other.size_);
+    swap(zerocopy_threshold_, other.zerocopy_threshold_);
+    swap(next_seq_, other.next_seq_);
+    swap(completed_seq_, other.completed_seq_);
+    pinned_.swap(other.pinned_);
+}
+
+void StreamBuffer::Clear()
+{
+    for (auto& chunk : chunks_)
+        FreeChunk(chunk.data, chunk.size);
+    chunks_.clear();
+    for (auto& chunk : pinned_)
+        FreeChunk(chunk.data, chunk.size);
+    pinned_.clear();
+    size_ = 0;
+}
+
+ReadSizer::ReadSizer(size_t min_size, size_t max_size, size_t initial):
+    min_(RoundUp(min_size)),
+    max_(RoundUp(max(min_size, max_size))),
+    size_(min(max(RoundUp(initial), min_), max_))
+{
+}
+
+size_t ReadSizer::Get()
+{
+    return size_;
+}
+
+void ReadSizer::Hint(size_t available)
+{
+    if (available > 0)
+        size_ = min(max(RoundUp(available), min_), max_);
+}
+
+void ReadSizer::Update(size_t want, size_t len, size_t got)
+{
+    if (got == want && size_ < max_)
+        size_ *= 2;
+    else if (got < len && got * 2 <= want && size_ > min_)
+        size_ /= 2;
+}
+
+int ReadSizer::BucketOf(size_t size)
+{
+    int bucket = 0;
+    while (bucket < kBuckets - 1 && size > (kMinBucketSize << bucket))
+        ++bucket;
+    return bucket;
+}
+
+size_t ReadSizer::RoundUp(size_t size)
+{
+    size_t rounded = 1;
+    while (rounded < size)
+        rounded *= 2;
+    return rounded;
+}
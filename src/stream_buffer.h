@@ -0,0 +1,108 @@
+#ifndef _STREAM_BUFFER_H_
+#define _STREAM_BUFFER_H_
+
+//byte queue of one stream direction, a chain of chunks sized by the reads.
+//recv writes into the free space of the last chunk and send drains the
+//chunks in place with a gather write, so nothing is moved or copied
+//after it has been received. chunks come from the loop's buffer pool.
+//with zero copy a large send passes MSG_ZEROCOPY, the kernel reads the
+//chunks in place until it reports completion on the error queue, so a sent
+//chunk is pinned until then instead of going back to the pool
+class StreamBuffer
+{
+    const static size_t kChunkSize = 32 * 1024;//of the appended data
+    const static int kMaxIov = 16;
+    struct Chunk
+    {
+        char* data;
+        size_t size;
+        size_t begin;
+        size_t end;
+        bool pinned;
+        uint32_t seq;//the last zero copy send reading the chunk
+    };
+public:
+    StreamBuffer(BufferPool* pool = NULL);
+    ~StreamBuffer();
+    size_t Size();
+    bool Empty();
+    //contiguous free space of at most want bytes at the tail, a new chunk
+    //of want bytes if the tail has less than a quarter of it
+    char* PrepareWrite(size_t want, size_t* len);
+    void CommitWrite(size_t len);
+    //nothing was written after PrepareWrite, give back the tail chunk if it
+    //holds no data so an idle stream keeps no buffer
+    void AbortWrite();
+    void Append(const char* data, size_t len);
+    //put data in front of the queued bytes, in a chunk of its own
+    void Prepend(const char* data, size_t len);
+    //append up to len bytes from the head to out without consuming them,
+    //the bytes copied
+    size_t Peek(vector<char>* out, size_t len);
+#ifndef _WIN32
+    //the queued data in place from the head, a chunk each and at most max,
+    //the count. the chunks stay until the bytes are consumed
+    int PeekIov(iovec* iov, int max);
+#endif
+    //drop len bytes from the head
+    void Consume(size_t len);
+    //write as much as possible to s, return the bytes sent or -1
+    int Send(SOCKET s);
+    //sends of at least threshold bytes use MSG_ZEROCOPY, s must have
+    //SO_ZEROCOPY set. 0 turns it off
+    void SetZeroCopy(size_t threshold);
+    //read the completions from the error queue of s and release the chunks
+    //the kernel is done with
+    void ReadCompletions(SOCKET s);
+    //zero copy sends not completed yet
+    bool HasPinned();
+    void Swap(StreamBuffer& other);
+    void Clear();
+private:
+    BufferPool* pool_;
+    deque<Chunk> chunks_;
+    size_t size_;
+    size_t zerocopy_threshold_;
+    uint32_t next_seq_;//of the next zero copy send
+    uint32_t completed_seq_;//every send before it has completed
+    deque<Chunk> pinned_;//consumed, waiting for the completion
+
+    StreamBuffer(const StreamBuffer&);
+    StreamBuffer& operator=(const StreamBuffer&);
+    char* NewChunk(size_t size);
+    void FreeChunk(char* data, size_t size);
+    bool IsCompleted(uint32_t seq);
+    //the chunk is consumed, free it once the kernel is done with it
+    void ReleaseChunk(const Chunk& chunk);
+    void Pin(size_t len);
+};
+
+//read size of one stream direction between a min and a max, both powers
+//of two. a read filling the whole buffer doubles it, a read draining the
+//socket with half of it or less halves it, so a bulk transfer soon reads
+//in large blocks and an interactive session in small ones
+class ReadSizer
+{
+public:
+    //reads counted by size, up to 4KB, 8KB ... 256KB and larger
+    const static int kBuckets = 8;
+    const static size_t kMinBucketSize = 4 * 1024;
+
+    ReadSizer(size_t min_size, size_t max_size, size_t initial);
+    size_t Get();
+    //the bytes available to read (FIONREAD), the next read takes them all
+    //if the max allows
+    void Hint(size_t available);
+    //want was asked, len was offered (the free space of the tail can be
+    //less than want) and got were read
+    void Update(size_t want, size_t len, size_t got);
+    static int BucketOf(size_t size);
+    //the smallest power of two not less than size
+    static size_t RoundUp(size_t size);
+private:
+    size_t min_;
+    size_t max_;
+    size_t size_;
+};
+
+#endif
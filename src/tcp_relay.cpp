@@ -63,11 +63,45 @@ const int kWaitStatusReading = 1;
 const int kWaitStatusWriting = 2;
 const int kWaitStatusReadWriting = kWaitStatusReading | kWaitStatusWriting;
 
+// in edge triggered mode a socket is drained until EAGAIN, but no more than
+// this many bytes per event so one busy socket can't starve the loop
+const int kEdgeReadBudget = 256 * 1024;
+
+// bounds of the adaptive read size, the largest buffer the pool keeps
+const int kMinReadSize = 4 * 1024;
+const int kMaxReadSize = 64 * 1024;
+
+// a direction stops reading when the queue of its destination reaches the
+// high watermark and starts again once it has drained to the low watermark
+const int kHighWatermark = 256 * 1024;
+const int kLowWatermark = 64 * 1024;
+
+// bytes moved into a splice pipe at once, the default pipe capacity
+const int kSpliceChunk = 64 * 1024;
+
+// connections accepted per listener event, the rest waits for the next
+// iteration so a connection storm can't starve the established ones
+const int kAcceptBatch = 64;
+
+// default timeout of each stage, second
+const int kHandshakeTimeout = 30;
+const int kDnsTimeout = 10;
+const int kConnectTimeout = 10;
+const int kIdleTimeout = 300;
+
+// data sent over a fast open connect kept for a fail over, past it a
+// failed connect isn't replayed
+const size_t kMaxFastOpenReplay = 64 * 1024;
+
+// sends linked in one chain of an io_uring stream, a chunk each
+const int kMaxLinkedSends = 32;
+
 
 TCPRelayHandler::TCPRelayHandler(TCPRelay * server,
                                  EventLoop * event_loop,
                                  DNSResolve* dns_resolver,
                                  SOCKET local_socket,
+                                 const sockaddr_storage& local_addr,
                                  Config * config,
                                  bool is_local):
     server_(server),
@@ -77,39 +111,127 @@ TCPRelayHandler::TCPRelayHandler(TCPRelay * server,
     remote_socket_(INVALID_SOCKET),
     config_(config),
     is_local_(is_local),
+    edge_triggered_(config->GetInt("edge_triggered") == 1),
+    splice_(config->GetInt("splice") == 1),
+    zerocopy_(false),
     stage_(kStageInit),
+    local_eof_(false),
+    remote_eof_(false),
+    high_watermark_(config->GetInt("high_watermark", kHighWatermark)),
+    low_watermark_(config->GetInt("low_watermark", kLowWatermark)),
+    read_hint_(config->GetInt("read_hint") == 1),
+    header_parser_(is_local ? 3 : 0),
+    local_sizer_(config->GetInt("min_buffer", kMinReadSize), config->GetInt("max_buffer", kMaxReadSize),
+                 is_local ? kUpStreamBufSize : kDownStreamBufSize),
+    remote_sizer_(config->GetInt("min_buffer", kMinReadSize), config->GetInt("max_buffer", kMaxReadSize),
+                  is_local ? kUpStreamBufSize : kDownStreamBufSize),
+    server_index_(-1),
+    tried_servers_(0),
+    connect_started_(0),
+    fast_open_pending_(false),
+    fast_open_replay_(false),
+    data_write_to_local_(event_loop->GetBufferPool()),
+    data_write_to_remote_(event_loop->GetBufferPool()),
     upstream_status_(kWaitStatusReading),
     downstream_status_(kWaitStatusInit),
     recv_data_size(0),
-    send_data_size(0)
+    send_data_size(0),
+    timer_(this),
+    last_active_(event_loop->Now()),
+    connector_(event_loop, server->GetAddressLatency(), this),
+    dispatching_(false),
+    completion_(false),
+    try_completion_(config->GetInt("io_uring") == 1),
+    local_sends_(0),
+    remote_sends_(0),
+    sends_canceled_(false)
 {
+    if (low_watermark_ > high_watermark_)
+        low_watermark_ = high_watermark_;
+#ifndef _WIN32
+    PipePool::Reset(&up_pipe_);
+    PipePool::Reset(&down_pipe_);
+#endif
     if (is_local_)
     {
         SelectAServer();
     }
-    SetNoBlocking(local_socket_);
+    if (config_->GetInt("no_delay") == 1)
+        SetNoDelay(local_socket_);
+#ifndef _WIN32
+    // the downloads sent to the client are the bulk of a server's sends
+    int zerocopy = config_->GetInt("zerocopy", 0);
+    if (!is_local_ && zerocopy > 0 && 0 == SetZeroCopy(local_socket_))
+    {
+        zerocopy_ = true;
+        data_write_to_local_.SetZeroCopy(zerocopy);
+    }
+#endif
+    // the socket is accepted non-blocking with its peer address
+    local_address_ = GetIpStr((const sockaddr*)&local_addr);
+    if (local_addr.ss_family == AF_INET6)
+        local_port_ = ((const sockaddr_in6*)&local_addr)->sin6_port;
+    else
+        local_port_ = ((const sockaddr_in*)&local_addr)->sin_port;
 
-    int addr_len = sizeof(sockaddr_in);
-    sockaddr_in addr;
-    GetPeerName(local_socket_, (sockaddr*)&addr, &addr_len);
-    char buf[30];
-    inet_ntop(addr.sin_family, &addr.sin_addr, buf, 30);
-    local_address_ = buf;
-    local_port_ = addr.sin_port;
+    event_loop_->Add(local_socket_, kPollIn | kPollErr | (edge_triggered_ ? kPollEdge : 0),
+                     static_cast<ISockNotify*>(this));
+    SetStageTimeout("handshake_timeout", kHandshakeTimeout);
+}
 
-    event_loop_->Add(local_socket_, kPollIn | kPollErr, static_cast<ISockNotify*>(this->server_));
-    server_->AddHandler(local_socket_, this);
+void TCPRelayHandler::SetStageTimeout(const char* key, int default_timeout)
+{
+    int timeout = config_->GetInt(key, default_timeout);
+    if (timeout > 0)
+        event_loop_->AddTimer(&timer_, timeout * 1000);
+    else
+        timer_.Cancel();
 }
 
-void TCPRelayHandler::SelectAServer()
+bool TCPRelayHandler::SelectAServer()
 {
-    remote_address_ = config_->GetStr("server_address");
-    remote_port_ = config_->GetInt("server_port");
+    int port = 0;
+    server_index_ = server_->GetServerSelector()->Select(tried_servers_, &remote_address_, &port);
+    if (server_index_ < 0)
+        return false;
+    tried_servers_ |= 1ULL << server_index_;
+    remote_port_ = port;
+    return true;
+}
+
+// the relay is the callback, the token finds the handler if it still lives
+void TCPRelayHandler::Resolve(const string& hostname)
+{
+    dns_resolver_->Resolve(hostname, server_, server_->GetHandlerToken(this));
+}
+
+void TCPRelayHandler::CancelResolve()
+{
+    dns_resolver_->RemoveCallback(server_, server_->GetHandlerToken(this));
+}
+
+bool TCPRelayHandler::Failover()
+{
+    if (!is_local_ || server_index_ < 0)
+        return false;
+    server_->GetServerSelector()->ReportFailure(server_index_);
+    if (!SelectAServer())
+        return false;
+    LOGI << "fail over to " << remote_address_ << ":" << remote_port_ << "\n";
+    // the local data waits in the socket until the next server is connecting
+    UpdateStream(kStreamUp, kWaitStatusWriting);
+    stage_ = kStageDns;
+    SetStageTimeout("dns_timeout", kDnsTimeout);
+    //may be called back at once for an ip or a cached host
+    Resolve(remote_address_);
+    return true;
 }
 
 void TCPRelayHandler::UpdateStream(int stream, int status)
 {
     bool dirty = false;
+    int old_upstream = upstream_status_;
+    int old_downstream = downstream_status_;
     if (stream == kStreamDown)
     {
         if (downstream_status_ != status)
@@ -127,10 +249,27 @@ void TCPRelayHandler::UpdateStream(int stream, int status)
         }
     }
     if (!dirty) return;
+    UpdateInterest();
+    if (edge_triggered_)
+    {
+        // the loop skips a change back to the registered mask, so a socket
+        // left undrained may never see another edge, read it again anyway
+        if (!(old_upstream & kWaitStatusReading) && (upstream_status_ & kWaitStatusReading) &&
+                local_socket_ != INVALID_SOCKET)
+            event_loop_->Repost(local_socket_, kPollIn);
+        if (!(old_downstream & kWaitStatusReading) && (downstream_status_ & kWaitStatusReading) &&
+                remote_socket_ != INVALID_SOCKET && stage_ == kStageStream)
+            event_loop_->Repost(remote_socket_, kPollIn);
+    }
+}
+
+// with completions a send is in flight instead of waiting for writable
+void TCPRelayHandler::UpdateInterest()
+{
     if (local_socket_ != INVALID_SOCKET)
     {
-        int event = kPollErr;
-        if (downstream_status_ & kWaitStatusWriting)
+        int event = kPollErr | (edge_triggered_ ? kPollEdge : 0);
+        if ((downstream_status_ & kWaitStatusWriting) && !completion_)
             event |= kPollOut;
         if (upstream_status_ & kWaitStatusReading)
             event |= kPollIn;
@@ -138,87 +277,136 @@ void TCPRelayHandler::UpdateStream(int stream, int status)
     }
     if (remote_socket_ != INVALID_SOCKET)
     {
-        int event = kPollErr;
+        int event = kPollErr | (edge_triggered_ ? kPollEdge : 0);
         if (downstream_status_ & kWaitStatusReading)
             event |= kPollIn;
-        if (upstream_status_ & kWaitStatusWriting)
+        // the handshake of a fast open connect makes it writable
+        if (((upstream_status_ & kWaitStatusWriting) && !completion_) || fast_open_pending_)
             event |= kPollOut;
         event_loop_->Modify(remote_socket_, event);
     }
 }
 
-bool TCPRelayHandler::WriteToSock(vector<char>& data, SOCKET s)
+bool TCPRelayHandler::WriteToSock(const char* data, size_t len, SOCKET s)
+{
+    if (len == 0 || s == INVALID_SOCKET)
+        return true;
+    // queue behind the pending data so the stream keeps its order
+    StreamBuffer& pending = s == local_socket_ ? data_write_to_local_ : data_write_to_remote_;
+    pending.Append(data, len);
+    return FlushSock(s);
+}
+
+// send the queued data of s, wait until s is writable if some is left.
+// the source keeps reading until the queue reaches the high watermark
+bool TCPRelayHandler::FlushSock(SOCKET s, bool writable)
 {
-    if (data.empty() || s == INVALID_SOCKET)
+    if (s == INVALID_SOCKET)
         return true;
-    bool uncomplete = false;
-    int ret = BufferSend(s, &data[0], data.size());
-    if (ret == -1)
+    bool to_local = s == local_socket_;
+    int status = to_local ? downstream_status_ : upstream_status_;
+    StreamBuffer& pending = to_local ? data_write_to_local_ : data_write_to_remote_;
+    if (completion_)
     {
-        if (!SocketIsBlock(s))
-        {
-            this->Destroy();
+        SubmitSends(s);
+        if (IsDestroyed())
             return false;
-        }
-        else
+    }
+    // while waiting for writable a send would only fail with EAGAIN
+    else if (!pending.Empty() && (writable || !(status & kWaitStatusWriting)))
+    {
+        size_t kept = fast_open_sent_.size();
+        size_t copied = 0;
+        bool replay = !to_local && fast_open_pending_ && fast_open_replay_;
+        if (replay)
+            copied = pending.Peek(&fast_open_sent_, kMaxFastOpenReplay - kept);
+        int ret = pending.Send(s);
+        bool failed = ret == -1 && !SocketIsBlock(s);
+        if (replay && ret > (int)copied)
         {
-            uncomplete = true;
+            // more has gone than is kept, stop keeping it
+            fast_open_replay_ = false;
+            vector<char>().swap(fast_open_sent_);
         }
-    }
-    else if (ret >= 0 && (size_t)ret < data.size())
-    {
-        uncomplete = true;
-    }
-    if (ret >= 0)
-    {
-        data.erase(data.begin(), data.begin() + ret);
-    }
-    if (ret > 0 && s == local_socket_)
-        send_data_size += ret;
-    if (uncomplete)
-    {
-        if (s == local_socket_)
+        else if (replay)
         {
-            this->data_write_to_local_.insert(data_write_to_local_.end(), data.begin(), data.end());
-            UpdateStream(kStreamDown, kWaitStatusWriting);
+            fast_open_sent_.resize(kept + max(ret, 0));
         }
-        else if (s == remote_socket_)
+        if (failed)
         {
-            this->data_write_to_remote_.insert(data_write_to_remote_.end(), data.begin(), data.end());
-            UpdateStream(kStreamUp, kWaitStatusWriting);
+            if (!to_local && FastOpenFailed())
+                return false;
+            this->Destroy();
+            return false;
         }
+        if (ret > 0 && to_local)
+            send_data_size += ret;
     }
-    else
+    size_t size = pending.Size();
+    if (size == 0 && (to_local ? remote_eof_ : local_eof_))
     {
-        if (s == local_socket_)
-        {
-            UpdateStream(kStreamDown, kWaitStatusReading);
-        }
-        else if (s == remote_socket_)
-        {
-            UpdateStream(kStreamUp, kWaitStatusReading);
-        }
+        this->Destroy();
+        return false;
     }
+    if (size == 0)
+        status = kWaitStatusReading;
+    else if (size >= (size_t)high_watermark_)
+        status = kWaitStatusWriting;
+    else if (!(status & kWaitStatusReading) && size > (size_t)low_watermark_)
+        status = kWaitStatusWriting;// paused, wait for the low watermark
+    else
+        status = kWaitStatusReadWriting;
+    UpdateStream(to_local ? kStreamDown : kStreamUp, status);
     return true;
 }
 
-void TCPRelayHandler::HandleStageConnecting(vector<char>& data)
+void TCPRelayHandler::HandleStageConnecting(const char* data, size_t len)
 {
     if (!is_local_)
     {
-        data_write_to_remote_.insert(data_write_to_remote_.end(), data.begin(), data.end());
-        return;
+        data_write_to_remote_.Append(data, len);
     }
-    //TODO encrypt
-    data_write_to_remote_.insert(data_write_to_remote_.end(), data.begin(), data.end());
+    else
+    {
+        //TODO encrypt
+        data_write_to_remote_.Append(data, len);
+    }
+    // remote isn't connected yet, stop reading once the queue is full
+    if (data_write_to_remote_.Size() >= (size_t)high_watermark_)
+        UpdateStream(kStreamUp, kWaitStatusWriting);
 
 }
 
-void TCPRelayHandler::HandleStageAddr(vector<char>& data)
+// data is the read buffer, the parser copies the header out of it
+void TCPRelayHandler::HandleStageAddr(const char* data, size_t len)
 {
+    if (!is_local_ && header_parser_.GetFedLength() == 0 && (uint8_t)data[0] == kMuxMagic)
+    {
+        // a tunnel of the client, not a single request
+        SOCKET s = local_socket_;
+        event_loop_->Remove(local_socket_);
+        local_socket_ = INVALID_SOCKET;
+        server_->AcceptTunnel(s, data + 1, len - 1);
+        this->Destroy();
+        return;
+    }
+    size_t used = 0;
+    int result = header_parser_.Feed(data, len, &used);
+    if (result == HeaderParser::kParseError)
+    {
+        LOGW << "unknown header \n";
+        this->Destroy();
+        return;
+    }
+    // the rest of the header comes with the next read
+    if (result == HeaderParser::kParseIncomplete)
+        return;
+    const char* payload = data + used;
+    size_t payload_len = len - used;
     if (is_local_)
     {
-        uint8_t cmd = data[1];
+        // VER CMD RSV before the header
+        uint8_t cmd = header_parser_.GetPrefix()[1];
         if (cmd == kCmdUdpAssociate)
         {
             LOGI << "UDP associate\n";
@@ -227,105 +415,99 @@ void TCPRelayHandler::HandleStageAddr(vector<char>& data)
             inet_pton(AF_INET, local_address_.c_str(), &ipaddr);
             memcpy(&response_data[4], &ipaddr, 4);
             memcpy(&response_data[8], &local_port_, 2);
-            vector<char> response(&response_data[0], &response_data[10]);
-            WriteToSock(response, local_socket_);
+            WriteToSock(response_data, sizeof(response_data), local_socket_);
             stage_ = kStageUdpAssoc;
+            timer_.Cancel();
             //just wait for the client to disconnect
             return;
         }
-        else if (cmd == kCmdConnect)
-        {
-            //just trim VER CMD RSV
-            data.erase(data.begin(), data.begin() + 3);
-        }
-        else
+        else if (cmd != kCmdConnect)
         {
             LOGW << "unknown command " << cmd << "\n";
             this->Destroy();
             return;
         }
     }
-    Sock5Header header_result;
-    if (!ParseHeader(data, &header_result))
-    {
-        LOGW << "unknown header \n";
-        this->Destroy();
-        return;
-    }
-    LOGI << "connecting " << header_result.remote_addr << ":" << header_result.remote_port << "\n";
+    // the text is made on the stack, a string only where it's kept
+    char address[HeaderParser::kMaxAddressLength];
+    LOGI << "connecting " << header_parser_.GetAddress(address) << ":" << header_parser_.GetPort() << "\n";
     UpdateStream(kStreamUp, kWaitStatusWriting);
     stage_ = kStageDns;
+    SetStageTimeout("dns_timeout", kDnsTimeout);
 
     if (is_local_)
     {
         //jump over socks5 response
         char response_data[] = { 0x05, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x10, 0x10 };
-        vector<char> response(&response_data[0], &response_data[10]);
-        if (!WriteToSock(response, local_socket_))
+        if (!WriteToSock(response_data, sizeof(response_data), local_socket_))
+            return;
+        // the stream goes through a tunnel, the handler isn't needed anymore
+        MuxTunnel* tunnel = data_write_to_local_.Empty() ? server_->GetMuxTunnel() : NULL;
+        if (tunnel)
+        {
+            SOCKET s = local_socket_;
+            event_loop_->Remove(local_socket_);
+            local_socket_ = INVALID_SOCKET;
+            tunnel->OpenStream(s, header_parser_.GetHeader(), header_parser_.GetHeaderLength(),
+                               payload, payload_len);
+            this->Destroy();
+            return;
+        }
+        // the header goes to the server as it came
+        data_write_to_remote_.Append(header_parser_.GetHeader(), header_parser_.GetHeaderLength());
+        if (payload_len > 0)
+            data_write_to_remote_.Append(payload, payload_len);
+        // a warm connection skips both the dns and the TCP handshake
+        remote_socket_ = server_->ClaimConnection();
+        if (remote_socket_ != INVALID_SOCKET)
+        {
+            // the pool picked its server itself
+            server_index_ = -1;
+            StartConnecting();
             return;
-        data_write_to_remote_.insert(
-            data_write_to_remote_.end(),
-            data.begin(),
-            data.end());
+        }
         //dns resolve
-        dns_resolver_->Resolve(this->remote_address_, this);
+        Resolve(this->remote_address_);
     }
     else
     {
-        if (data.size() > header_result.header_length)
+        if (payload_len > 0)
+            data_write_to_remote_.Append(payload, payload_len);
+        this->remote_address_.assign(address);
+        this->remote_port_ = header_parser_.GetPort();
+        sockaddr_storage addr;
+        int addr_len = header_parser_.GetSockAddr(&addr);
+        if (addr_len == 0)
         {
-            data_write_to_remote_.insert(
-                data_write_to_remote_.end(),
-                data.begin() + header_result.header_length,
-                data.end());
+            Resolve(this->remote_address_);
+            return;
         }
-        this->remote_address_ = header_result.remote_addr;
-        this->remote_port_ = header_result.remote_port;
-        dns_resolver_->Resolve(header_result.remote_addr, this);
+        // an IP literal, nothing to resolve
+        stage_ = kStageConnecting;
+        SetStageTimeout("connect_timeout", kConnectTimeout);
+        connect_started_ = event_loop_->Now();
+        connector_.Connect(addr, addr_len, false);
     }
 }
 
-SOCKET TCPRelayHandler::CreateRemoteSocket(string ip, int port)
-{
-    addrinfo hints;
-    addrinfo *result = NULL;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-
-    stringstream ss;
-    ss << port;
-    int ret = getaddrinfo(ip.c_str(), ss.str().c_str(), &hints, &result);
-    if (result == NULL)
-    {
-        LOGW << "getaddrinfo failed for " << ip << ":" << port << "\n";
-        return INVALID_SOCKET;
-    }
-    remote_socket_ = socket(result[0].ai_family, result[0].ai_socktype, result[0].ai_protocol);
-    SetNoBlocking(remote_socket_);
-    server_->AddHandler(remote_socket_, this);
-    freeaddrinfo(result);
-    return remote_socket_;
-}
-
-void TCPRelayHandler::HandleStageStream(vector<char>& data)
+// the data has been received into data_write_to_remote_
+void TCPRelayHandler::HandleStageStream()
 {
     if (is_local_)
     {
-        //TODO encrypt
-        WriteToSock(data, remote_socket_);
+        //TODO encrypt in place
+        FlushSock(remote_socket_);
     }
     else
     {
-        WriteToSock(data, remote_socket_);
+        FlushSock(remote_socket_);
     }
 }
 
-void TCPRelayHandler::CheckAuthMethod(vector<char>& data)
+void TCPRelayHandler::CheckAuthMethod(const char* data, size_t len)
 {
     // VER, NMETHODS, and at least 1 METHODS
-    if (data.size() < 3)
+    if (len < 3)
     {
         LOGE << "method selection header too short\n";
         throw BadSocksHeader();
@@ -337,13 +519,13 @@ void TCPRelayHandler::CheckAuthMethod(vector<char>& data)
         LOGE << "unsupported SOCKS protocol version " << (int)socks_version << "\n";
         throw BadSocksHeader();
     }
-    if (nmethods < 1 || data.size() != nmethods + 2)
+    if (nmethods < 1 || len != (size_t)nmethods + 2)
     {
         LOGE << "NMETHODS and number of METHODS mismatch\n";
         throw BadSocksHeader();
     }
     bool noauth_exist = false;
-    for (size_t i = 2; i < data.size(); i++)
+    for (size_t i = 2; i < len; i++)
     {
         if (data[i] == kMethodNoauth)
         {
@@ -359,11 +541,11 @@ void TCPRelayHandler::CheckAuthMethod(vector<char>& data)
     }
 }
 
-void TCPRelayHandler::HandleStageInit(vector<char>& data)
+void TCPRelayHandler::HandleStageInit(const char* data, size_t len)
 {
     try
     {
-        CheckAuthMethod(data);
+        CheckAuthMethod(data, len);
     }
     catch (const BadSocksHeader)
     {
@@ -372,14 +554,12 @@ void TCPRelayHandler::HandleStageInit(vector<char>& data)
     catch (const NoAcceptableMethods)
     {
         char data1[2] = { (char)0x05, (char)0xff };
-        vector<char> response(&data[0], &data[2]);
-        WriteToSock(response, local_socket_);
+        WriteToSock(data1, sizeof(data1), local_socket_);
         if(!IsDestroyed())
             this->Destroy();
     }
     char data2[2] = { (char)0x05, (char)0x00 };
-    vector<char> response(&data2[0], &data2[2]);
-    if(WriteToSock(response, local_socket_))
+    if(WriteToSock(data2, sizeof(data2), local_socket_))
         stage_ = kStageAddr;
 }
 
@@ -392,92 +572,172 @@ void TCPRelayHandler::OnLocalRead()
         return;
     }
     bool is_local = this->is_local_;
-    int buf_size;
-    if (is_local)
-        buf_size = kUpStreamBufSize;
-    else
-        buf_size = kDownStreamBufSize;
-    vector<char> data(buf_size);
-    int ret = BufferRecv(local_socket_, &data[0], buf_size);
-    if (ret == -1)
-    {
-        if (SocketIsBlock(local_socket_))
-        {
-            return;
-        }
-    }
-    if (ret <= 0)
-    {
-        this->Destroy();
+    // remote is blocked (or still connecting), leave the data in the socket
+    if (!(upstream_status_ & kWaitStatusReading))
         return;
-    }
-    data.resize(max(0, ret));
-    if (!is_local)
+    if (UseSplice(kStreamUp))
     {
-        //TODO data = self._cryptor.decrypt(data)
-    }
-    if (stage_ == kStageStream)
-    {
-        HandleStageStream(data);
+        SpliceStream(kStreamUp);
         return;
     }
-    else if (is_local && stage_ == kStageInit)
-    {
-        // jump over socks5 init
-        HandleStageInit(data);
-    }
-    else if (stage_ == kStageConnecting)
-    {
-        HandleStageConnecting(data);
-    }
-    else if ((is_local && stage_ == kStageAddr) ||
-             (!is_local && stage_ == kStageInit))
-    {
-        HandleStageAddr(data);
+    int budget = kEdgeReadBudget;
+    while (budget > 0)
+    {
+        // the handshake is parsed straight from the pooled buffer
+        PooledBuffer scratch(event_loop_->GetBufferPool());
+        char* buf = NULL;
+        if (read_hint_)
+            local_sizer_.Hint(GetReadableSize(local_socket_));
+        size_t want = local_sizer_.Get();
+        size_t len = want;
+        if (stage_ == kStageStream)
+        {
+            // receive straight into the queue of the remote
+            buf = data_write_to_remote_.PrepareWrite(want, &len);
+        }
+        else
+        {
+            buf = scratch.Acquire(want);
+        }
+        int ret = BufferRecv(local_socket_, buf, (int)len);
+        if (ret <= 0)
+            data_write_to_remote_.AbortWrite();
+        if (ret == -1)
+        {
+            if (SocketIsBlock(local_socket_))
+            {
+                return;
+            }
+        }
+        if (ret == 0 && !data_write_to_remote_.Empty() &&
+                (stage_ == kStageConnecting || stage_ == kStageStream))
+        {
+            // local has finished, close once the queued data is written
+            local_eof_ = true;
+            UpdateStream(kStreamUp, kWaitStatusWriting);
+            return;
+        }
+        if (ret <= 0)
+        {
+            this->Destroy();
+            return;
+        }
+        budget -= ret;
+        local_sizer_.Update(want, len, ret);
+        server_->CountRead(ret);
+        if (!is_local)
+        {
+            //TODO data = self._cryptor.decrypt(data)
+        }
+        if (stage_ == kStageStream)
+        {
+            data_write_to_remote_.CommitWrite(ret);
+            HandleStageStream();
+        }
+        else if (is_local && stage_ == kStageInit)
+        {
+            // jump over socks5 init
+            HandleStageInit(buf, ret);
+        }
+        else if (stage_ == kStageConnecting)
+        {
+            HandleStageConnecting(buf, ret);
+        }
+        else if ((is_local && stage_ == kStageAddr) ||
+                 (!is_local && stage_ == kStageInit))
+        {
+            HandleStageAddr(buf, ret);
+        }
+        // level triggered loop will tell us again, a short read means
+        // the socket is most likely drained
+        if (!edge_triggered_ && ret < (int)len)
+            return;
+        // remote can't take more, wait until it is writable again
+        if (IsDestroyed() || !(upstream_status_ & kWaitStatusReading))
+            return;
     }
+    event_loop_->Repost(local_socket_, kPollIn);
 }
 
 void TCPRelayHandler::OnRemoteRead()
 {
     // handle all remote read events
-    int buf_size = 0;
-    if (is_local_)
-        buf_size = kUpStreamBufSize;
-    else
-        buf_size = kDownStreamBufSize;
-    vector<char> data(buf_size);
-    int ret = BufferRecv(remote_socket_, &data[0], buf_size);
-    if (ret == -1)
+    // local is blocked, leave the data (and a pending EOF) in the socket
+    // until the queued data has been written
+    if (!(downstream_status_ & kWaitStatusReading))
+        return;
+    if (UseSplice(kStreamDown))
     {
-        if (SocketIsBlock(remote_socket_))
+        SpliceStream(kStreamDown);
+        return;
+    }
+    int budget = kEdgeReadBudget;
+    while (budget > 0)
+    {
+        if (read_hint_)
+            remote_sizer_.Hint(GetReadableSize(remote_socket_));
+        size_t want = remote_sizer_.Get();
+        size_t len = 0;
+        char* buf = data_write_to_local_.PrepareWrite(want, &len);
+        int ret = BufferRecv(remote_socket_, buf, (int)len);
+        if (ret <= 0)
+            data_write_to_local_.AbortWrite();
+        if (ret == -1)
         {
+            if (SocketIsBlock(remote_socket_))
+            {
+                return;
+            }
+            if (FastOpenFailed())
+                return;
+        }
+        // an answer, even the end of the stream, means the connect worked
+        if (ret >= 0 && fast_open_pending_)
+            ConfirmFastOpen();
+        if (ret == 0 && !data_write_to_local_.Empty())
+        {
+            // remote has finished, close once the queued data is written
+            remote_eof_ = true;
+            UpdateStream(kStreamDown, kWaitStatusWriting);
             return;
         }
+        if (ret <= 0)
+        {
+            this->Destroy();
+            return;
+        }
+        data_write_to_local_.CommitWrite(ret);
+        budget -= ret;
+        remote_sizer_.Update(want, len, ret);
+        server_->CountRead(ret);
+        /*
+        if (is_local)
+        data = self._cryptor.decrypt(data);
+        else
+        data = self._cryptor.encrypt(data);
+        */
+        recv_data_size += ret;
+        if (!FlushSock(local_socket_))
+            return;
+        if (!edge_triggered_ && ret < (int)len)
+            return;
+        // local can't take more, wait until it is writable again
+        if (IsDestroyed() || !(downstream_status_ & kWaitStatusReading))
+            return;
     }
-    if (ret <= 0)
-    {
-        this->Destroy();
-        return;
-    }
-    data.resize(max(ret, 0));
-    /*
-    if (is_local)
-    data = self._cryptor.decrypt(data);
-    else
-    data = self._cryptor.encrypt(data);
-    */
-    recv_data_size += ret;
-    WriteToSock(data, local_socket_);
+    event_loop_->Repost(remote_socket_, kPollIn);
 }
 
 void TCPRelayHandler::OnLocalWrite()
 {
     // handle local writable event
-    if (!data_write_to_local_.empty())
+    if (!data_write_to_local_.Empty())
+    {
+        FlushSock(local_socket_, true);
+    }
+    else if (UseSplice(kStreamDown))
     {
-        auto data = data_write_to_local_;
-        data_write_to_local_.clear();
-        WriteToSock(data, local_socket_);
+        SpliceStream(kStreamDown);
     }
     else
     {
@@ -488,12 +748,20 @@ void TCPRelayHandler::OnLocalWrite()
 void TCPRelayHandler::OnRemoteWrite()
 {
     // handle remote writable event
-    stage_ = kStageStream;
-    if (!data_write_to_remote_.empty())
+    if (stage_ != kStageStream)
+    {
+        stage_ = kStageStream;
+        // a fast open connect keeps its timeout until the handshake is done
+        if (!fast_open_pending_)
+            SetStageTimeout("timeout", kIdleTimeout);
+    }
+    if (!data_write_to_remote_.Empty())
+    {
+        FlushSock(remote_socket_, true);
+    }
+    else if (UseSplice(kStreamUp))
     {
-        auto data = data_write_to_remote_;
-        data_write_to_remote_.clear();
-        WriteToSock(data, remote_socket_);
+        SpliceStream(kStreamUp);
     }
     else
     {
@@ -501,6 +769,97 @@ void TCPRelayHandler::OnRemoteWrite()
     }
 }
 
+bool TCPRelayHandler::UseSplice(int stream)
+{
+#ifdef _WIN32
+    return false;
+#else
+    SplicePipe& pipe = stream == kStreamUp ? up_pipe_ : down_pipe_;
+    if (pipe.read_fd >= 0)
+        return true;
+    // the plaintext stream is only spliced once the data queued during the
+    // handshake has been written
+    StreamBuffer& queued = stream == kStreamUp ? data_write_to_remote_ : data_write_to_local_;
+    // with fast open the data sent is kept until the server answers
+    if (!splice_ || stage_ != kStageStream || !queued.Empty() || fast_open_pending_)
+        return false;
+    if (!server_->GetPipePool()->Acquire(&pipe))
+    {
+        splice_ = false;
+        return false;
+    }
+    return true;
+#endif
+}
+
+// move data from one socket to the other through a pipe, the data never
+// enters userspace. the pipe is flushed before reading more, so a pipe
+// holding data means the destination is blocked
+void TCPRelayHandler::SpliceStream(int stream)
+{
+#ifndef _WIN32
+    bool up = stream == kStreamUp;
+    SOCKET src = up ? local_socket_ : remote_socket_;
+    SOCKET dst = up ? remote_socket_ : local_socket_;
+    SplicePipe& pipe = up ? up_pipe_ : down_pipe_;
+    int budget = kEdgeReadBudget;
+    bool drained = false;
+    while (true)
+    {
+        while (pipe.pending > 0)
+        {
+            ssize_t ret = splice(pipe.read_fd, NULL, dst, NULL, pipe.pending,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (ret == -1)
+            {
+                if (SocketIsBlock(dst))
+                {
+                    // wait for dst to be writable, stop reading src
+                    UpdateStream(stream, kWaitStatusWriting);
+                    return;
+                }
+                LOGW << "splice to socket failed " << GetSocketErrorCode() << "\n";
+                this->Destroy();
+                return;
+            }
+            pipe.pending -= ret;
+            if (!up)
+                send_data_size += ret;
+        }
+        UpdateStream(stream, kWaitStatusReading);
+        if (drained || IsDestroyed())
+            return;
+        if (budget <= 0)
+        {
+            event_loop_->Repost(src, kPollIn);
+            return;
+        }
+        ssize_t ret = splice(src, NULL, pipe.write_fd, NULL, kSpliceChunk,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret == -1)
+        {
+            if (SocketIsBlock(src))
+                return;
+            LOGW << "splice from socket failed " << GetSocketErrorCode() << "\n";
+            this->Destroy();
+            return;
+        }
+        if (ret == 0)
+        {
+            this->Destroy();
+            return;
+        }
+        pipe.pending += ret;
+        budget -= ret;
+        if (!up)
+            recv_data_size += ret;
+        // level triggered loop will tell us again
+        if (!edge_triggered_ && ret < kSpliceChunk)
+            drained = true;
+    }
+#endif
+}
+
 void TCPRelayHandler::OnLocalError()
 {
     LOGW << "got local error\n";
@@ -510,35 +869,55 @@ void TCPRelayHandler::OnLocalError()
 void TCPRelayHandler::OnRemoteError()
 {
     LOGW << "got remote error\n";
+    if (FastOpenFailed())
+        return;
     this->Destroy();
 }
 
 void TCPRelayHandler::HandleEvent(SOCKET s, int event)
 {
+    // destroyed, waiting for its sends to complete
+    if (IsDestroyed())
+        return;
+    last_active_ = event_loop_->Now();
+    dispatching_ = true;
     // order is important
     if (s == remote_socket_)
     {
+        // the handshake is done once the connect is, whatever the target
+        // sends. it's written to once done, so it's never replayed
+        if (fast_open_pending_ && IsHandshakeDone(s))
+            ConfirmFastOpen();
         if (event & kPollErr)
         {
             OnRemoteError();
         }
-        if (!IsDestroyed() &&
+        // a failed fast open may have replaced the socket, a stream on
+        // completions is received by the recv request
+        if (!IsDestroyed() && s == remote_socket_ && !completion_ &&
                 (event & (kPollIn | kPollHup)))
         {
             OnRemoteRead();
         }
-        if (!IsDestroyed() && (event & kPollOut))
+        if (!IsDestroyed() && s == remote_socket_ && (event & kPollOut))
         {
             OnRemoteWrite();
         }
     }
     else if (s == local_socket_)
     {
+        // zero copy completions are reported as errors, they aren't one
+        if (zerocopy_ && (event & kPollErr))
+        {
+            data_write_to_local_.ReadCompletions(s);
+            if (GetSocketPendingError(s) == 0)
+                event &= ~kPollErr;
+        }
         if (event & kPollErr)
         {
             OnLocalError();
         }
-        if (!IsDestroyed() &&
+        if (!IsDestroyed() && !completion_ &&
                 (event & (kPollIn | kPollHup)))
         {
             OnLocalRead();
@@ -550,58 +929,297 @@ void TCPRelayHandler::HandleEvent(SOCKET s, int event)
     }
     else
         LOGW << "unknown socket\n";
+    if (try_completion_ && stage_ == kStageStream)
+        StartCompletion();
     if (IsDestroyed())
     {
         //free memory when it mark destroyed
-        delete this;
+        server_->FreeHandler(this);
+        return;
+    }
+    dispatching_ = false;
+}
+
+// the stream moves to completions once it's established, between two events
+// so no read of the readiness path is going on. splice and zero copy keep
+// the readiness path, a fast open waits until the handshake is done
+void TCPRelayHandler::StartCompletion()
+{
+    if (splice_ || zerocopy_)
+    {
+        try_completion_ = false;
+        return;
+    }
+    if (fast_open_pending_ || IsDestroyed())
+        return;
+    try_completion_ = false;
+    if (!event_loop_->StartRecv(local_socket_, this) || !event_loop_->StartRecv(remote_socket_, this))
+        return;
+    completion_ = true;
+    UpdateInterest();
+    // the data queued meanwhile goes out by the sends
+    if (FlushSock(local_socket_))
+        FlushSock(remote_socket_);
+}
+
+void TCPRelayHandler::SubmitSends(SOCKET s)
+{
+#ifndef _WIN32
+    bool to_local = s == local_socket_;
+    int& sends = to_local ? local_sends_ : remote_sends_;
+    StreamBuffer& pending = to_local ? data_write_to_local_ : data_write_to_remote_;
+    // the next chain goes out when this one has completed, so the sends
+    // keep their order
+    if (sends > 0 || pending.Empty())
+        return;
+    iovec iov[kMaxLinkedSends];
+    int count = pending.PeekIov(iov, kMaxLinkedSends);
+    sends = event_loop_->SubmitSend(s, iov, count);
+    if (sends == 0)
+    {
+        LOGE << "submit send failed\n";
+        Destroy();
     }
+#endif
 }
 
-void TCPRelayHandler::DNSResolved(string hostname, string ip, string err)
+void TCPRelayHandler::HandleRecv(SOCKET s, const char* data, int len)
+{
+    // destroyed, waiting for its sends to complete
+    if (IsDestroyed())
+        return;
+    last_active_ = event_loop_->Now();
+    bool up = s == local_socket_;
+    StreamBuffer& queue = up ? data_write_to_remote_ : data_write_to_local_;
+    if (len < 0)
+    {
+        LOGW << "recv failed " << -len << "\n";
+        Destroy();
+    }
+    else if (len == 0)
+    {
+        // the peer has finished, close once the queued data is written
+        if (queue.Empty())
+        {
+            Destroy();
+        }
+        else
+        {
+            if (up)
+                local_eof_ = true;
+            else
+                remote_eof_ = true;
+            UpdateStream(up ? kStreamUp : kStreamDown, kWaitStatusWriting);
+        }
+    }
+    else
+    {
+        // received after a pause was asked for too, the queue takes it
+        queue.Append(data, len);
+        server_->CountRead(len);
+        if (!up)
+            recv_data_size += len;
+        FlushSock(up ? remote_socket_ : local_socket_);
+    }
+    if (IsDestroyed())
+        server_->FreeHandler(this);
+}
+
+void TCPRelayHandler::HandleSend(SOCKET s, int res)
+{
+    bool to_local = s == local_socket_;
+    int& sends = to_local ? local_sends_ : remote_sends_;
+    --sends;
+    if (!IsDestroyed())
+    {
+        last_active_ = event_loop_->Now();
+        if (res > 0)
+        {
+            (to_local ? data_write_to_local_ : data_write_to_remote_).Consume(res);
+            if (to_local)
+                send_data_size += res;
+        }
+        // the sends linked after a failed one are canceled
+        else if (res != -ECANCELED)
+        {
+            LOGW << "send failed " << -res << "\n";
+            Destroy();
+        }
+        if (!IsDestroyed() && sends == 0)
+            FlushSock(s, true);
+    }
+    if (IsDestroyed())
+        server_->FreeHandler(this);
+}
+
+bool TCPRelayHandler::WaitSends()
+{
+    if (local_sends_ + remote_sends_ == 0)
+        return false;
+    // a peer which doesn't read would keep them forever
+    if (!sends_canceled_)
+    {
+        sends_canceled_ = true;
+        timer_.Cancel();
+        event_loop_->CancelIo(local_socket_);
+        event_loop_->CancelIo(remote_socket_);
+    }
+    return true;
+}
+
+void TCPRelayHandler::DNSResolvedAll(string hostname, const vector<string>& ips, string err)
 {
     if (!err.empty())
     {
         LOGW << err << " when handling connection\n";
+        if (Failover())
+            return;
         Destroy();
     }
-    if (ip.empty())
+    else if (ips.empty())
     {
         LOGW << "parse " << hostname << " result is empty!\n";
+        if (Failover())
+            return;
         Destroy();
     }
     if (IsDestroyed())
     {
-        delete this;
+        // resolved at once inside HandleEvent, which deletes the handler
+        if (!dispatching_)
+            server_->FreeHandler(this);
         return;
     }
     stage_ = kStageConnecting;
-    string remote_addr = ip;
-    sockaddr_in client_service;
-    int remote_port = this->remote_port_;
-    client_service.sin_family = AF_INET;
-    inet_pton(AF_INET, remote_addr.c_str(), &client_service.sin_addr.s_addr);
-    client_service.sin_port = htons(remote_port);
-    remote_socket_ = CreateRemoteSocket(remote_addr, remote_port);
-    int ret = connect(remote_socket_, (sockaddr*)&client_service, sizeof(client_service));
-    if (ret == -1)
-    {
-        if (!SocketIsBlock(remote_socket_))
-        {
-            LOGE << "connect failed:" << ret << " " << GetSocketErrorCode() << "\n";
-            this->Destroy();
-        }
-    }
-    if (IsDestroyed())
+    SetStageTimeout("connect_timeout", kConnectTimeout);
+    connect_started_ = event_loop_->Now();
+    // the address header and the first data are flushed in OnRemoteWrite,
+    // with fast open they ride in the SYN. without it this is a plain connect
+    connector_.Start(ips, remote_port_, is_local_ && config_->GetInt("fast_open") == 1);
+}
+
+void TCPRelayHandler::Connected(SOCKET s)
+{
+    if (s == INVALID_SOCKET)
     {
-        delete this;
+        LOGE << "connect " << remote_address_ << ":" << remote_port_ << " failed\n";
+        // the handler may be gone once it returns
+        if (Failover())
+            return;
+        Destroy();
+        if (!dispatching_)
+            server_->FreeHandler(this);
         return;
     }
-    event_loop_->Add(remote_socket_, kPollErr | kPollOut, server_);
+    // with fast open the connect returns before the handshake, it's neither
+    // a success nor a connect time yet
+    fast_open_pending_ = is_local_ && config_->GetInt("fast_open") == 1;
+    fast_open_replay_ = fast_open_pending_;
+    fast_open_sent_.clear();
+    if (fast_open_pending_)
+    {
+        sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        fast_open_ip_ = getpeername(s, (sockaddr*)&addr, &addr_len) == 0 ? GetIpStr((sockaddr*)&addr) : "";
+    }
+    else if (is_local_ && server_index_ >= 0)
+    {
+        server_->GetServerSelector()->ReportSuccess(server_index_, event_loop_->Now() - connect_started_);
+    }
+    remote_socket_ = s;
+    if (config_->GetInt("no_delay") == 1)
+        SetNoDelay(remote_socket_);
+    StartConnecting();
+}
+
+// remote_socket_ is connecting (or connected), writable means it's ready
+void TCPRelayHandler::StartConnecting()
+{
+    event_loop_->Add(remote_socket_, kPollErr | kPollOut | (edge_triggered_ ? kPollEdge : 0),
+                     static_cast<ISockNotify*>(this));
     stage_ = kStageConnecting;
+    SetStageTimeout("connect_timeout", kConnectTimeout);
     UpdateStream(kStreamUp, kWaitStatusReadWriting);
     UpdateStream(kStreamDown, kWaitStatusReading);
 }
 
+void TCPRelayHandler::ConfirmFastOpen()
+{
+    fast_open_pending_ = false;
+    vector<char>().swap(fast_open_sent_);
+    if (server_index_ >= 0)
+        server_->GetServerSelector()->ReportSuccess(server_index_, -1);
+    if (stage_ == kStageStream)
+        SetStageTimeout("timeout", kIdleTimeout);
+    // remote was polled for writable to see the handshake
+    UpdateInterest();
+}
+
+bool TCPRelayHandler::FastOpenFailed()
+{
+    if (!fast_open_pending_)
+        return false;
+    fast_open_pending_ = false;
+    LOGW << "fast open to " << remote_address_ << ":" << remote_port_ << " failed\n";
+    if (!fast_open_ip_.empty())
+        server_->GetAddressLatency()->RecordFailure(fast_open_ip_);
+    event_loop_->Remove(remote_socket_);
+    CloseSocket(remote_socket_);
+    remote_socket_ = INVALID_SOCKET;
+    if (!fast_open_replay_)
+    {
+        // part of the request has gone without being kept
+        if (server_index_ >= 0)
+            server_->GetServerSelector()->ReportFailure(server_index_);
+        return false;
+    }
+    // the handshake wasn't done, the next server gets the whole request
+    data_write_to_remote_.Prepend(fast_open_sent_.data(), fast_open_sent_.size());
+    vector<char>().swap(fast_open_sent_);
+    return Failover();
+}
+
+void TCPRelayHandler::HandleTimeout(Timer* timer)
+{
+    if (fast_open_pending_ && IsHandshakeDone(remote_socket_))
+    {
+        ConfirmFastOpen();
+        if (stage_ == kStageStream)
+            return;
+    }
+    if (fast_open_pending_)
+    {
+        LOGW << "timeout waiting for " << remote_address_ << ":" << remote_port_ << "\n";
+        if (FastOpenFailed())
+            return;
+        Destroy();
+        server_->FreeHandler(this);
+        return;
+    }
+    if (stage_ == kStageStream)
+    {
+        // idle timer isn't refreshed on every event, check the last activity
+        int64_t idle_timeout = config_->GetInt("timeout", kIdleTimeout) * 1000;
+        int64_t idle = event_loop_->Now() - last_active_;
+        if (idle < idle_timeout)
+        {
+            event_loop_->AddTimer(&timer_, idle_timeout - idle);
+            return;
+        }
+    }
+    LOGW << "timeout at stage " << stage_ << ": " << remote_address_ << ":" << remote_port_ << "\n";
+    // the server didn't answer, the request can still go to another one
+    if (remote_socket_ == INVALID_SOCKET && (stage_ == kStageDns || stage_ == kStageConnecting))
+    {
+        connector_.Cancel();
+        CancelResolve();
+        if (Failover())
+            return;
+    }
+    Destroy();
+    server_->FreeHandler(this);
+}
+
 bool TCPRelayHandler::IsDestroyed()
 {
     return stage_ == kStageDestroyed;
@@ -634,21 +1252,36 @@ TCPRelayHandler::~TCPRelayHandler()
     if (!is_local_ && recv_data_size != send_data_size)
         LOGW << "receive and send the size is not equal:" << send_data_size << "  " << recv_data_size << "\n";
     LOGI << "destroy: " << remote_address_ << ":" << remote_port_ << "\n";
+#ifndef _WIN32
+    server_->GetPipePool()->Release(&up_pipe_);
+    server_->GetPipePool()->Release(&down_pipe_);
+#endif
     if (remote_socket_ != INVALID_SOCKET)
     {
         event_loop_->Remove(remote_socket_);
-        server_->RemoveHandler(remote_socket_);
         CloseSocket(remote_socket_);
         remote_socket_ = INVALID_SOCKET;
     }
+#ifndef _WIN32
+    if (zerocopy_ && local_socket_ != INVALID_SOCKET)
+    {
+        data_write_to_local_.ReadCompletions(local_socket_);
+        if (data_write_to_local_.HasPinned())
+        {
+            event_loop_->Remove(local_socket_);
+            server_->GetZeroCopyLinger()->Adopt(local_socket_, &data_write_to_local_);
+            local_socket_ = INVALID_SOCKET;
+        }
+    }
+#endif
     if (local_socket_ != INVALID_SOCKET)
     {
         event_loop_->Remove(local_socket_);
-        server_->RemoveHandler(local_socket_);
         CloseSocket(local_socket_);
         local_socket_ = INVALID_SOCKET;
     }
-    dns_resolver_->RemoveCallback(this);
+    CancelResolve();
+    server_->HandlerClosed();
 }
 
 bool TCPRelay::Init()
@@ -684,6 +1317,13 @@ bool TCPRelay::Init()
 
     SetReUseAddr(server_socket);
 
+    if (config_->GetInt("workers", 1) > 1 && -1 == SetReUsePort(server_socket))
+    {
+        CloseSocket(server_socket);
+        LOGE << "set SO_REUSEPORT failed" << GetSocketErrorCode() << "\n";
+        return false;
+    }
+
     if (-1 == bind(server_socket,
                    (sockaddr *)&service,
                    sizeof(service)
@@ -700,19 +1340,31 @@ bool TCPRelay::Init()
         LOGE << "listen socket failed" << GetSocketErrorCode() << "\n";
         return false;
     }
+    if (!is_local_ && config_->GetInt("fast_open") == 1 &&
+            -1 == SetFastOpen(server_socket, true))
+    {
+        LOGW << "set TCP_FASTOPEN failed" << GetSocketErrorCode() << "\n";
+    }
     this->server_socket_ = server_socket;
     return true;
 }
 
-TCPRelay::TCPRelay(Config * config, DNSResolve* dns_resolve, bool is_local):
+TCPRelay::TCPRelay(Config * config, DNSResolve* dns_resolve, ServerSelector* selector, bool is_local):
     config_(config),
     is_local_(is_local),
     is_closed_(false),
     event_loop_(NULL),
     dns_resolver_(dns_resolve),
+    selector_(selector),
     server_socket_(INVALID_SOCKET),
-    listen_port_(0)
+    listen_port_(0),
+    accepted_count_(0),
+    closed_count_(0),
+    connection_pool_(NULL),
+    mux_count_(0)
 {
+    for (int i = 0; i < ReadSizer::kBuckets; i++)
+        read_counts_[i] = 0;
 }
 
 bool TCPRelay::AddToLoop(EventLoop * event_loop)
@@ -729,21 +1381,98 @@ bool TCPRelay::AddToLoop(EventLoop * event_loop)
     }
     event_loop_ = event_loop;
     event_loop_->Add(server_socket_, kPollIn | kPollErr, this);
+    // with io_uring the connections come by a multishot accept
+    if (config_->GetInt("io_uring") == 1)
+        event_loop_->StartAccept(server_socket_, this);
+#ifndef _WIN32
+    zerocopy_linger_.AddToLoop(event_loop_);
+#endif
+    int pool_size = config_->GetInt("pool_size", 0);
+    if (is_local_ && pool_size > 0)
+    {
+        connection_pool_ = new ConnectionPool(config_, event_loop_, dns_resolver_, selector_, pool_size);
+        connection_pool_->Start();
+    }
+    if (is_local_)
+    {
+        mux_count_ = config_->GetInt("mux", 0);
+        if (mux_count_ > 0)
+            LOGI << "mux over " << mux_count_ << " tunnels\n";
+        for (int i = 0; i < mux_count_; i++)
+        {
+            MuxTunnel* tunnel = new MuxTunnel(this, event_loop_, dns_resolver_, config_, true);
+            tunnels_.insert(tunnel);
+            tunnel->Connect();
+        }
+    }
     return true;
 }
 
-void TCPRelay::AddHandler(SOCKET s, ISockNotify * handler)
+SOCKET TCPRelay::ClaimConnection()
 {
-    if (socket_handler_.count(s) > 0)
-    {
-        LOGW << "this socket has bind a handler,it may cause memory leak\n";
-    }
-    socket_handler_[s] = handler;
+    if (connection_pool_ == NULL)
+        return INVALID_SOCKET;
+    return connection_pool_->Claim();
+}
+
+MuxTunnel* TCPRelay::GetMuxTunnel()
+{
+    if (mux_count_ <= 0 || is_closed_)
+        return NULL;
+    MuxTunnel* best = NULL;
+    int alive = 0;
+    for (auto& tunnel : tunnels_)
+    {
+        if (tunnel->IsBroken())
+            continue;
+        ++alive;
+        if (best == NULL || tunnel->GetStreamCount() < best->GetStreamCount())
+            best = tunnel;
+    }
+    // replace a broken tunnel, it's deleted from a timer
+    if (alive < mux_count_)
+    {
+        MuxTunnel* tunnel = new MuxTunnel(this, event_loop_, dns_resolver_, config_, true);
+        tunnels_.insert(tunnel);
+        tunnel->Connect();
+        if (!tunnel->IsBroken() && (best == NULL || best->GetStreamCount() > 0))
+            best = tunnel;
+    }
+    return best;
+}
+
+void TCPRelay::AcceptTunnel(SOCKET s, const char* data, size_t len)
+{
+    MuxTunnel* tunnel = new MuxTunnel(this, event_loop_, dns_resolver_, config_, false);
+    tunnels_.insert(tunnel);
+    tunnel->Accept(s, data, len);
+}
+
+void TCPRelay::RemoveTunnel(MuxTunnel * tunnel)
+{
+    tunnels_.erase(tunnel);
+}
+
+void TCPRelay::FreeHandler(TCPRelayHandler * handler)
+{
+    // the kernel still reads the queues of its sends, it's freed once they
+    // have completed
+    if (handler->WaitSends())
+        return;
+    handler_pool_.Delete(handler);
+}
+
+uint64_t TCPRelay::GetHandlerToken(TCPRelayHandler * handler)
+{
+    return handler_pool_.GetHandle(handler);
 }
 
-void TCPRelay::RemoveHandler(SOCKET s)
+void TCPRelay::DNSResolvedToken(uint64_t token, string hostname, const vector<string>& ips, string err)
 {
-    socket_handler_.erase(s);
+    // an answer for a handler freed meanwhile is dropped
+    TCPRelayHandler* handler = handler_pool_.Get(token);
+    if (handler)
+        handler->DNSResolvedAll(hostname, ips, err);
 }
 
 void TCPRelay::HandleEvent(SOCKET s, int event)
@@ -753,27 +1482,96 @@ void TCPRelay::HandleEvent(SOCKET s, int event)
         LOGW << "invalid socket\n";
         return;
     }
-    if (s == server_socket_)
+    //only the listener is registered with the relay,
+    //the loop dispatches the relayed sockets to their handlers
+    if (event & kPollErr)
     {
-        if (event & kPollErr)
-        {
-            event_loop_->Stop();
-            return;
-        }
-        SOCKET new_socket = accept(server_socket_, NULL, NULL);
-        if (new_socket != INVALID_SOCKET)
-        {
-            new TCPRelayHandler(this, event_loop_, dns_resolver_, new_socket, config_, is_local_);
-        }
+        event_loop_->Stop();
+        return;
     }
-    else
+    // drain the backlog first, then create the handlers of the batch
+    SOCKET sockets[kAcceptBatch];
+    sockaddr_storage addrs[kAcceptBatch];
+    int count = 0;
+    while (count < kAcceptBatch)
     {
-        if (socket_handler_.count(s) > 0)
+        int addr_len = sizeof(sockaddr_storage);
+        SOCKET new_socket = AcceptNoBlocking(server_socket_, (sockaddr*)&addrs[count], &addr_len);
+        if (new_socket == INVALID_SOCKET)
         {
-            socket_handler_[s]->HandleEvent(s, event);
+            if (!SocketIsBlock(server_socket_))
+                LOGW << "accept failed " << GetSocketErrorCode() << "\n";
+            break;
         }
+        sockets[count++] = new_socket;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        ++accepted_count_;
+        handler_pool_.New(this, event_loop_, dns_resolver_, sockets[i], addrs[i], config_, is_local_);
+    }
+}
+
+void TCPRelay::HandleAccept(SOCKET s, SOCKET client)
+{
+    // a multishot accept doesn't keep the peer addresses
+    sockaddr_storage addr;
+    int addr_len = sizeof(addr);
+    if (GetPeerName(client, (sockaddr*)&addr, &addr_len) != 0)
+    {
+        CloseSocket(client);
+        return;
     }
+    ++accepted_count_;
+    handler_pool_.New(this, event_loop_, dns_resolver_, client, addr, config_, is_local_);
+}
+
+void TCPRelay::HandlerClosed()
+{
+    ++closed_count_;
+}
+
+int64_t TCPRelay::GetAcceptedCount()
+{
+    return accepted_count_;
+}
+
+int64_t TCPRelay::GetActiveCount()
+{
+    return accepted_count_ - closed_count_;
+}
+
+AddressLatency* TCPRelay::GetAddressLatency()
+{
+    return &address_latency_;
+}
+
+void TCPRelay::CountRead(size_t size)
+{
+    ++read_counts_[ReadSizer::BucketOf(size)];
+}
+
+int64_t TCPRelay::GetReadCount(int bucket)
+{
+    return read_counts_[bucket];
+}
+
+ServerSelector* TCPRelay::GetServerSelector()
+{
+    return selector_;
+}
+
+#ifndef _WIN32
+PipePool* TCPRelay::GetPipePool()
+{
+    return &pipe_pool_;
+}
+
+ZeroCopyLinger* TCPRelay::GetZeroCopyLinger()
+{
+    return &zerocopy_linger_;
 }
+#endif
 
 void TCPRelay::Close()
 {
@@ -785,8 +1583,24 @@ void TCPRelay::Close()
     }
     if(server_socket_ != INVALID_SOCKET)
         CloseSocket(server_socket_);
-    for (auto& iter : socket_handler_)
+    if (connection_pool_)
+    {
+        connection_pool_->Close();
+        delete connection_pool_;
+        connection_pool_ = NULL;
+    }
+    //tunnels remove themselves from the set when deleted
+    set<MuxTunnel*> tunnels;
+    tunnels.swap(tunnels_);
+    for (auto& tunnel : tunnels)
+    {
+        delete tunnel;
+    }
+    for (auto& handler : handler_pool_.GetAll())
     {
-        delete iter.second;
+        handler_pool_.Delete(handler);
     }
+#ifndef _WIN32
+    zerocopy_linger_.Close();
+#endif
 }
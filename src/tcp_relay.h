@@ -10,16 +10,44 @@ class NoAcceptableMethods : exception {
 };
 
 
+class TCPRelayHandler;
+
 //tcp protocol socket
-class TCPRelay : public ISockNotify {
+class TCPRelay : public ISockNotify, public IDNSNotify, public ICompletionNotify {
 public:
     bool Init();
-    TCPRelay(Config * config, DNSResolve * dns_resolve, bool is_local);
+    TCPRelay(Config * config, DNSResolve * dns_resolve, ServerSelector* selector, bool is_local);
     ~TCPRelay() {};
     bool AddToLoop(EventLoop* event_loop);
-    void AddHandler(SOCKET s, ISockNotify* handler) ;
-    void RemoveHandler(SOCKET s) ;
+    //handlers are allocated from a pool, a handler frees itself with this
+    void FreeHandler(TCPRelayHandler* handler);
+    //identifies the handler in callbacks which may come after it's freed
+    uint64_t GetHandlerToken(TCPRelayHandler* handler);
+    void HandlerClosed();
+    int64_t GetAcceptedCount();
+    int64_t GetActiveCount();
+    //a pre-connected socket to the server (client mode), or INVALID_SOCKET
+    SOCKET ClaimConnection();
+    //the tunnel with the fewest streams (client mode with --mux), or NULL
+    MuxTunnel* GetMuxTunnel();
+    //take over a connection which carries a tunnel (server mode)
+    void AcceptTunnel(SOCKET s, const char* data, size_t len);
+    void RemoveTunnel(MuxTunnel* tunnel);
+#ifndef _WIN32
+    PipePool* GetPipePool();
+    ZeroCopyLinger* GetZeroCopyLinger();
+#endif
+    AddressLatency* GetAddressLatency();
+    //a read of a handler, by the bytes it returned
+    void CountRead(size_t size);
+    int64_t GetReadCount(int bucket);
+    //the servers of the client, NULL on the server
+    ServerSelector* GetServerSelector();
     virtual void HandleEvent(SOCKET s, int event) override;
+    //a connection of the multishot accept (io_uring)
+    virtual void HandleAccept(SOCKET s, SOCKET client) override;
+    //dns answers of the handlers, the token is the handler's
+    virtual void DNSResolvedToken(uint64_t token, string hostname, const vector<string>& ips, string err) override;
     void Close();
 private:
     bool is_local_;
@@ -27,27 +55,52 @@ private:
     bool is_closed_;
     EventLoop* event_loop_;
     DNSResolve* dns_resolver_;
+    ServerSelector* selector_;
     int listen_port_;
     SOCKET server_socket_;
-    map<SOCKET, ISockNotify*> socket_handler_;
+    //handlers register their sockets to the loop themselves,
+    //the pool is only walked to release them on close
+    ObjectPool<TCPRelayHandler> handler_pool_;
+    int64_t accepted_count_;
+    int64_t closed_count_;
+    ConnectionPool* connection_pool_;
+    int mux_count_;
+    set<MuxTunnel*> tunnels_;
+    AddressLatency address_latency_;
+    int64_t read_counts_[ReadSizer::kBuckets];
+#ifndef _WIN32
+    PipePool pipe_pool_;
+    ZeroCopyLinger zerocopy_linger_;
+#endif
 };
 
-class TCPRelayHandler : public IDNSNotify, ISockNotify {
+class TCPRelayHandler : public IDNSNotify, ISockNotify, ITimerNotify, IConnectNotify, ICompletionNotify {
 public:
     TCPRelayHandler(
         TCPRelay* server,
         EventLoop* event_loop,
         DNSResolve* dns_resolver,
         SOCKET local_socket,
+        const sockaddr_storage& local_addr,
         Config* config,
         bool is_local);
     virtual void HandleEvent(SOCKET s, int event) override;
 
-    virtual void DNSResolved(string hostname, string ip, string err) override;
+    virtual void DNSResolvedAll(string hostname, const vector<string>& ips, string err) override;
+
+    virtual void Connected(SOCKET s) override;
+
+    virtual void HandleTimeout(Timer* timer) override;
+
+    virtual void HandleRecv(SOCKET s, const char* data, int len) override;
+
+    virtual void HandleSend(SOCKET s, int res) override;
 
     bool IsDestroyed();
 
 private:
+    friend class TCPRelay;
+    friend class ObjectPool<TCPRelayHandler>;
 	int recv_data_size;
 	int send_data_size;
 	~TCPRelayHandler() ;
@@ -58,7 +111,18 @@ private:
     SOCKET remote_socket_;
     Config* config_;
     bool is_local_;
+    bool edge_triggered_;
+    bool splice_;
+    bool zerocopy_;//the downstream sends may be zero copy
     int stage_;
+    bool local_eof_;
+    bool remote_eof_;
+    int high_watermark_;
+    int low_watermark_;
+    bool read_hint_;//size the reads by FIONREAD
+    HeaderParser header_parser_;
+    ReadSizer local_sizer_;
+    ReadSizer remote_sizer_;
 
 	string		local_address_;
 	uint16_t	local_port_;
@@ -66,26 +130,73 @@ private:
 	string		remote_address_;
 	uint16_t	remote_port_;
 
-	vector<char> data_write_to_local_;
-    vector<char> data_write_to_remote_;
+    int server_index_;//client, the server connecting to
+    uint64_t tried_servers_;//a bit per index
+    int64_t connect_started_;
+    //connected with fast open, which returns at once. the server is known
+    //to be up only once the kernel has done the handshake, until then the
+    //data sent is kept to be sent again to the next server
+    bool fast_open_pending_;
+    bool fast_open_replay_;//fast_open_sent_ holds all the data sent
+    string fast_open_ip_;
+    vector<char> fast_open_sent_;
+
+    StreamBuffer data_write_to_local_;
+    StreamBuffer data_write_to_remote_;
     int upstream_status_;
     int downstream_status_;
+    Timer timer_;
+    int64_t last_active_;
+    HappyEyeballs connector_;
+    bool dispatching_;//in HandleEvent, which deletes the handler once destroyed
+    //the stream runs on io_uring completions, the sockets are received by
+    //multishot recv and the queues sent by linked sends
+    bool completion_;
+    bool try_completion_;
+    int local_sends_;//in flight, the kernel reads the queue until they complete
+    int remote_sends_;
+    bool sends_canceled_;
+#ifndef _WIN32
+    SplicePipe up_pipe_;
+    SplicePipe down_pipe_;
+#endif
 
-    void SelectAServer();
-
-    void UpdateStream(int stream, int status);
-
-    bool WriteToSock(vector<char>& data, SOCKET s);
-
-    void HandleStageConnecting(vector<char>& data);
+    void SetStageTimeout(const char* key, int default_timeout);
 
-    void HandleStageAddr(vector<char>& data);
+    //pick the best server not tried yet, false when all have been
+    bool SelectAServer();
+    //report the failure of the server, and try the next one if any
+    bool Failover();
+    void Resolve(const string& hostname);
+    void CancelResolve();
 
-    SOCKET CreateRemoteSocket(string ip, int port);
+    void StartConnecting();
+    void ConfirmFastOpen();
+    //the fast open connect turned out to fail, fail over with the data
+    //sent. false if there is no other server or the data can't be replayed
+    bool FastOpenFailed();
 
-    void HandleStageStream(vector<char>& data);
-    void CheckAuthMethod(vector<char>& data);
-    void HandleStageInit(vector<char>& data);
+    void UpdateStream(int stream, int status);
+    //poll the sockets for what the streams wait for
+    void UpdateInterest();
+    //move an established stream to io_uring completions if it can
+    void StartCompletion();
+    //send the queue of s by linked sends, one chain at a time
+    void SubmitSends(SOCKET s);
+    //a destroyed handler is kept until its sends complete, they're canceled.
+    //false if it can be freed
+    bool WaitSends();
+
+    bool WriteToSock(const char* data, size_t len, SOCKET s);
+    bool FlushSock(SOCKET s, bool writable = false);
+
+    void HandleStageConnecting(const char* data, size_t len);
+
+    void HandleStageAddr(const char* data, size_t len);
+
+    void HandleStageStream();
+    void CheckAuthMethod(const char* data, size_t len);
+    void HandleStageInit(const char* data, size_t len);
     void OnLocalRead();
     void OnRemoteRead();
 
@@ -95,6 +206,9 @@ private:
     void OnLocalError();
     void OnRemoteError();
 
+    bool UseSplice(int stream);
+    void SpliceStream(int stream);
+
     void Destroy();
 };
 
@@ -0,0 +1,234 @@
+#include "common.h"
+#include "timer_wheel.h"
+
+Timer::Timer(ITimerNotify * notify):
+    notify_(notify),
+    wheel_(NULL),
+    prev_(NULL),
+    next_(NULL),
+    expire_(0)
+{
+}
+
+Timer::~Timer()
+{
+    Cancel();
+}
+
+void Timer::SetNotify(ITimerNotify * notify)
+{
+    notify_ = notify;
+}
+
+bool Timer::IsActive()
+{
+    return wheel_ != NULL;
+}
+
+void Timer::Cancel()
+{
+    if (wheel_)
+        wheel_->Remove(this);
+}
+
+TimerWheel::TimerWheel():
+    count_(0)
+{
+    for (int i = 0; i < kRootSize; i++)
+    {
+        root_[i].prev_ = root_[i].next_ = &root_[i];
+    }
+    for (int level = 0; level < kLevels; level++)
+    {
+        for (int i = 0; i < kLevelSize; i++)
+        {
+            levels_[level][i].prev_ = levels_[level][i].next_ = &levels_[level][i];
+        }
+    }
+    current_tick_ = GetMonotonicTime() / kTickMs;
+}
+
+TimerWheel::~TimerWheel()
+{
+    //detach the timers still armed, their owners may outlive the wheel
+    for (int i = 0; i < kRootSize; i++)
+    {
+        while (!Empty(&root_[i]))
+            Remove(root_[i].next_);
+    }
+    for (int level = 0; level < kLevels; level++)
+    {
+        for (int i = 0; i < kLevelSize; i++)
+        {
+            while (!Empty(&levels_[level][i]))
+                Remove(levels_[level][i].next_);
+        }
+    }
+}
+
+void TimerWheel::Link(Timer * head, Timer * timer)
+{
+    timer->prev_ = head->prev_;
+    timer->next_ = head;
+    head->prev_->next_ = timer;
+    head->prev_ = timer;
+}
+
+void TimerWheel::Unlink(Timer * timer)
+{
+    timer->prev_->next_ = timer->next_;
+    timer->next_->prev_ = timer->prev_;
+    timer->prev_ = timer->next_ = NULL;
+}
+
+bool TimerWheel::Empty(Timer * head)
+{
+    return head->next_ == head;
+}
+
+void TimerWheel::Place(Timer * timer)
+{
+    int64_t idx = (int64_t)(timer->expire_ - current_tick_);
+    Timer* head = NULL;
+    if (idx < 0)
+    {
+        //already expired, fire it at the next tick
+        head = &root_[current_tick_ & (kRootSize - 1)];
+    }
+    else if (idx < kRootSize)
+    {
+        head = &root_[timer->expire_ & (kRootSize - 1)];
+    }
+    else
+    {
+        int level = 0;
+        while (level < kLevels && idx >= (1LL << (kRootBits + (level + 1) * kLevelBits)))
+            ++level;
+        if (level == kLevels)
+        {
+            level = kLevels - 1;
+            timer->expire_ = current_tick_ + (1ULL << (kRootBits + kLevels * kLevelBits)) - 1;
+        }
+        int shift = kRootBits + level * kLevelBits;
+        head = &levels_[level][(timer->expire_ >> shift) & (kLevelSize - 1)];
+    }
+    Link(head, timer);
+}
+
+void TimerWheel::Add(Timer * timer, int64_t timeout, int64_t now)
+{
+    if (timer->wheel_)
+        Remove(timer);
+    if (timeout < 0)
+        timeout = 0;
+    if (count_ == 0 && (uint64_t)(now / kTickMs) > current_tick_)
+    {
+        //nothing to fire in between, skip the idle ticks
+        current_tick_ = now / kTickMs;
+    }
+    //round up so a timer never fires early
+    timer->expire_ = (now + timeout + kTickMs - 1) / kTickMs;
+    timer->wheel_ = this;
+    ++count_;
+    Place(timer);
+}
+
+void TimerWheel::Remove(Timer * timer)
+{
+    if (timer->wheel_ != this)
+        return;
+    Unlink(timer);
+    timer->wheel_ = NULL;
+    --count_;
+}
+
+void TimerWheel::Cascade(int level, int index)
+{
+    Timer* head = &levels_[level][index];
+    while (!Empty(head))
+    {
+        Timer* timer = head->next_;
+        Unlink(timer);
+        Place(timer);
+    }
+}
+
+void TimerWheel::Advance(int64_t now)
+{
+    uint64_t target = now / kTickMs;
+    while (current_tick_ <= target)
+    {
+        if (count_ == 0)
+        {
+            current_tick_ = target + 1;
+            break;
+        }
+        int index = current_tick_ & (kRootSize - 1);
+        if (index == 0)
+        {
+            //the root wrapped around, move the next block down,
+            //an upper level is cascaded only when the level below wrapped too
+            for (int level = 0; level < kLevels; level++)
+            {
+                int shift = kRootBits + level * kLevelBits;
+                int level_index = (current_tick_ >> shift) & (kLevelSize - 1);
+                Cascade(level, level_index);
+                if (level_index != 0)
+                    break;
+            }
+        }
+        ++current_tick_;
+        Timer* head = &root_[index];
+        if (Empty(head))
+            continue;
+        //move the slot out first, callbacks may arm or cancel any timer
+        Timer expired;
+        expired.next_ = head->next_;
+        expired.prev_ = head->prev_;
+        expired.next_->prev_ = &expired;
+        expired.prev_->next_ = &expired;
+        head->next_ = head->prev_ = head;
+        while (!Empty(&expired))
+        {
+            Timer* timer = expired.next_;
+            Unlink(timer);
+            timer->wheel_ = NULL;
+            --count_;
+            if (timer->notify_)
+                timer->notify_->HandleTimeout(timer);
+        }
+    }
+}
+
+int64_t TimerWheel::NextTimeout(int64_t now)
+{
+    if (count_ == 0)
+        return -1;
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < kRootSize; i++)
+    {
+        if (!Empty(&root_[(current_tick_ + i) & (kRootSize - 1)]))
+        {
+            next = current_tick_ + i;
+            break;
+        }
+    }
+    //timers of the upper levels are not exact, wake up when they are cascaded
+    for (int level = 0; level < kLevels; level++)
+    {
+        int shift = kRootBits + level * kLevelBits;
+        uint64_t block = current_tick_ >> shift;
+        bool at_boundary = (current_tick_ & ((1ULL << shift) - 1)) == 0;
+        int first = at_boundary ? 0 : 1;
+        for (int k = first; k < first + kLevelSize; k++)
+        {
+            if (!Empty(&levels_[level][(block + k) & (kLevelSize - 1)]))
+            {
+                next = min(next, (block + k) << shift);
+                break;
+            }
+        }
+    }
+    int64_t timeout = (int64_t)next * kTickMs - now;
+    return timeout < 0 ? 0 : timeout;
+}
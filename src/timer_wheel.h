@@ -0,0 +1,61 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+class TimerWheel;
+
+//intrusive timer node, embedded in the object which arms it.
+//a timer is canceled automatically when it is destroyed
+class Timer
+{
+public:
+    Timer(ITimerNotify* notify = NULL);
+    ~Timer();
+    void SetNotify(ITimerNotify* notify);
+    bool IsActive();
+    void Cancel();
+private:
+    friend class TimerWheel;
+    ITimerNotify* notify_;
+    TimerWheel* wheel_;
+    Timer* prev_;
+    Timer* next_;
+    uint64_t expire_;//tick
+};
+
+//hierarchical timing wheel, 10ms per tick
+//level 0 has 256 slots, level 1-3 have 64 slots each, so the wheel covers
+//2^26 ticks (about 7.7 days), longer timeouts are clamped.
+//arm and cancel are O(1), timers of the upper levels are cascaded down
+//when the lower level wraps around.
+class TimerWheel
+{
+    const static int kRootBits = 8;
+    const static int kLevelBits = 6;
+    const static int kRootSize = 1 << kRootBits;
+    const static int kLevelSize = 1 << kLevelBits;
+    const static int kLevels = 3;
+public:
+    const static int kTickMs = 10;
+    TimerWheel();
+    ~TimerWheel();
+    //timeout is millisecond
+    void Add(Timer* timer, int64_t timeout, int64_t now);
+    void Remove(Timer* timer);
+    //fire all timers expired at now
+    void Advance(int64_t now);
+    //millisecond until the next timer (or cascade) is due, -1 if no timer
+    int64_t NextTimeout(int64_t now);
+private:
+    Timer root_[kRootSize];
+    Timer levels_[kLevels][kLevelSize];
+    uint64_t current_tick_;
+    size_t count_;
+
+    void Place(Timer* timer);
+    void Cascade(int level, int index);
+    static void Link(Timer* head, Timer* timer);
+    static void Unlink(Timer* timer);
+    static bool Empty(Timer* head);
+};
+
+#endif
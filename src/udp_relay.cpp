@@ -37,8 +37,16 @@
 // | Fixed |   Variable   |
 // +-------+--------------+
 
+const int kMaxSessions = 1024;
+const int kSessionTimeout = 60;//seconds
+const int kResolvedTimeout = 60;//seconds
+const size_t kMaxPendingHosts = 256;
+const size_t kMaxPendingDatagrams = 32;//per hostname
+const int kDnsTimeout = 10;//seconds
 
-UDPRelay::UDPRelay(Config * config, DNSResolve * dns_resolver, bool is_local)
+
+UDPRelay::UDPRelay(Config * config, DNSResolve * dns_resolver, ServerSelector* selector, bool is_local):
+    sessions_(config->GetInt("udp_max_sessions", kMaxSessions))
 {
     this->config_ = config;
     if (is_local)
@@ -57,8 +65,14 @@ UDPRelay::UDPRelay(Config * config, DNSResolve * dns_resolver, bool is_local)
     }
 
     dns_resolver_ = dns_resolver;
+    selector_ = selector;
     is_local_ = is_local;
     is_closed_ = false;
+    offload_ = false;
+    session_timeout_ = config_->GetInt("udp_timeout", kSessionTimeout);
+    created_count_ = 0;
+    evicted_count_ = 0;
+    next_token_ = 0;
     this->event_loop_ = NULL;
 }
 
@@ -72,61 +86,271 @@ bool UDPRelay::Init()
     inet_pton(AF_INET, listen_addr_.c_str(), &service.sin_addr.s_addr);
     service.sin_port = htons(listen_port_);
 
+    if (config_->GetInt("workers", 1) > 1 && -1 == SetReUsePort(server_socket_))
+    {
+        LOGE << "set SO_REUSEPORT failed" << GetSocketErrorCode() << "\n";
+        return false;
+    }
+
     if (0 != bind(server_socket_, (sockaddr *)&service,
                   sizeof(service)))
     {
         return false;
     }
     SetNoBlocking(server_socket_);
+    if (config_->GetInt("udp_offload") == 1)
+    {
+        offload_ = SetUdpGro(server_socket_) == 0;
+        if (!offload_)
+            LOGW << "UDP_GRO not supported, UDP offload is off\n";
+        batch_.SetOffload(offload_, offload_);
+    }
     return true;
 }
 
+// datagrams have no connect to measure, they follow what the TCP side learned
 void UDPRelay::SelectAServer()
 {
-    select_server_ = config_->GetStr("server_address");
-    select_port_ = config_->GetInt("server_port");
+    selector_->Select(0, &select_server_, &select_port_);
 }
 
 UDPRelay::~UDPRelay()
 {
+    if (event_loop_)
+    {
+        event_loop_->RemovePeriodic(this);
+        event_loop_->RemoveFlush(this);
+    }
+    for (auto& iter : pending_tokens_)
+        dns_resolver_->RemoveCallback(this, iter.first);
+    UDPSession* session;
+    while ((session = sessions_.Oldest()) != NULL)
+    {
+        if (event_loop_)
+            event_loop_->Remove(session->s);
+        CloseSocket(session->s);
+        sessions_.Remove(session);
+    }
+}
+
+UDPSession* UDPRelay::NewSession(const sockaddr* addr, int addr_len)
+{
+    //the least recently used client makes room
+    if (sessions_.Full())
+        CloseSession(sessions_.Oldest());
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET)
+    {
+        LOGW << "UDP socket failed " << GetSocketErrorCode() << "\n";
+        return NULL;
+    }
+    SetNoBlocking(s);
+    if (offload_)
+        SetUdpGro(s);
+    UDPSession* session = sessions_.Insert(addr, addr_len, s, event_loop_->Now());
+    if (!session)
+    {
+        CloseSocket(s);
+        return NULL;
+    }
+    event_loop_->Add(s, kPollIn, this);
+    ++created_count_;
+    return session;
+}
+
+void UDPRelay::CloseSession(UDPSession* session)
+{
+    SOCKET s = session->s;
+    //datagrams relayed in this iteration still go out
+    batch_.Flush(s);
+    event_loop_->Remove(s);
+    CloseSocket(s);
+    sessions_.Remove(session);
+    ++evicted_count_;
+}
+
+void UDPRelay::HandlePeriodic()
+{
+    for (auto iter = resolved_.begin(); iter != resolved_.end();)
+    {
+        if (iter->second.expire <= event_loop_->Now())
+            iter = resolved_.erase(iter);
+        else
+            ++iter;
+    }
+    for (auto iter = pending_dns_.begin(); iter != pending_dns_.end();)
+    {
+        if (iter->second.expire <= event_loop_->Now())
+        {
+            LOGW << "UDP resolve " << iter->first << " timeout, drop " << iter->second.datagrams.size() <<
+                 " datagrams\n";
+            dns_resolver_->RemoveCallback(this, iter->second.token);
+            pending_tokens_.erase(iter->second.token);
+            iter = pending_dns_.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+    if (session_timeout_ <= 0)
+        return;
+    int64_t deadline = event_loop_->Now() - (int64_t)session_timeout_ * 1000;
+    UDPSession* session;
+    while ((session = sessions_.Oldest()) != NULL && session->last_active <= deadline)
+        CloseSession(session);
+}
+
+bool UDPRelay::FindResolved(const string& hostname, in_addr* addr)
+{
+    auto iter = resolved_.find(hostname);
+    if (iter == resolved_.end() || iter->second.expire <= event_loop_->Now())
+        return false;
+    *addr = iter->second.addr;
+    return true;
+}
+
+void UDPRelay::QueueResolve(const string& hostname, int port, const char* data, size_t len,
+                            const UDPSession* session)
+{
+    auto iter = pending_dns_.find(hostname);
+    bool resolving = iter != pending_dns_.end();
+    if (!resolving && pending_dns_.size() >= kMaxPendingHosts)
+    {
+        LOGW << "UDP too many hostnames resolving, drop a datagram to " << hostname << "\n";
+        return;
+    }
+    PendingHost& host = pending_dns_[hostname];
+    if (host.datagrams.size() >= kMaxPendingDatagrams)
+    {
+        LOGW << "UDP too many datagrams wait for " << hostname << ", drop one\n";
+        return;
+    }
+    host.datagrams.push_back(PendingDatagram());
+    PendingDatagram& datagram = host.datagrams.back();
+    memcpy(&datagram.client_addr, &session->client_addr, session->client_addr_len);
+    datagram.client_addr_len = session->client_addr_len;
+    datagram.port = port;
+    datagram.data.assign(data, data + len);
+    if (resolving)
+        return;
+    //a hostname is resolved once for all the datagrams waiting for it
+    host.token = ++next_token_;
+    //a query lost keeps the datagrams until then, so it can't be turned off
+    int timeout = config_->GetInt("dns_timeout", kDnsTimeout);
+    if (timeout <= 0)
+        timeout = kDnsTimeout;
+    host.expire = event_loop_->Now() + (int64_t)timeout * 1000;
+    pending_tokens_[host.token] = hostname;
+    //may be called back at once for a cached host
+    dns_resolver_->Resolve(hostname, this, host.token);
+}
+
+void UDPRelay::DNSResolvedToken(uint64_t token, string hostname, const vector<string>& ips, string err)
+{
+    auto token_iter = pending_tokens_.find(token);
+    if (token_iter == pending_tokens_.end())
+        return;
+    auto iter = pending_dns_.find(token_iter->second);
+    pending_tokens_.erase(token_iter);
+    if (iter == pending_dns_.end())
+        return;
+    deque<PendingDatagram> datagrams;
+    datagrams.swap(iter->second.datagrams);
+    pending_dns_.erase(iter);
+    //the sockets of the sessions are IPv4
+    in_addr addr;
+    bool found = false;
+    for (auto& ip : ips)
+    {
+        if (inet_pton(AF_INET, ip.c_str(), &addr) == 1)
+        {
+            found = true;
+            break;
+        }
+    }
+    if (!found)
+    {
+        LOGW << "UDP can not resolve " << hostname << " " << err << ", drop " << datagrams.size() << " datagrams\n";
+        return;
+    }
+    ResolvedHost& resolved = resolved_[hostname];
+    resolved.addr = addr;
+    resolved.expire = event_loop_->Now() + kResolvedTimeout * 1000;
+    for (auto& datagram : datagrams)
+    {
+        UDPSession* session = sessions_.Find((sockaddr*)&datagram.client_addr, datagram.client_addr_len);
+        if (!session)
+            session = NewSession((sockaddr*)&datagram.client_addr, datagram.client_addr_len);
+        if (!session)
+            continue;
+        sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(datagram.port);
+        server_addr.sin_addr = addr;
+        BufferSendTo(session->s, datagram.data.data(), (int)datagram.data.size(),
+                     (sockaddr*)&server_addr, sizeof(server_addr));
+    }
+}
+
+size_t UDPRelay::GetSessionCount()
+{
+    return sessions_.GetCount();
+}
+
+int64_t UDPRelay::GetCreatedCount()
+{
+    return created_count_;
+}
+
+int64_t UDPRelay::GetEvictedCount()
+{
+    return evicted_count_;
 }
 
 void UDPRelay::HandleServer()
 {
-    vector<char> data(kBuffSize);
-    sockaddr_in addr;
-    int addr_len = sizeof(sockaddr_in);
-    int recv_len = BufferRecvFrom(server_socket_, &data[0], kBuffSize, (sockaddr*)&addr, &addr_len);
-    if (recv_len <= 0)
+    int first;
+    int count = batch_.Receive(server_socket_, &first);
+    if (count <= 0)
     {
         LOGW << "UDP handle_server: data is empty";
         return;
     }
-    data.resize(recv_len);
+    for (int i = first; i < first + count; i++)
+        HandleServerPacket(i);
+    if (!batch_.Empty())
+        event_loop_->AddFlush(this);
+}
+
+void UDPRelay::HandleServerPacket(int index)
+{
+    //the packet is handled in place, consumed headers are pulled off
+    DatagramBatch::Packet* packet = batch_.Get(index);
+    PacketBuffer& buffer = packet->buffer;
+    sockaddr_in addr;
+    memcpy(&addr, &packet->addr, sizeof(addr));
     if (is_local_)
     {
-        if (data[2] != 0)
+        if (buffer.Length() < 3 || buffer.Data()[2] != 0)
         {
             LOGW << "UDP drop a message since frag is not 0";
+            return;
         }
-        else
-        {
-            data.erase(data.begin(), data.begin() + 2);
-        }
+        //RSV and FRAG
+        buffer.Pull(3);
     }
     else
     {
         //TODO decrypt data
     }
     Sock5Header header_result;
-    if (!ParseHeader(data, &header_result))
+    if (!ParseHeader(buffer.Data(), buffer.Length(), &header_result))
     {
         LOGE << "can not parse header";
         return;
     }
-    LOGI << "udp data to " << header_result.remote_addr <<
-         header_result.remote_port << "from " <<
-         addr.sin_addr.s_addr << ":" << addr.sin_port;
     if (is_local_)
     {
         SelectAServer();
@@ -136,86 +360,87 @@ void UDPRelay::HandleServer()
         select_server_ = header_result.remote_addr;
         select_port_ = header_result.remote_port;
     }
-    if (dns_cache_.count(select_server_) == 0)
-    {
-        string ip = GetIpByHostName(select_server_);
-        dns_cache_[select_server_] = ip;
-    }
-    string ip = dns_cache_[select_server_];
-    string key = GetClientKey(addr, AF_INET);
-    if (key_sockets_.count(key) == 0)
-    {
-        SOCKET s;
-        s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        SetNoBlocking(server_socket_);
-        key_sockets_[key] = s;
-        socket_to_addr_[s] = addr;
-        sockets_.insert(s);
-        event_loop_->Add(s, kPollIn, this);
-    }
-    SOCKET new_socket = key_sockets_[key];
+    UDPSession* session = sessions_.Find((sockaddr*)&packet->addr, packet->addr_len);
+    if (session)
+        sessions_.Touch(session, event_loop_->Now());
+    else
+        session = NewSession((sockaddr*)&packet->addr, packet->addr_len);
+    if (!session)
+        return;
+    SOCKET new_socket = session->s;
     if (is_local_)
     {
         //TODO encrypt
     }
     else
     {
-        data.erase(data.begin(), data.begin() + header_result.header_length);
+        buffer.Pull(header_result.header_length);
     }
-    if (data.size() == 0)
+    if (buffer.Length() == 0)
     {
         return;
     }
     sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(select_port_);
-    inet_pton(AF_INET, select_server_.c_str(), &server_addr.sin_addr);
-    BufferSendTo(new_socket, &data[0], data.size(), (sockaddr*)&server_addr, sizeof(server_addr));
-}
-
-string UDPRelay::GetClientKey(sockaddr_in dest_addr, int server_af)
-{
-    stringstream ss;
-    ss << dest_addr.sin_addr.s_addr << ":" <<
-       dest_addr.sin_port << ":" << server_af;
-    return ss.str();
+    if (inet_pton(AF_INET, select_server_.c_str(), &server_addr.sin_addr) != 1 &&
+        !FindResolved(select_server_, &server_addr.sin_addr))
+    {
+        //sent once the hostname has been resolved
+        QueueResolve(select_server_, select_port_, buffer.Data(), buffer.Length(), session);
+        return;
+    }
+    batch_.Queue(index, new_socket, (sockaddr*)&server_addr, sizeof(server_addr));
 }
 
-void UDPRelay::HandleClient(SOCKET s)
+void UDPRelay::HandleClient(SOCKET s, UDPSession* session)
 {
-    vector<char> data(kBuffSize);
-    sockaddr_in addr;
-    int addr_len = sizeof(sockaddr_in);
-    int recv_len = BufferRecvFrom(server_socket_, &data[0], kBuffSize, (sockaddr*)&addr, &addr_len);
-    if (recv_len <= 0)
+    int first;
+    int count = batch_.Receive(s, &first);
+    if (count <= 0)
     {
         LOGW << "UDP handle_client: data is empty";
         return;
     }
+    sessions_.Touch(session, event_loop_->Now());
+    for (int i = first; i < first + count; i++)
+        HandleClientPacket(i, session);
+    if (!batch_.Empty())
+        event_loop_->AddFlush(this);
+}
+
+void UDPRelay::HandleClientPacket(int index, const UDPSession* session)
+{
+    //the header is pushed into the headroom of the slot
+    DatagramBatch::Packet* packet = batch_.Get(index);
+    PacketBuffer& buffer = packet->buffer;
     if (!is_local_)
     {
-        char response[7] = {0x01 };
+        sockaddr_in addr;
+        memcpy(&addr, &packet->addr, sizeof(addr));
+        char* response = buffer.Push(7);
+        response[0] = 0x01;
         memcpy(&response[1], &addr.sin_addr, 4);
         memcpy(&response[5], &addr.sin_port, 2);
-        data.insert(data.begin(), &response[0], &response[7]);
     }
     else
     {
         Sock5Header header_result;
-        if (!ParseHeader(data, &header_result))
+        if (!ParseHeader(buffer.Data(), buffer.Length(), &header_result))
         {
             LOGW << "can not parse header";
             return;
         }
-        char response[3] = { 0x00, 0x00, 0x00 };
-        data.insert(data.begin(), &response[0], &response[7]);
-    }
-    if (socket_to_addr_.count(s) > 0)
-    {
-        sockaddr_in client_addr =  socket_to_addr_[s];
-        LOGI << "sendto UDP";
-        BufferSendTo(server_socket_, &data[0], data.size(), (sockaddr*)&client_addr, sizeof(sockaddr_in));
+        //RSV and FRAG
+        memset(buffer.Push(3), 0, 3);
     }
+    batch_.Queue(index, server_socket_, (sockaddr*)&session->client_addr, session->client_addr_len);
+}
+
+void UDPRelay::HandleFlush()
+{
+    batch_.Flush();
 }
 
 void UDPRelay::HandleEvent(SOCKET s, int event)
@@ -228,14 +453,16 @@ void UDPRelay::HandleEvent(SOCKET s, int event)
         }
         HandleServer();
     }
-    else if(s != INVALID_SOCKET &&
-            sockets_.find(s) != sockets_.end())
+    else
     {
+        UDPSession* session = sessions_.FindBySocket(s);
+        if (!session)
+            return;
         if (event & kPollErr)
         {
             LOGI << "UDP client_socket err";
         }
-        HandleClient(s);
+        HandleClient(s, session);
     }
 }
 
@@ -253,5 +480,7 @@ bool UDPRelay::AddToLoop(EventLoop * event_loop)
     }
     event_loop_ = event_loop;
     event_loop_->Add(server_socket_, kPollIn | kPollErr, this);
+    //idle sessions are expired with the loop's precision
+    event_loop_->AddPeriodic(this);
     return true;
 }
@@ -1,14 +1,44 @@
 #ifndef _UDP_RELAY_H_
 #define _UDP_RELAY_H_
 
-class UDPRelay: public ISockNotify
+class UDPRelay: public ISockNotify, public IFlushNotify, public IPeriodicNotify, public IDNSNotify
 {
+    //a datagram copied out of the batch until its hostname is resolved
+    struct PendingDatagram
+    {
+        sockaddr_storage client_addr;
+        int client_addr_len;
+        int port;
+        vector<char> data;
+    };
+    struct PendingHost
+    {
+        uint64_t token;
+        int64_t expire;//the query is given up, the resolver doesn't time out
+        deque<PendingDatagram> datagrams;
+    };
+    struct ResolvedHost
+    {
+        in_addr addr;
+        int64_t expire;
+    };
 public:
-    UDPRelay(Config * config, DNSResolve * dns_resolver, bool is_local);
+    UDPRelay(Config * config, DNSResolve * dns_resolver, ServerSelector* selector, bool is_local);
     bool Init();
     ~UDPRelay();
     virtual void HandleEvent(SOCKET s, int event) override;
+    //send the datagrams relayed in this loop iteration
+    virtual void HandleFlush() override;
+    //close the sessions idle for --udp-timeout, drop the datagrams of
+    //hostnames not resolved within --dns-timeout
+    virtual void HandlePeriodic() override;
+    //send the datagrams waiting for the hostname of the token
+    virtual void DNSResolvedToken(uint64_t token, string hostname, const vector<string>& ips, string err) override;
     bool AddToLoop(EventLoop * event_loop);
+    size_t GetSessionCount();
+    int64_t GetCreatedCount();
+    //closed when idle or to make room for a new one
+    int64_t GetEvictedCount();
 private:
     bool is_local_;
     Config* config_;
@@ -19,18 +49,32 @@ private:
     int remote_port_;
     EventLoop* event_loop_;
     DNSResolve* dns_resolver_;
+    ServerSelector* selector_;
     SOCKET server_socket_;
-    set<SOCKET> sockets_;
-    map<string, string> dns_cache_;
-    map<string, SOCKET> key_sockets_;
-    map<SOCKET, sockaddr_in> socket_to_addr_;
+    map<string, ResolvedHost> resolved_;//IPv4 of the hostnames sent to
+    map<string, PendingHost> pending_dns_;
+    map<uint64_t, string> pending_tokens_;
+    uint64_t next_token_;
+    UDPSessionTable sessions_;
+    int session_timeout_;//seconds
+    int64_t created_count_;
+    int64_t evicted_count_;
     string select_server_;
     int    select_port_;
+    DatagramBatch batch_;
+    bool offload_;//GSO and GRO
 
     void SelectAServer();
     void HandleServer();
-    void HandleClient(SOCKET s);
-    string GetClientKey(sockaddr_in dest_addr, int server_af);
+    void HandleServerPacket(int index);
+    void HandleClient(SOCKET s, UDPSession* session);
+    void HandleClientPacket(int index, const UDPSession* session);
+    UDPSession* NewSession(const sockaddr* addr, int addr_len);
+    void CloseSession(UDPSession* session);
+    bool FindResolved(const string& hostname, in_addr* addr);
+    //keep the datagram until hostname is resolved, dropped past the bounds
+    void QueueResolve(const string& hostname, int port, const char* data, size_t len,
+                      const UDPSession* session);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include "common.h"
+#include "udp_session.h"
+
+UDPSessionTable::UDPSessionTable(size_t max_sessions):
+    count_(0),
+    free_(kNone),
+    head_(kNone),
+    tail_(kNone)
+{
+    if (max_sessions == 0)
+        max_sessions = 1;
+    sessions_.resize(max_sessions);
+    for (int i = (int)max_sessions - 1; i >= 0; i--)
+    {
+        sessions_[i].s = INVALID_SOCKET;
+        sessions_[i].next = free_;
+        free_ = i;
+    }
+    //at most half full, so probes stay short
+    size_t capacity = 2;
+    while (capacity < max_sessions * 2)
+        capacity <<= 1;
+    slots_.assign(capacity, (int)kNone);
+    mask_ = capacity - 1;
+}
+
+bool UDPSessionTable::MakeKey(const sockaddr* addr, int addr_len, UDPSessionKey* key)
+{
+    memset(key, 0, sizeof(*key));
+    key->family = addr->sa_family;
+    if (addr->sa_family == AF_INET && addr_len >= (int)sizeof(sockaddr_in))
+    {
+        const sockaddr_in* addr4 = (const sockaddr_in*)addr;
+        memcpy(key->addr, &addr4->sin_addr, 4);
+        key->port = addr4->sin_port;
+        return true;
+    }
+    if (addr->sa_family == AF_INET6 && addr_len >= (int)sizeof(sockaddr_in6))
+    {
+        const sockaddr_in6* addr6 = (const sockaddr_in6*)addr;
+        memcpy(key->addr, &addr6->sin6_addr, 16);
+        key->port = addr6->sin6_port;
+        return true;
+    }
+    return false;
+}
+
+//FNV-1a
+uint32_t UDPSessionTable::Hash(const UDPSessionKey& key)
+{
+    const uint8_t* bytes = (const uint8_t*)&key;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(key); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+size_t UDPSessionTable::Probe(const UDPSessionKey& key, uint32_t hash)
+{
+    size_t slot = hash & mask_;
+    while (slots_[slot] != kNone)
+    {
+        UDPSession& session = sessions_[slots_[slot]];
+        if (session.hash == hash && memcmp(&session.key, &key, sizeof(key)) == 0)
+            break;
+        slot = (slot + 1) & mask_;
+    }
+    return slot;
+}
+
+UDPSession* UDPSessionTable::Find(const sockaddr* addr, int addr_len)
+{
+    UDPSessionKey key;
+    if (!MakeKey(addr, addr_len, &key))
+        return NULL;
+    size_t slot = Probe(key, Hash(key));
+    if (slots_[slot] == kNone)
+        return NULL;
+    return &sessions_[slots_[slot]];
+}
+
+UDPSession* UDPSessionTable::FindBySocket(SOCKET s)
+{
+    if (s == INVALID_SOCKET || (size_t)s >= by_socket_.size() || by_socket_[s] == kNone)
+        return NULL;
+    return &sessions_[by_socket_[s]];
+}
+
+UDPSession* UDPSessionTable::Insert(const sockaddr* addr, int addr_len, SOCKET s, int64_t now)
+{
+    UDPSessionKey key;
+    if (free_ == kNone || s == INVALID_SOCKET || !MakeKey(addr, addr_len, &key))
+        return NULL;
+    uint32_t hash = Hash(key);
+    size_t slot = Probe(key, hash);
+    if (slots_[slot] != kNone)
+        return NULL;
+    int index = free_;
+    UDPSession& session = sessions_[index];
+    free_ = session.next;
+    session.key = key;
+    session.hash = hash;
+    session.s = s;
+    memcpy(&session.client_addr, addr, addr_len);
+    session.client_addr_len = addr_len;
+    session.last_active = now;
+    slots_[slot] = index;
+    if ((size_t)s >= by_socket_.size())
+        by_socket_.resize(s + 1, (int)kNone);
+    by_socket_[s] = index;
+    LinkHead(index);
+    ++count_;
+    return &session;
+}
+
+void UDPSessionTable::Remove(UDPSession* session)
+{
+    int index = (int)(session - &sessions_[0]);
+    size_t slot = Probe(session->key, session->hash);
+    assert(slots_[slot] == index);
+    //shift back the entries after the hole which can't be found across it
+    size_t next = (slot + 1) & mask_;
+    while (slots_[next] != kNone)
+    {
+        size_t home = sessions_[slots_[next]].hash & mask_;
+        bool movable = slot <= next ? (home <= slot || home > next) : (home <= slot && home > next);
+        if (movable)
+        {
+            slots_[slot] = slots_[next];
+            slot = next;
+        }
+        next = (next + 1) & mask_;
+    }
+    slots_[slot] = kNone;
+    by_socket_[session->s] = kNone;
+    Unlink(index);
+    session->s = INVALID_SOCKET;
+    session->next = free_;
+    free_ = index;
+    --count_;
+}
+
+void UDPSessionTable::Touch(UDPSession* session, int64_t now)
+{
+    int index = (int)(session - &sessions_[0]);
+    session->last_active = now;
+    if (head_ == index)
+        return;
+    Unlink(index);
+    LinkHead(index);
+}
+
+UDPSession* UDPSessionTable::Oldest()
+{
+    return tail_ == kNone ? NULL : &sessions_[tail_];
+}
+
+bool UDPSessionTable::Full()
+{
+    return free_ == kNone;
+}
+
+size_t UDPSessionTable::GetCount()
+{
+    return count_;
+}
+
+void UDPSessionTable::Unlink(int index)
+{
+    UDPSession& session = sessions_[index];
+    if (session.prev != kNone)
+        sessions_[session.prev].next = session.next;
+    else
+        head_ = session.next;
+    if (session.next != kNone)
+        sessions_[session.next].prev = session.prev;
+    else
+        tail_ = session.prev;
+}
+
+void UDPSessionTable::LinkHead(int index)
+{
+    UDPSession& session = sessions_[index];
+    session.prev = kNone;
+    session.next = head_;
+    if (head_ != kNone)
+        sessions_[head_].prev = index;
+    head_ = index;
+    if (tail_ == kNone)
+        tail_ = index;
+}
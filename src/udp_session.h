@@ -0,0 +1,65 @@
+#ifndef _UDP_SESSION_H_
+#define _UDP_SESSION_H_
+
+//address of a client of the UDP relay in binary, compared as bytes
+struct UDPSessionKey
+{
+    uint8_t addr[16];//IPv4 in the first 4 bytes
+    uint16_t port;//network order
+    uint16_t family;
+};
+
+//a client of the UDP relay, it has a socket of its own to the far side
+struct UDPSession
+{
+    UDPSessionKey key;
+    uint32_t hash;
+    SOCKET s;
+    sockaddr_storage client_addr;
+    int client_addr_len;
+    int64_t last_active;
+    int prev;//least recently used list, the oldest is the tail
+    int next;//also the free list
+};
+
+//sessions of a relay, at most max_sessions of them. clients are looked up
+//in an open addressing table with linear probing, sockets in a vector
+//indexed by fd. the table only indexes sessions, which keep their place
+//in a fixed array, so a session pointer is valid until it's removed.
+//closing the socket of a removed session is up to the caller
+class UDPSessionTable
+{
+    const static int kNone = -1;
+public:
+    UDPSessionTable(size_t max_sessions);
+    //the session of the client, NULL if none
+    UDPSession* Find(const sockaddr* addr, int addr_len);
+    UDPSession* FindBySocket(SOCKET s);
+    //the table must not be full
+    UDPSession* Insert(const sockaddr* addr, int addr_len, SOCKET s, int64_t now);
+    void Remove(UDPSession* session);
+    //move the session to the head of the used list
+    void Touch(UDPSession* session, int64_t now);
+    //the least recently used session, NULL if empty
+    UDPSession* Oldest();
+    bool Full();
+    size_t GetCount();
+private:
+    vector<UDPSession> sessions_;
+    vector<int> slots_;//session index or kNone, a power of two
+    vector<int> by_socket_;//session index by fd
+    size_t mask_;
+    size_t count_;
+    int free_;
+    int head_;
+    int tail_;
+
+    static bool MakeKey(const sockaddr* addr, int addr_len, UDPSessionKey* key);
+    static uint32_t Hash(const UDPSessionKey& key);
+    //the slot of key, or the empty slot it would go in
+    size_t Probe(const UDPSessionKey& key, uint32_t hash);
+    void Unlink(int index);
+    void LinkHead(int index);
+};
+
+#endif
@@ -0,0 +1,663 @@
+#include "common.h"
+#include "uring_loop.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+
+//the completion requests need the headers of 6.1
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_DEFER_TASKRUN)
+#define URING_COMPLETION
+#endif
+
+//user_data of a request is its kind, a generation and the fd
+enum
+{
+    kOpPoll = 0,
+    kOpAccept = 1,
+    kOpRecv = 2,
+    kOpSend = 3
+};
+const uint32_t kGenMask = 0xFFFFFF;
+//user_data of cancel requests, their completions are ignored
+const uint64_t kCancelTag = ~0ULL;
+//group of the provided receive buffers
+const uint16_t kBufferGroup = 0;
+
+static uint64_t MakeTag(int op, SOCKET s, uint32_t gen)
+{
+    return ((uint64_t)op << 56) | ((uint64_t)(gen & kGenMask) << 32) | (uint32_t)s;
+}
+
+UringLoop::UringLoop():
+    ring_fd_(-1),
+    multishot_(true),
+    completion_(false),
+    disabled_(false),
+    next_gen_(0),
+    sq_ring_(MAP_FAILED),
+    sq_ring_size_(0),
+    cq_ring_(MAP_FAILED),
+    cq_ring_size_(0),
+    sqes_((io_uring_sqe*)MAP_FAILED),
+    sqes_size_(0),
+    to_submit_(0),
+    buf_ring_(MAP_FAILED),
+    buf_ring_size_(0),
+    recv_bufs_(NULL),
+    buf_tail_(0)
+{
+}
+
+UringLoop::~UringLoop()
+{
+    Close();
+}
+
+bool UringLoop::Init()
+{
+    io_uring_params params;
+    bool deferred = false;
+#ifdef URING_COMPLETION
+    //a multishot recv goes on receiving until its cancel is seen, with the
+    //deferred task work (6.1+) it only runs in io_uring_enter, which is
+    //called by the thread of the loop alone. its first call enables the ring
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+                   IORING_SETUP_R_DISABLED;
+    params.cq_entries = kRingSize * 4;
+    ring_fd_ = (int)syscall(__NR_io_uring_setup, kRingSize, &params);
+    deferred = ring_fd_ >= 0;
+    disabled_ = deferred;
+#endif
+    if (!deferred)
+    {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = kRingSize * 4;
+        ring_fd_ = (int)syscall(__NR_io_uring_setup, kRingSize, &params);
+    }
+    if (ring_fd_ < 0)
+    {
+        LOGW << "io_uring_setup failed " << GetSocketErrorCode() << "\n";
+        return false;
+    }
+    //the wait timeout is passed by IORING_ENTER_EXT_ARG (5.11+)
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        LOGW << "io_uring doesn't support IORING_FEAT_EXT_ARG\n";
+        return false;
+    }
+    const int kProbeOps = 256;
+    io_uring_probe* probe = (io_uring_probe*)calloc(1, sizeof(io_uring_probe) + kProbeOps * sizeof(io_uring_probe_op));
+    int ret = (int)syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PROBE, probe, kProbeOps);
+    bool supported = ret >= 0 &&
+                     probe->last_op >= IORING_OP_POLL_REMOVE &&
+                     (probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) &&
+                     (probe->ops[IORING_OP_POLL_REMOVE].flags & IO_URING_OP_SUPPORTED);
+#ifdef URING_COMPLETION
+    //multishot recv isn't told by the probe, SEND_ZC came with it in 6.0
+    bool completion = deferred && ret >= 0 && probe->last_op >= IORING_OP_SEND_ZC;
+#else
+    bool completion = false;
+#endif
+    free(probe);
+    if (!supported)
+    {
+        LOGW << "io_uring doesn't support poll requests\n";
+        return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+    {
+        sq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+        cq_ring_size_ = sq_ring_size_;
+    }
+    sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+    {
+        LOGW << "mmap io_uring sq ring failed\n";
+        return false;
+    }
+    if (single_mmap)
+    {
+        cq_ring_ = sq_ring_;
+    }
+    else
+    {
+        cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED)
+        {
+            LOGW << "mmap io_uring cq ring failed\n";
+            return false;
+        }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe*)mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+    {
+        LOGW << "mmap io_uring sqes failed\n";
+        return false;
+    }
+    char* sq = (char*)sq_ring_;
+    sq_head_ = (unsigned*)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_entries_ = *(unsigned*)(sq + params.sq_off.ring_entries);
+    sq_array_ = (unsigned*)(sq + params.sq_off.array);
+    char* cq = (char*)cq_ring_;
+    cq_head_ = (unsigned*)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    completion_ = completion && InitCompletion();
+    if (completion_)
+        LOGI << "io_uring accepts, receives and sends by completion requests\n";
+    return true;
+}
+
+bool UringLoop::InitCompletion()
+{
+#ifdef URING_COMPLETION
+    buf_ring_size_ = kRecvBuffers * sizeof(io_uring_buf);
+    buf_ring_ = mmap(NULL, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring_ == MAP_FAILED)
+        return false;
+    recv_bufs_ = (char*)malloc((size_t)kRecvBuffers * kRecvBufferSize);
+    if (recv_bufs_ == NULL)
+        return false;
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring_;
+    reg.ring_entries = kRecvBuffers;
+    reg.bgid = kBufferGroup;
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        LOGW << "io_uring buffer ring failed " << GetSocketErrorCode() << "\n";
+        return false;
+    }
+    for (unsigned i = 0; i < kRecvBuffers; i++)
+        ProvideBuffer(i);
+    return true;
+#else
+    return false;
+#endif
+}
+
+io_uring_sqe* UringLoop::GetSqe()
+{
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail_;
+    if (tail - head >= sq_entries_)
+    {
+        //submission ring is full, flush it without waiting
+        Enter(0, 0);
+        head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (tail - head >= sq_entries_)
+        {
+            LOGE << "io_uring submission ring is full\n";
+            return NULL;
+        }
+    }
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    //no SQPOLL thread, the kernel only looks at the ring in io_uring_enter
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+    return sqe;
+}
+
+bool UringLoop::Reserve(unsigned count)
+{
+    if (count > sq_entries_)
+        return false;
+    if (*sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) + count <= sq_entries_)
+        return true;
+    Enter(0, 0);
+    return *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) + count <= sq_entries_;
+}
+
+int UringLoop::Enter(unsigned wait_nr, int timeout)
+{
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    unsigned flags = 0;
+    void* argp = NULL;
+    size_t argsz = 0;
+    if (wait_nr > 0)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    if (disabled_)
+    {
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0)
+        {
+            LOGE << "io_uring enable failed " << GetSocketErrorCode() << "\n";
+            return -1;
+        }
+        disabled_ = false;
+    }
+    int ret = (int)syscall(__NR_io_uring_enter, ring_fd_, to_submit_, wait_nr, flags, argp, argsz);
+    if (ret < 0)
+    {
+        int err = GetSocketErrorCode();
+        //timeout, signal or completion ring is busy, none of them is fatal
+        if (err == ETIME || err == EINTR || err == EBUSY || err == EAGAIN)
+            return 0;
+        LOGE << "io_uring_enter failed " << err << "\n";
+        return -1;
+    }
+    to_submit_ -= min((unsigned)ret, to_submit_);
+    return ret;
+}
+
+bool UringLoop::NeedPoll(const PollState & state)
+{
+    if (state.io == kIoPoll)
+        return true;
+    //errors and the end of the stream come with the accept or recv
+    return (state.mode & kPollOut) != 0;
+}
+
+void UringLoop::Arm(SOCKET s, PollState & state)
+{
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL)
+        return;
+    unsigned events = POLLERR | POLLHUP;
+    if ((state.mode & kPollIn) && state.io == kIoPoll)
+        events |= POLLIN;
+    if (state.mode & kPollOut)
+        events |= POLLOUT;
+    state.gen = ++next_gen_;
+    state.armed = true;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s;
+    sqe->poll32_events = events;
+    if ((state.mode & kPollEdge) && multishot_)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = MakeTag(kOpPoll, s, state.gen);
+}
+
+void UringLoop::Cancel(SOCKET s, PollState & state)
+{
+    io_uring_sqe* sqe = GetSqe();
+    state.armed = false;
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = MakeTag(kOpPoll, s, state.gen);
+    sqe->user_data = kCancelTag;
+}
+
+void UringLoop::ArmIo(SOCKET s, PollState & state)
+{
+#ifdef URING_COMPLETION
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL)
+        return;
+    state.io_state = kIoArmed;
+    sqe->fd = s;
+    if (state.io == kIoAccept)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        //as AcceptNoBlocking, the relay asks for the peer address
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = MakeTag(kOpAccept, s, state.reg_gen);
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufferGroup;
+        sqe->user_data = MakeTag(kOpRecv, s, state.reg_gen);
+    }
+#endif
+}
+
+void UringLoop::CancelRequest(uint64_t user_data, bool all)
+{
+#ifdef URING_COMPLETION
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    if (all)
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = kCancelTag;
+#endif
+}
+
+void UringLoop::UpdateIo(SOCKET s, PollState & state)
+{
+    bool wanted = (state.mode & kPollIn) != 0;
+    if (wanted && state.io_state == kIoIdle)
+    {
+        ArmIo(s, state);
+    }
+    else if (!wanted && state.io_state == kIoArmed)
+    {
+        //the kernel keeps receiving into the buffers given back until it
+        //sees the cancel, so it's submitted now. the data received until
+        //then still comes
+        CancelRequest(MakeTag(state.io == kIoAccept ? kOpAccept : kOpRecv, s, state.reg_gen), false);
+        state.io_state = kIoCanceling;
+        Enter(0, 0);
+    }
+}
+
+void UringLoop::ProvideBuffer(unsigned bid)
+{
+#ifdef URING_COMPLETION
+    //io_uring_buf_ring isn't laid out the same by C++ (its flexible array),
+    //the ring is an array of io_uring_buf with the tail in place of resv
+    //of the first one
+    io_uring_buf* bufs = (io_uring_buf*)buf_ring_;
+    io_uring_buf* buf = &bufs[buf_tail_ & (kRecvBuffers - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(recv_bufs_ + (size_t)bid * kRecvBufferSize);
+    buf->len = kRecvBufferSize;
+    buf->bid = (uint16_t)bid;
+    ++buf_tail_;
+    //the kernel takes the buffers up to the tail
+    __atomic_store_n(&bufs[0].resv, buf_tail_, __ATOMIC_RELEASE);
+#endif
+}
+
+void UringLoop::HandleIo(EventLoop* loop, const io_uring_cqe& cqe, SOCKET s, int op, bool live)
+{
+    int bid = -1;
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+        bid = (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    if (!live)
+    {
+        //a request of a socket removed since
+        if (op == kOpAccept && cqe.res >= 0)
+            close(cqe.res);
+    }
+    else if (op == kOpSend)
+    {
+        PollState& state = sock_state_[s];
+        --state.sends;
+        loop->DispatchSend(state.tag, cqe.res);
+    }
+    else
+    {
+        PollState& state = sock_state_[s];
+        uint64_t tag = state.tag;
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            //the request has ended, the next poll arms a new one unless
+            //the stream has ended or failed
+            bool again = op == kOpAccept || cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED;
+            state.io_state = kIoIdle;
+            if (again && (state.mode & kPollIn))
+                rearm_.push_back(s);
+        }
+        if (op == kOpAccept)
+        {
+            if (cqe.res >= 0)
+                loop->DispatchAccept(tag, cqe.res);
+            else if (cqe.res != -ECANCELED)
+                LOGW << "accept failed " << -cqe.res << "\n";
+        }
+        else if (cqe.res > 0 && bid >= 0)
+        {
+            loop->DispatchRecv(tag, recv_bufs_ + (size_t)bid * kRecvBufferSize, cqe.res);
+        }
+        else if (cqe.res <= 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+        {
+            loop->DispatchRecv(tag, NULL, cqe.res);
+        }
+    }
+    if (bid >= 0)
+        ProvideBuffer(bid);
+}
+
+int UringLoop::Poll(EventLoop* loop, int timeout)
+{
+    if (timeout < 0)
+    {
+        timeout = 1000;
+    }
+    //requests which ended in the last iteration, the handlers have run
+    //so the readiness is checked again
+    for (auto& s : rearm_)
+    {
+        PollState& state = sock_state_[s];
+        if (!state.registered)
+            continue;
+        if (!state.armed && NeedPoll(state))
+            Arm(s, state);
+        if (state.io != kIoPoll && state.io_state == kIoIdle && (state.mode & kPollIn))
+            ArmIo(s, state);
+    }
+    rearm_.clear();
+    //a zero timeout still gets the events, the deferred task work runs
+    if (-1 == Enter(1, timeout))
+    {
+        return -1;
+    }
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        io_uring_cqe cqe = cqes_[head & cq_mask_];
+        //release the entry before the handler runs, it may submit more
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        if (cqe.user_data == kCancelTag)
+            continue;
+        int op = (int)(cqe.user_data >> 56);
+        SOCKET s = (SOCKET)(uint32_t)cqe.user_data;
+        uint32_t gen = (uint32_t)(cqe.user_data >> 32) & kGenMask;
+        bool live = (size_t)s < sock_state_.size() && sock_state_[s].registered;
+        if (op != kOpPoll)
+        {
+            HandleIo(loop, cqe, s, op, live && (sock_state_[s].reg_gen & kGenMask) == gen);
+            continue;
+        }
+        if (!live || (sock_state_[s].gen & kGenMask) != gen)
+        {
+            //completion of a poll which has been canceled
+            continue;
+        }
+        PollState& state = sock_state_[s];
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            state.armed = false;
+            rearm_.push_back(s);
+        }
+        if (cqe.res < 0)
+        {
+            if (cqe.res == -EINVAL && (state.mode & kPollEdge) && multishot_)
+            {
+                LOGW << "io_uring doesn't support multishot poll, use one-shot poll\n";
+                multishot_ = false;
+            }
+            continue;
+        }
+        int mode = 0;
+        if (cqe.res & POLLIN)
+            mode |= kPollIn;
+        if (cqe.res & POLLOUT)
+            mode |= kPollOut;
+        if (cqe.res & POLLERR)
+            mode |= kPollErr;
+        if (cqe.res & POLLHUP)
+            mode |= kPollHup;
+        loop->Dispatch(state.tag, mode);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void UringLoop::Register(SOCKET s, int mode, uint64_t tag)
+{
+    if ((size_t)s >= sock_state_.size())
+    {
+        PollState empty = { false, false, 0, 0, 0, 0, kIoPoll, kIoIdle, 0 };
+        sock_state_.resize(s + 1, empty);
+    }
+    PollState& state = sock_state_[s];
+    state.registered = true;
+    state.armed = false;
+    state.mode = mode;
+    state.gen = 0;
+    state.tag = tag;
+    state.reg_gen = ++next_gen_;
+    state.io = kIoPoll;
+    state.io_state = kIoIdle;
+    state.sends = 0;
+    Arm(s, state);
+}
+
+void UringLoop::UnRegister(SOCKET s)
+{
+    if ((size_t)s >= sock_state_.size() || !sock_state_[s].registered)
+        return;
+    PollState& state = sock_state_[s];
+    if (state.armed)
+        Cancel(s, state);
+    //keyed by user_data, the fd is usually closed before they're submitted
+    if (state.io_state == kIoArmed)
+        CancelRequest(MakeTag(state.io == kIoAccept ? kOpAccept : kOpRecv, s, state.reg_gen), false);
+    if (state.sends > 0)
+        CancelRequest(MakeTag(kOpSend, s, state.reg_gen), true);
+    state.registered = false;
+}
+
+void UringLoop::Modify(SOCKET s, int mode)
+{
+    if ((size_t)s >= sock_state_.size() || !sock_state_[s].registered)
+        return;
+    PollState& state = sock_state_[s];
+    if (state.mode == mode && (state.armed || !NeedPoll(state)))
+        return;
+    state.mode = mode;
+    if (state.io != kIoPoll)
+        UpdateIo(s, state);
+    if (state.armed)
+        Cancel(s, state);
+    if (NeedPoll(state))
+        Arm(s, state);
+}
+
+bool UringLoop::StartAccept(SOCKET s)
+{
+    if (!completion_ || (size_t)s >= sock_state_.size() || !sock_state_[s].registered)
+        return false;
+    PollState& state = sock_state_[s];
+    state.io = kIoAccept;
+    if (state.armed)
+        Cancel(s, state);
+    if (NeedPoll(state))
+        Arm(s, state);
+    UpdateIo(s, state);
+    return true;
+}
+
+bool UringLoop::StartRecv(SOCKET s)
+{
+    if (!completion_ || (size_t)s >= sock_state_.size() || !sock_state_[s].registered)
+        return false;
+    PollState& state = sock_state_[s];
+    state.io = kIoRecv;
+    if (state.armed)
+        Cancel(s, state);
+    if (NeedPoll(state))
+        Arm(s, state);
+    UpdateIo(s, state);
+    return true;
+}
+
+int UringLoop::SubmitSend(SOCKET s, const iovec* iov, int count)
+{
+    if (!completion_ || count <= 0 || (size_t)s >= sock_state_.size() || !sock_state_[s].registered)
+        return 0;
+    //a chain split by a flush of the ring would lose its order
+    if (!Reserve(count))
+        return 0;
+    PollState& state = sock_state_[s];
+    for (int i = 0; i < count; i++)
+    {
+        io_uring_sqe* sqe = GetSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = s;
+        sqe->addr = (uint64_t)(uintptr_t)iov[i].iov_base;
+        sqe->len = (unsigned)iov[i].iov_len;
+        //a short send would break the link, the kernel sends it all
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (i + 1 < count)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = MakeTag(kOpSend, s, state.reg_gen);
+    }
+    state.sends += count;
+    return count;
+}
+
+void UringLoop::CancelIo(SOCKET s)
+{
+    if ((size_t)s >= sock_state_.size() || !sock_state_[s].registered)
+        return;
+    PollState& state = sock_state_[s];
+    //nothing is armed again
+    state.mode = 0;
+    if (state.armed)
+    {
+        Cancel(s, state);
+        state.gen = ++next_gen_;
+    }
+    if (state.io_state == kIoArmed)
+    {
+        CancelRequest(MakeTag(state.io == kIoAccept ? kOpAccept : kOpRecv, s, state.reg_gen), false);
+        state.io_state = kIoCanceling;
+    }
+    if (state.sends > 0)
+        CancelRequest(MakeTag(kOpSend, s, state.reg_gen), true);
+}
+
+void UringLoop::Close()
+{
+    if (sqes_ != MAP_FAILED)
+        munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+        munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED)
+        munmap(sq_ring_, sq_ring_size_);
+    sqes_ = (io_uring_sqe*)MAP_FAILED;
+    cq_ring_ = MAP_FAILED;
+    sq_ring_ = MAP_FAILED;
+    if (ring_fd_ >= 0)
+        close(ring_fd_);
+    ring_fd_ = -1;
+    //the kernel is done with the receive buffers once the ring is closed
+    if (buf_ring_ != MAP_FAILED)
+        munmap(buf_ring_, buf_ring_size_);
+    buf_ring_ = MAP_FAILED;
+    free(recv_bufs_);
+    recv_bufs_ = NULL;
+    completion_ = false;
+    sock_state_.clear();
+    rearm_.clear();
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef _URING_LOOP_H_
+#define _URING_LOOP_H_
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+//io_uring mode
+//every socket is watched by a poll request, level triggered sockets use a
+//one-shot poll which is armed again after the event has been dispatched,
+//edge triggered sockets use a multishot poll. All arm and cancel requests
+//are queued in the submission ring and submitted by the same io_uring_enter
+//that waits for completions, so changing interest costs no extra syscall.
+//
+//with the completion requests (6.0+) a listener accepts by a multishot
+//accept and a socket receives by a multishot recv into the buffers provided
+//to the kernel, kPollIn of their mode arms the request instead of a poll.
+//sends are linked so they go out in order, each one sends all its data
+class UringLoop : public ILoopImpl
+{
+    const static unsigned kRingSize = 4096;
+    //receive buffers provided to the kernel, a recv completion takes one
+    //and it's given back once the data has been dispatched
+    const static unsigned kRecvBuffers = 256;//a power of 2
+    const static unsigned kRecvBufferSize = 16 * 1024;
+public:
+    UringLoop();
+    ~UringLoop();
+    bool Init();
+    virtual int Poll(EventLoop* loop, int timeout) override;
+    virtual void Register(SOCKET s, int mode, uint64_t tag) override;
+    virtual void UnRegister(SOCKET s) override;
+    virtual void Modify(SOCKET s, int mode) override;
+    virtual void Close() override;
+    virtual bool StartAccept(SOCKET s) override;
+    virtual bool StartRecv(SOCKET s) override;
+    virtual int SubmitSend(SOCKET s, const iovec* iov, int count) override;
+    virtual void CancelIo(SOCKET s) override;
+private:
+    //what kPollIn of a socket stands for
+    enum IoKind
+    {
+        kIoPoll,
+        kIoAccept,
+        kIoRecv
+    };
+    //state of the accept or recv request, at most one is alive so the
+    //data keeps its order
+    enum IoState
+    {
+        kIoIdle,
+        kIoArmed,
+        kIoCanceling
+    };
+    struct PollState
+    {
+        bool registered;
+        bool armed;
+        int mode;
+        uint32_t gen;//generation of the poll request
+        uint64_t tag;//EventLoop tag
+        uint32_t reg_gen;//generation of the registration, of the other requests
+        int io;
+        int io_state;
+        int sends;//in flight
+    };
+    int ring_fd_;
+    bool multishot_;
+    bool completion_;
+    bool disabled_;//until the loop's thread enters the ring
+    uint32_t next_gen_;
+    void* sq_ring_;
+    size_t sq_ring_size_;
+    void* cq_ring_;
+    size_t cq_ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+    unsigned to_submit_;
+    void* buf_ring_;
+    size_t buf_ring_size_;
+    char* recv_bufs_;
+    uint16_t buf_tail_;
+    vector<PollState> sock_state_;//indexed by fd
+    vector<SOCKET> rearm_;
+
+    io_uring_sqe* GetSqe();
+    //room for count requests, flushing the ring if it's needed
+    bool Reserve(unsigned count);
+    int Enter(unsigned wait_nr, int timeout);
+    bool InitCompletion();
+    //a poll is needed for what the accept or recv request doesn't cover
+    bool NeedPoll(const PollState& state);
+    void Arm(SOCKET s, PollState& state);
+    void Cancel(SOCKET s, PollState& state);
+    void ArmIo(SOCKET s, PollState& state);
+    void CancelRequest(uint64_t user_data, bool all);
+    //arm or cancel the accept or recv request by kPollIn
+    void UpdateIo(SOCKET s, PollState& state);
+    void ProvideBuffer(unsigned bid);
+    //a completion of an accept, recv or send request, live if its socket
+    //is still the one registered
+    void HandleIo(EventLoop* loop, const io_uring_cqe& cqe, SOCKET s, int op, bool live);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+#include "common.h"
+#include "worker.h"
+
+WorkerStats::WorkerStats():
+    tcp_accepted(0),
+    tcp_active(0),
+    buffers_in_use(0),
+    buffers_high_water(0),
+    udp_sessions(0),
+    udp_created(0),
+    udp_evicted(0)
+{
+    for (int i = 0; i < ReadSizer::kBuckets; i++)
+        reads[i] = 0;
+}
+
+Worker::Worker(Config * config, int id, bool is_local):
+    config_(config),
+    id_(id),
+    is_local_(is_local),
+    event_loop_(NULL),
+    dns_resolver_(NULL),
+    server_selector_(NULL),
+    tcp_server_(NULL),
+    udp_server_(NULL),
+    running_(false),
+    stopped_(false)
+{
+}
+
+Worker::~Worker()
+{
+    Join();
+    if (event_loop_)
+    {
+        event_loop_->RemovePeriodic(this);
+    }
+    if (tcp_server_)
+    {
+        tcp_server_->Close();
+        delete tcp_server_;
+        tcp_server_ = NULL;
+    }
+    if (udp_server_)
+    {
+        delete udp_server_;
+        udp_server_ = NULL;
+    }
+    if (server_selector_)
+    {
+        delete server_selector_;
+        server_selector_ = NULL;
+    }
+    if (dns_resolver_)
+    {
+        dns_resolver_->Close();
+        delete dns_resolver_;
+        dns_resolver_ = NULL;
+    }
+    if (event_loop_)
+    {
+        delete event_loop_;
+        event_loop_ = NULL;
+    }
+}
+
+bool Worker::Init()
+{
+    list<string> dns_servers;
+    dns_servers.push_back("114.114.114.114");
+
+    event_loop_ = new EventLoop(config_);
+    dns_resolver_ = new DNSResolve(dns_servers);
+    if (is_local_)
+        server_selector_ = new ServerSelector(config_, event_loop_, dns_resolver_);
+    tcp_server_ = new TCPRelay(config_, dns_resolver_, server_selector_, is_local_);
+    udp_server_ = new UDPRelay(config_, dns_resolver_, server_selector_, is_local_);
+    dns_resolver_->AddToLoop(event_loop_);
+    if (!tcp_server_->Init() || !udp_server_->Init())
+    {
+        LOGE << "worker " << id_ << " initialize failed\n";
+        return false;
+    }
+    tcp_server_->AddToLoop(event_loop_);
+    udp_server_->AddToLoop(event_loop_);
+    event_loop_->AddPeriodic(this);
+    return true;
+}
+
+void Worker::Start()
+{
+    running_ = true;
+    thread_ = thread(&Worker::Run, this);
+}
+
+void Worker::Stop()
+{
+    stopped_ = true;
+    if (event_loop_)
+        event_loop_->Stop();
+}
+
+void Worker::Join()
+{
+    if (thread_.joinable())
+        thread_.join();
+}
+
+bool Worker::IsRunning()
+{
+    return running_;
+}
+
+void Worker::Run()
+{
+    try
+    {
+        event_loop_->Run();
+        if (!stopped_)
+            LOGE << "worker " << id_ << " error occurred, exit...\n";
+    }
+    catch (const std::exception&)
+    {
+        LOGE << "worker " << id_ << " exception occurred, exit...\n";
+    }
+    Publish();
+    running_ = false;
+}
+
+void Worker::HandlePeriodic()
+{
+    Publish();
+}
+
+void Worker::Publish()
+{
+    //relay counters are plain integers owned by this thread,
+    //only the snapshot is visible to other threads
+    stats_.tcp_accepted.store(tcp_server_->GetAcceptedCount(), memory_order_relaxed);
+    stats_.tcp_active.store(tcp_server_->GetActiveCount(), memory_order_relaxed);
+    BufferPool* pool = event_loop_->GetBufferPool();
+    stats_.buffers_in_use.store(pool->GetInUse(), memory_order_relaxed);
+    stats_.buffers_high_water.store(pool->GetHighWater(), memory_order_relaxed);
+    for (int i = 0; i < ReadSizer::kBuckets; i++)
+        stats_.reads[i].store(tcp_server_->GetReadCount(i), memory_order_relaxed);
+    stats_.udp_sessions.store(udp_server_->GetSessionCount(), memory_order_relaxed);
+    stats_.udp_created.store(udp_server_->GetCreatedCount(), memory_order_relaxed);
+    stats_.udp_evicted.store(udp_server_->GetEvictedCount(), memory_order_relaxed);
+}
+
+void Worker::GetStats(WorkerStats * stats)
+{
+    stats->tcp_accepted += stats_.tcp_accepted.load(memory_order_relaxed);
+    stats->tcp_active += stats_.tcp_active.load(memory_order_relaxed);
+    stats->buffers_in_use += stats_.buffers_in_use.load(memory_order_relaxed);
+    stats->buffers_high_water += stats_.buffers_high_water.load(memory_order_relaxed);
+    for (int i = 0; i < ReadSizer::kBuckets; i++)
+        stats->reads[i] += stats_.reads[i].load(memory_order_relaxed);
+    stats->udp_sessions += stats_.udp_sessions.load(memory_order_relaxed);
+    stats->udp_created += stats_.udp_created.load(memory_order_relaxed);
+    stats->udp_evicted += stats_.udp_evicted.load(memory_order_relaxed);
+}
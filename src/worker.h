@@ -0,0 +1,52 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+//counters published by a worker thread, read by the main thread
+struct WorkerStats
+{
+    atomic<int64_t> tcp_accepted;
+    atomic<int64_t> tcp_active;
+    atomic<int64_t> buffers_in_use;
+    atomic<int64_t> buffers_high_water;
+    atomic<int64_t> reads[ReadSizer::kBuckets];//by ReadSizer::BucketOf
+    atomic<int64_t> udp_sessions;
+    atomic<int64_t> udp_created;
+    atomic<int64_t> udp_evicted;
+
+    WorkerStats();
+};
+
+//a worker owns one event loop and everything that runs on it,
+//so nothing on the relay path is shared between threads
+class Worker : public IPeriodicNotify
+{
+public:
+    Worker(Config* config, int id, bool is_local);
+    ~Worker();
+    bool Init();
+    void Start();
+    //ask the loop to return, from another thread
+    void Stop();
+    void Join();
+    bool IsRunning();
+    void GetStats(WorkerStats* stats);
+    virtual void HandlePeriodic() override;
+private:
+    Config* config_;
+    int id_;
+    bool is_local_;
+    EventLoop* event_loop_;
+    DNSResolve* dns_resolver_;
+    ServerSelector* server_selector_;//client only
+    TCPRelay* tcp_server_;
+    UDPRelay* udp_server_;
+    thread thread_;
+    atomic<bool> running_;
+    atomic<bool> stopped_;//by Stop, not by an error
+    WorkerStats stats_;
+
+    void Run();
+    void Publish();
+};
+
+#endif
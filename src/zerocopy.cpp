@@ -0,0 +1,81 @@
+#include "common.h"
+#include "zerocopy.h"
+
+#ifndef _WIN32
+ZeroCopyLinger::ZeroCopyLinger():
+    event_loop_(NULL),
+    timer_(this)
+{
+}
+
+ZeroCopyLinger::~ZeroCopyLinger()
+{
+    Close();
+}
+
+void ZeroCopyLinger::AddToLoop(EventLoop * event_loop)
+{
+    event_loop_ = event_loop;
+}
+
+void ZeroCopyLinger::Adopt(SOCKET s, StreamBuffer * buffer)
+{
+    Lingering lingering = { new StreamBuffer(), event_loop_->Now() + kLingerTimeout };
+    lingering.buffer->Swap(*buffer);
+    sockets_[s] = lingering;
+    // the peer sees the close as before, only the descriptor waits
+    shutdown(s, SHUT_WR);
+    // only the error queue is watched, completions arrive as errors
+    event_loop_->Add(s, kPollErr, this);
+    if (!timer_.IsActive())
+        event_loop_->AddTimer(&timer_, kLingerTimeout);
+}
+
+void ZeroCopyLinger::HandleEvent(SOCKET s, int event)
+{
+    auto iter = sockets_.find(s);
+    if (iter == sockets_.end())
+        return;
+    iter->second.buffer->ReadCompletions(s);
+    // after a reset the kernel has dropped the data anyway
+    if (!iter->second.buffer->HasPinned() || (event & kPollHup) || GetSocketPendingError(s) != 0)
+        Release(s);
+}
+
+void ZeroCopyLinger::HandleTimeout(Timer * timer)
+{
+    int64_t now = event_loop_->Now();
+    int64_t next = 0;
+    vector<SOCKET> expired;
+    for (auto& iter : sockets_)
+    {
+        if (iter.second.deadline <= now)
+            expired.push_back(iter.first);
+        else if (next == 0 || iter.second.deadline < next)
+            next = iter.second.deadline;
+    }
+    for (auto& s : expired)
+    {
+        LOGW << "zero copy sends not completed in time\n";
+        Release(s);
+    }
+    if (next > 0)
+        event_loop_->AddTimer(&timer_, next - now);
+}
+
+void ZeroCopyLinger::Release(SOCKET s)
+{
+    auto iter = sockets_.find(s);
+    event_loop_->Remove(s);
+    CloseSocket(s);
+    delete iter->second.buffer;
+    sockets_.erase(iter);
+}
+
+void ZeroCopyLinger::Close()
+{
+    timer_.Cancel();
+    while (!sockets_.empty())
+        Release(sockets_.begin()->first);
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef _ZEROCOPY_H_
+#define _ZEROCOPY_H_
+
+#ifndef _WIN32
+//sockets closed by their handlers with zero copy sends in flight. the
+//kernel still reads the pinned chunks, a retransmit would send whatever
+//they hold once reused, so the socket is kept open until the completions
+//have arrived (or the peer is gone, or a timeout) and only then closed
+class ZeroCopyLinger : public ISockNotify, public ITimerNotify
+{
+    const static int kLingerTimeout = 30000;//millisecond
+    struct Lingering
+    {
+        StreamBuffer* buffer;
+        int64_t deadline;
+    };
+public:
+    ZeroCopyLinger();
+    ~ZeroCopyLinger();
+    void AddToLoop(EventLoop* event_loop);
+    //take over s and the chunks of buffer, s must not be in the loop
+    void Adopt(SOCKET s, StreamBuffer* buffer);
+    virtual void HandleEvent(SOCKET s, int event) override;
+    virtual void HandleTimeout(Timer* timer) override;
+    void Close();
+private:
+    EventLoop* event_loop_;
+    map<SOCKET, Lingering> sockets_;
+    Timer timer_;
+
+    void Release(SOCKET s);
+};
+#endif
+
+#endif